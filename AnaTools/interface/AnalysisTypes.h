@@ -1,9 +1,12 @@
 #ifndef ANALYSIS_TYPES
 #define ANALYSIS_TYPES
 
-#include "boost/variant.hpp"
+#include <algorithm>
+#include <unordered_map>
 
 #include "DataFormats/Common/interface/Handle.h"
+#include "DataFormats/Provenance/interface/EventID.h"
+#include "DataFormats/Provenance/interface/ParameterSetID.h"
 
 #include "OSUT3Analysis/Collections/interface/Basicjet.h"
 #include "OSUT3Analysis/Collections/interface/Beamspot.h"
@@ -27,8 +30,12 @@
 #include "OSUT3Analysis/Collections/interface/PileUpInfo.h"
 
 class ValueLookupTree;
+class TH1;
 
-typedef boost::variant<double, string> Leaf;
+namespace edm
+{
+  class TriggerNames;
+}
 
 typedef vector<map<string, vector<pair<bool, bool> > > > FlagMap;
 
@@ -48,25 +55,101 @@ struct Cut
 
 typedef vector<Cut> Cuts;
 
-struct CutCalculatorPayload
+// Configuration of a CutCalculator, which is the same for every event. It is
+// stored once per run, so that the payload for each event need only hold the
+// flags.
+struct CutCalculatorConfiguration
 {
-  FlagMap         cumulativeObjectFlags;
-  FlagMap         individualObjectFlags;
-  bool            cutDecision;         // whether event passes current cut (independant from other cuts)
-  bool            cutsDecision;        // whether event passes all cuts, without trigger
-  bool            eventDecision;       // whether event passes all cuts and the trigger 
-  bool            isValid;
-  bool            triggerDecision;
-  bool            triggerFilterDecision;
   Cuts            cuts;
-  vector<bool>    cumulativeEventFlags;
-  vector<bool>    individualEventFlags;
-  vector<bool>    triggerFlags;
-  vector<bool>    vetoTriggerFlags;
-  vector<bool>    triggerFilterFlags;
+  vector<string>  collections;  // collections with object flags, sorted, indexing the columns of a FlagMatrix
   vector<string>  triggers;
   vector<string>  triggersToVeto;
   vector<string>  triggerFilters;
+  bool            fastSkim;     // whether cuts after the first one an event fails are left unevaluated
+};
+
+// Flags of the objects in each collection for each cut, packed into bits. The
+// flags for a cut take up one row, in which those of the objects in the i-th
+// collection of CutCalculatorConfiguration::collections start at offsets[i].
+struct FlagMatrix
+{
+  vector<unsigned>  offsets;   // the size of a row is appended to these
+  vector<bool>      hasFlags;  // whether there are flags for each collection, indexed by cut * nCollections + collection
+  vector<bool>      flags;     // whether each object passes
+  vector<bool>      isValid;   // whether each flag is valid
+
+  unsigned nCollections () const { return offsets.size () ? offsets.size () - 1 : 0; }
+  unsigned nCuts () const { return nCollections () ? hasFlags.size () / nCollections () : 0; }
+  unsigned size (const unsigned collection) const { return offsets.at (collection + 1) - offsets.at (collection); }
+  bool has (const unsigned cut, const unsigned collection) const { return hasFlags.at (cut * nCollections () + collection); }
+  pair<bool, bool> at (const unsigned cut, const unsigned collection, const unsigned object) const
+  {
+    unsigned bit = cut * offsets.back () + offsets.at (collection) + object;
+    return make_pair (flags.at (bit), isValid.at (bit));
+  }
+};
+
+struct CutCalculatorPayload
+{
+  FlagMatrix               cumulativeObjectFlags;
+  FlagMatrix               individualObjectFlags;
+  vector<string>           collections;         // collections with object flags, sorted, indexing passesAllCuts
+  vector<vector<bool> >    passesAllCuts;       // whether each object passes all cuts
+  bool                     cutDecision;         // whether event passes current cut (independant from other cuts)
+  bool                     cutsDecision;        // whether event passes all cuts, without trigger
+  bool                     eventDecision;       // whether event passes all cuts and the trigger 
+  bool                     isValid;
+  bool                     triggerDecision;
+  bool                     triggerFilterDecision;
+  vector<bool>             cumulativeEventFlags;
+  vector<bool>             individualEventFlags;
+  vector<bool>             triggerFlags;
+  vector<bool>             vetoTriggerFlags;
+  vector<bool>             triggerFilterFlags;
+
+  // Returns whether each object of the named collection passes all cuts, or
+  // NULL if there are no cuts on the collection. The collections are stored by
+  // name, since the ids from anatools::getCollectionId () are only valid
+  // within the job which made them.
+  const vector<bool> *getPassesAllCuts (const string &collection) const
+  {
+    auto i = find (collections.begin (), collections.end (), collection);
+    return (i != collections.end () && (unsigned) (i - collections.begin ()) < passesAllCuts.size () ? &passesAllCuts.at (i - collections.begin ()) : NULL);
+  }
+};
+
+// Trigger paths matching each of a list of patterns, which are looked up again
+// only when the trigger names change. A path matches a pattern if its name
+// starts with it or, if isSubstring is set, contains it anywhere.
+struct TriggerIndex
+{
+  vector<string>             patterns;
+  bool                       isSubstring;
+  edm::ParameterSetID        parameterSetID;  // of the trigger names the paths were found in
+  vector<vector<unsigned> >  paths;           // indices of the paths matching each pattern, in increasing order
+};
+
+// Binning of one axis of a booked histogram, from which the bin of each value
+// and its width are found without going through TAxis. The bins are numbered
+// as in ROOT, with zero for the underflow and nBins + 1 for the overflow.
+struct HistoAxis
+{
+  int             nBins;
+  double          min;
+  double          max;
+  vector<double>  edges;   // bin edges, empty if the bins are uniform
+  vector<double>  widths;  // indexed by bin, the underflow and overflow taking those of the nearest bins
+
+  int findBin (const double x) const
+  {
+    if (x < min)
+      return 0;
+    if (!(x < max))
+      return nBins + 1;
+    if (edges.empty ())
+      return 1 + int (nBins * (x - min) / (max - min));
+    return upper_bound (edges.begin (), edges.end (), x) - edges.begin ();
+  }
 };
 
 struct HistoDef {
@@ -82,6 +165,12 @@ struct HistoDef {
   vector<string> inputVariables;
   vector<ValueLookupTree *> valueLookupTrees;
   int dimensions;
+  TH1 *histogram; // bound when booked, NULL if booking failed
+  HistoAxis axisX;
+  HistoAxis axisY;
+  vector<double> bufferX; // values waiting to be filled, with their weights
+  vector<double> bufferY;
+  vector<double> bufferWeights;
 };
 
 struct Weight
@@ -99,6 +188,66 @@ struct Node
   vector<Node *>  branches;
 };
 
+// Operations understood by the ValueLookupTree interpreter. Each opcode pops
+// its operands off of the evaluation stack and pushes a single result, except
+// for the following, which leave the stack as it is:
+//   Load and Store bracket a subexpression whose value is shared between
+//   trees. Load pushes the stored value and jumps past the matching Store if
+//   the value is already known, and Store records the value on the top of the
+//   stack.
+//   JumpIfFalse and JumpIfTrue skip the right operand of && and ||, leaving
+//   the result on the stack, if the left operand already decides it.
+enum class Opcode : unsigned char
+{
+  Constant, Invalid, Number, Lookup, UservariableLookup, EventvariableLookup, FourVectorLookup, Load, Store, JumpIfFalse, JumpIfTrue,
+  Or, And, Equal, NotEqual, Less, LessEqual, Greater, GreaterEqual,
+  Add, Subtract, Multiply, Divide, Modulo, Positive, Negative, Not,
+  Atan2, Ldexp, Pow, Hypot, Fmod, Remainder, Copysign, Nextafter, Fdim, Fmax, Fmin,
+  Cos, Sin, Tan, Acos, Asin, Atan, Cosh, Sinh, Tanh, Acosh, Asinh, Atanh,
+  Exp, Log, Log10, Exp2, Expm1, Ilogb, Log1p, Log2, Logb, Sqrt, Cbrt,
+  Erf, Erfc, Tgamma, Lgamma, Ceil, Floor, Trunc, Round, Rint, Nearbyint, Fabs,
+  DeltaPhi, DeltaR, InvMass, PT, TrigobjDeltaR
+};
+
+struct Instruction
+{
+  Opcode    opcode;
+  unsigned  nOperands;   // number of values popped off of the stack
+  double    value;       // value pushed by Constant and Number
+  unsigned  slot;        // index into inputCollections of the object to look up
+  string    collection;  // collection name for lookups and Number
+  unsigned  collectionId;  // id of the collection from anatools::getCollectionId (), for lookups and Number
+  string    type;        // C++ type of the collection for lookups
+  string    variable;    // member name for lookups, or filter label for TrigobjDeltaR
+  double    (*accessor) (const void * const);  // direct accessor for lookups, if there is one
+  unsigned  subexpression;  // id of the shared subexpression for Load and Store
+  unsigned  keySlots[2];    // slots of the objects the shared subexpression depends on
+  unsigned  target;         // index of the instruction to jump to, for Load and the jumps
+  bool      isShared;       // whether Load and Store actually use the shared values
+  unsigned  variableSlot;   // slot of the event or user variable for their lookups,
+                            // the component of the four-vector for FourVectorLookup,
+                            // or the index of the filter among those of the tree for TrigobjDeltaR
+};
+
+// Values of one user variable in an event, joined to the objects it was
+// computed from. values is indexed by the sum over those objects of their
+// local index times the stride of their collection.
+struct UservariableColumn
+{
+  vector<string>    collections;  // collection of each object, sorted
+  vector<unsigned>  strides;
+  vector<double>    values;
+};
+
+// Four-vectors of the objects in a collection for the current event, with
+// one array per component, so that the kinematic operators can be computed
+// for many pairs of objects at once.
+struct FourVectors
+{
+  vector<double>  energy, px, py, pz, eta, phi;
+  bool            isRegular;  // whether all values are valid and phi is within [-pi, pi]
+};
+
 struct Collections
 {
   edm::Handle<osu::Beamspot>                beamspots;
@@ -120,11 +269,19 @@ struct Collections
   edm::Handle<vector<osu::PileUpInfo> >     pileupinfos;
   edm::Handle<vector<osu::Trigobj> >        trigobjs;
   vector<edm::Handle<osu::Uservariable> >   uservariables;
+  vector<UservariableColumn>                uservariableColumns;  // indexed by anatools::getUservariableSlot ()
   vector<edm::Handle<osu::Eventvariable> >  eventvariables;
+  vector<double>                            eventvariableValues;  // indexed by anatools::getEventvariableSlot ()
+  unordered_map<string, unsigned>           uservariableSlots;    // slots seen so far, filled by anatools::getUservariableSlot ()
+  unordered_map<string, unsigned>           eventvariableSlots;   // slots seen so far, filled by anatools::getEventvariableSlot ()
 
   edm::Handle<TYPE(triggers)>                 triggers;
+  const edm::TriggerNames                     *triggerNames;  // names of the triggers, if they have any, for unpacking the trigger objects
   edm::Handle<TYPE(prescales)>                prescales;
   edm::Handle<TYPE(generatorweights)>         generatorweights;
+
+  edm::EventID                                eventID;  // event from which the handles were retrieved
+  unsigned                                    stream;   // stream in which that event is being processed
 };
 
 struct ValueToPrint
@@ -137,11 +294,4 @@ struct ValueToPrint
 
 typedef vector<ValueToPrint> ValuesToPrint;
 
-struct DressedObject
-{
-  unsigned collectionIndex;
-  unsigned localIndex;
-  void *addr;
-};
-
 #endif
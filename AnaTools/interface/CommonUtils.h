@@ -8,15 +8,27 @@
 #define COMMON_UTILS
 
 #include <iostream>
+#include <mutex>
+#include <unordered_map>
 #include <unordered_set>
 #include <typeinfo>
 
+#include "CommonTools/UtilAlgos/interface/TFileService.h"
+#include "FWCore/Common/interface/TriggerNames.h"
 #include "FWCore/Framework/interface/Event.h"
+#include "FWCore/Framework/interface/stream/EDAnalyzer.h"
+#include "FWCore/ServiceRegistry/interface/Service.h"
 
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
 
 #include "OSUT3Analysis/AnaTools/interface/AnalysisTypes.h"
 
+#ifndef ROOT6
+  #include "Reflex/Member.h"
+  #include "Reflex/Object.h"
+  #include "Reflex/Type.h"
+#endif
+
 namespace anatools
 {
   template <class T> bool getCollection (const edm::InputTag& label, edm::Handle<T>& collection, const edm::Event& event, bool verbose = true);
@@ -45,7 +57,7 @@ namespace anatools
   string getObjectType (const osu::Genjet &);
   string getObjectClass (const osu::Genjet &);
 #endif
-#if IS_VALID(basicjets)
+#if IS_VALID(basicjets) && DATA_FORMAT == AOD
   string getObjectType  (const osu::Basicjet &);
   string getObjectClass (const osu::Basicjet &);
 #endif
@@ -133,18 +145,102 @@ namespace anatools
   // Removes whitespace from both sides of a string.
   string &trim (string &);
 
+  // Returns the index of the named event variable in
+  // Collections::eventvariableValues, giving it one if it is new. The second
+  // form remembers the slot in the given handles, so that it only has to be
+  // looked up in the process-wide table once.
+  unsigned getEventvariableSlot (const string &);
+  unsigned getEventvariableSlot (const string &, Collections &);
+
+  // Returns the index of the named user variable in
+  // Collections::uservariableColumns, giving it one if it is new. The second
+  // form works as for event variables.
+  unsigned getUservariableSlot (const string &);
+  unsigned getUservariableSlot (const string &, Collections &);
+  unsigned getSlot (unordered_map<string, unsigned> &, const string &);
+
+  ////////////////////////////////////////////////////////////////////////////////
+  // Registry of the collections which can be used in expressions. A name is
+  // resolved once into an id, the index of its entry, whose functions then
+  // act directly on the corresponding member of Collections.
+  ////////////////////////////////////////////////////////////////////////////////
+  struct CollectionEntry
+  {
+    string    name;  // e.g., "muons"
+    string    type;  // C++ type of the objects, e.g., "osu::Muon"
+    bool      (*isFound) (const Collections &);
+    unsigned  (*getSize) (const Collections &);
+    void      (*getObjects) (const Collections &, vector<void *> &);
+    void      (*getHashes) (const Collections &, vector<int> &);  // adds nothing for objects without getObjectClass, NULL for the user and event variables
+    void      (*retrieve) (const edm::InputTag &, Collections &, const edm::Event &);  // NULL for the user and event variables
+  };
+
+  const vector<CollectionEntry> &getCollectionRegistry ();
+  unsigned getCollectionId (const string &);
+  ////////////////////////////////////////////////////////////////////////////////
+
+  // Finds the trigger paths matching the patterns of a TriggerIndex if the
+  // trigger names have changed, returning whether they had.
+  bool updateTriggerIndex (TriggerIndex &, const edm::TriggerNames &);
+
   ////////////////////////////////////////////////////////////////////////////////
-  // Comparison functions for sorting.
+  // Histograms of a module which runs in several streams. Each stream books and
+  // fills its own copies, which it hands over to the global cache of the module
+  // when it ends, and these are added together in order of stream at the end of
+  // the job and written to the directory of the module. The copies are booked
+  // with a TH1AddDirectorySentry turning TH1::AddDirectory off, so that they are
+  // kept out of any directory until they are added together. The directory of
+  // the module is taken from TFileService when the global cache is made, since
+  // the module is being constructed then, so TFileService is in its directory.
   ////////////////////////////////////////////////////////////////////////////////
-  bool firstOfTupleAscending (tuple<size_t, size_t, string>, tuple<size_t, size_t, string>);
-  bool firstOfTupleDescending (tuple<size_t, size_t, string>, tuple<size_t, size_t, string>);
-  bool collectionIndexAscending (pair<string, DressedObject>, pair<string, DressedObject>);
+  struct StreamHistograms
+  {
+    StreamHistograms () : directory (*edm::Service<TFileService> ()) {}
+
+    mutable TFileDirectory          directory;       // of the module in the output file
+    mutable mutex                   streamMutex;
+    mutable vector<string>          subdirectories;  // of each histogram within directory, empty for directory itself
+    mutable vector<vector<TH1 *> >  histograms;      // copies of each histogram, indexed by stream
+  };
+
+  void storeStreamHistograms (const StreamHistograms &, const unsigned, const vector<TH1 *> &, const vector<string> & = vector<string> ());
+  vector<TH1 *> writeStreamHistograms (const StreamHistograms &);
+
+  // Base of the modules filling StreamHistograms, whose global cache is Cache.
+  // When its stream ends, the histograms of the stream are taken from
+  // Module::releaseStreamHistograms, in the same order in every stream, along
+  // with their subdirectories, if any, and handed over to the global cache.
+  template <class Module, class Cache = StreamHistograms> class StreamHistogramAnalyzer : public edm::stream::EDAnalyzer<edm::GlobalCache<Cache> >
+  {
+    public:
+      StreamHistogramAnalyzer () : stream_ (0) {}
+
+      void beginStream (edm::StreamID streamID) { stream_ = streamID.value (); }
+      void endStream ();
+
+      static std::unique_ptr<Cache> initializeGlobalCache (const edm::ParameterSet &) { return std::unique_ptr<Cache> (new Cache); }
+      static void globalEndJob (const Cache *cache) { writeStreamHistograms (*cache); }
+
+    private:
+      unsigned stream_;
+  };
   ////////////////////////////////////////////////////////////////////////////////
 
   // Retrieves all the collections from the event which are needed based on the
   // first argument.
   void getRequiredCollections (const unordered_set<string> &, const edm::ParameterSet &, Collections &, const edm::Event &);
 
+  // Joins the user variables to the objects they were computed from, filling
+  // Collections::uservariableColumns.
+  void indexUservariables (Collections &);
+
+  // Returns the indices of the trigger objects passing each filter in the
+  // current event, keyed by filter label, building them once per event.
+  const unordered_map<string, vector<unsigned> > &getTrigobjFilterIndex (const Collections &);
+
+  // Returns the hash of each object in the named collection.
+  vector<int> getObjectHashes (const string &, const Collections &);
+
   double getMember (const string &type, const void * const obj, const string &member);
 
   template <class T> double getMember (const T &obj, const string &member);
@@ -152,8 +248,38 @@ namespace anatools
 #ifdef ROOT6
   template<class T> T invoke (const string &, edm::ObjectWithDict * const, const edm::FunctionWithDict &);
 #else
-  const Reflex::Object * const getMember (const Reflex::Type &t, const Reflex::Object &o, const string &member, string &memberType);
-  const Reflex::Object * const invoke (const string &returnType, const Reflex::Object &o, const string &member);
+  ////////////////////////////////////////////////////////////////////////////////
+  // A member access is resolved through the Reflex dictionaries only once for
+  // each (type, member) pair, into a chain of steps leading from the object to
+  // the member, and then cached. Later calls to getMember just follow the
+  // steps.
+  ////////////////////////////////////////////////////////////////////////////////
+  struct MemberStep
+  {
+    enum Kind { Dereference, BaseClass, DataMember, FunctionMember } kind;
+    Reflex::Type    type;         // type of the object this step acts on
+    Reflex::Type    baseType;     // target type of BaseClass steps
+    Reflex::Member  member;       // member used by DataMember and FunctionMember steps
+    Reflex::Object  returnValue;  // storage for what FunctionMember steps return
+  };
+
+  struct MemberAccessor
+  {
+    MemberAccessor () : isValid (false), hasWarned (false), convert (NULL) {}
+    MemberAccessor (const MemberAccessor &) = delete;
+    ~MemberAccessor ();  // destructs the storage for what the FunctionMember steps return
+
+    bool                isValid;    // false if the member could not be resolved
+    bool                hasWarned;  // whether a failed access has already been reported
+    vector<MemberStep>  steps;
+    double              (*convert) (const void * const);
+  };
+
+  void truncateMemberSteps (vector<MemberStep> &, const size_t);
+
+  MemberAccessor &getMemberAccessor (const string &type, const string &member);
+  bool resolveMember (const Reflex::Type &t, const string &member, vector<MemberStep> &steps, string &memberType);
+  ////////////////////////////////////////////////////////////////////////////////
 #endif
 
   double getGeneratorWeight (const TYPE(generatorweights) &);
@@ -238,4 +364,19 @@ anatools::getObjectHash(const T& object){
     return px_mev + py_mev + pz_mev;
 }
 
+/**
+ * Hands the histograms of this stream over to the global cache of the module.
+ *
+ * The module gives up the histograms it returns from releaseStreamHistograms,
+ * which from then on belong to the global cache.
+ */
+template <class Module, class Cache> void
+anatools::StreamHistogramAnalyzer<Module, Cache>::endStream ()
+{
+  vector<TH1 *> histograms;
+  vector<string> subdirectories;
+  static_cast<Module *> (this)->releaseStreamHistograms (histograms, subdirectories);
+  storeStreamHistograms (*this->globalCache (), stream_, histograms, subdirectories);
+}
+
 #endif
@@ -45,6 +45,8 @@
 // Return whether obj is contained in vec.
 #define VEC_CONTAINS(vec, obj) (find (vec.begin (), vec.end (), obj) != vec.end ())
 
+#include <cassert>
+#include <cstring>
 #include <map>
 #include <string>
 #include <vector>
@@ -0,0 +1,27 @@
+// Table of direct C++ accessors for the members used most often in cut and
+// histogram expressions. Looking a member up in this table avoids going
+// through the ROOT dictionaries at all; anything not in the table still falls
+// back to anatools::getMember.
+
+#ifndef MEMBER_TABLE
+#define MEMBER_TABLE
+
+#include <string>
+
+#include "OSUT3Analysis/AnaTools/interface/DataFormat.h"
+
+namespace anatools
+{
+  // Returns the value of one member of an object, given a pointer to it.
+  typedef double (*DirectAccessor) (const void * const);
+
+  // Returns the direct accessor for the given member of the given type, e.g.,
+  // ("osu::Muon", "pt"), or NULL if there is none in the table.
+  DirectAccessor getDirectAccessor (const string &type, const string &member);
+
+  // Returns the C++ text of the same member access, e.g., "pt ()", to be
+  // applied to a pointer to the object, or an empty string if there is none.
+  string getDirectExpression (const string &type, const string &member);
+}
+
+#endif
@@ -108,23 +108,15 @@ template<class T, class TO> bool
   plO_ = auto_ptr<vector<TO> > (new vector<TO> ());
   if (collection.isValid () && collectionOrig.isValid())
     {
+      const vector<bool> *passesAllCuts = (cutDecisions.isValid () ? cutDecisions->getPassesAllCuts (collectionToFilter_) : NULL);
       auto objOrig = collectionOrig->begin();  
       for (auto object = collection->begin (); object != collection->end (); object++, objOrig++)
         {
           unsigned iObject = object - collection->begin ();
           bool passes = true;
 
-          if (cutDecisions.isValid ())
-            {
-              for (int iCut = cutDecisions->cumulativeObjectFlags.size () - 1; iCut >= 0; iCut--)
-                {
-                  if (cutDecisions->cumulativeObjectFlags.at (iCut).at (collectionToFilter_).at (iObject).second)
-                    {
-                      passes = cutDecisions->cumulativeObjectFlags.at (iCut).at (collectionToFilter_).at (iObject).first;
-                      break;
-                    }
-                }
-            }
+          if (passesAllCuts && iObject < passesAllCuts->size ())
+            passes = passesAllCuts->at (iObject);
           if (passes)
             {
               pl_ ->push_back (*object);
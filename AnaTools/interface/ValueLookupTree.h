@@ -81,9 +81,95 @@ This will be converted to the following, by the prunedCommas() and prunedParenth
           /   \
        muon   muon
 
+Once pruned, the tree is compiled into a flat program of instructions which is
+run by a simple stack machine for each combination of objects. The tree above
+becomes, with each muon reference bound to its own copy of the muon collection:
+    FourVectorLookup muons[0].energy
+    FourVectorLookup muons[0].px
+    FourVectorLookup muons[0].py
+    FourVectorLookup muons[0].pz
+    FourVectorLookup muons[1].energy
+    ...
+    InvMass (8 operands)
+    Constant 0
+    Less (2 operands)
+All string comparisons, and the resolution of which input collection each
+variable belongs to, are done once during compilation rather than for every
+object in every event. Operators whose operands are all constants, e.g.,
+"2 * 3.1416", are folded into a single constant during compilation, and the
+right operand of && and || is jumped over when the left operand already
+decides the result:
+    Lookup muons[0].isGlobalMuon
+    JumpIfFalse (to the end)
+    Lookup muons[0].pt
+    Constant 20
+    Greater (2 operands)
+    And (2 operands)
+
+Subexpressions which are worth reusing, e.g., the d0 calculation
+"abs((-(muon.vx - beamspot.x0)*muon.py + (muon.vy - beamspot.y0)*muon.px)/muon.pt)",
+are registered under a canonical text in which each collection reference is
+numbered by order of appearance rather than by slot, so that identical
+subexpressions in different trees get the same id. Their instructions are
+bracketed by Load and Store, and their values are kept for the rest of the
+event in a store shared by all trees, keyed by the id and the addresses of
+the objects involved. A subexpression only uses the store if it appears more
+than once among all the trees, or if its objects repeat across the
+combinations of its own tree. Lookups which have to go through the
+dictionaries always use it.
+
+Expressions over a single input collection whose lookups all have direct
+accessors are evaluated for the whole collection at once: each stack entry
+becomes a column with one value per object, so that each operator is a single
+loop over contiguous arrays, which the compiler vectorizes.
+
+The kinematic operators, deltaPhi, deltaR, invMass, and pT, read the
+four-vectors of their objects from a cache holding, for each collection used
+in the event, one array per component. It is filled once per event, and
+shared by all the trees. An expression which is nothing but one of these
+operators of two objects, e.g., "deltaR(muon,jet)", is evaluated for all the
+pairs at once by loops over these arrays.
+
+Objects are matched to trigger objects with trigobjDeltaR, e.g.,
+"trigobjDeltaR(muon, hltL3fL1sMu16L1f0L2f10QL3Filtered20Q) < 0.1", which gives
+the distance to the closest trigger object passing the named filter. The
+trigger objects passing each filter are found once per event by
+anatools::getTrigobjFilterIndex (), so only these are compared with each
+object, and the trigger objects need not be an input collection.
+
+Expressions are tokenized and parsed in a single pass. The pruned tree and the
+compiled program of each expression are kept in a cache shared by the whole
+process, keyed by the expression and the input collections, so an expression
+used by several modules or channels is only parsed and compiled once.
+
+Since the expressions of a configuration rarely change, they can also be
+compiled ahead of time. Setting the untracked parameter generatedCode of any
+CutCalculator or Plotter to a file name makes the job write that file once,
+when the last module asking for it has finished, with a C++ function for each
+expression of the job which only depends on members with direct accessors. To
+use these functions in later jobs:
+
+  1. copy the file into the src directory of a package of its own, e.g.,
+     MyAnalysis/PrecompiledExpressions/src/PrecompiledExpressions.cc,
+  2. give the package a BuildFile.xml which uses OSUT3Analysis/AnaTools and
+     DataFormats/Math and exports its library,
+  3. build it with scram b, which makes libMyAnalysisPrecompiledExpressions.so,
+  4. set the untracked parameter precompiledCode of the CutCalculators and
+     Plotters to the name of that library.
+
+The library is loaded with dlopen () when the first of these modules is
+constructed, at which point its functions register themselves and are used
+instead of the interpreter. A warning is printed if it cannot be loaded, in
+which case every expression is interpreted as usual. The file has to be
+generated again whenever the expressions or the input collections change, or
+the functions for the old expressions are simply never used.
+
 */
 
-typedef unordered_multimap<string, DressedObject> ObjMap;
+// Stores of the values and four-vectors shared by the trees of a stream,
+// defined in ValueLookupTree.cc.
+struct ValueStore;
+struct FourVectorStore;
 
 class ValueLookupTree
 {
@@ -112,25 +198,43 @@ class ValueLookupTree
     // Methods for inserting an expression into the tree and for evaluating the
     // expression.  The evaluate() function returns values for each of the 
     // objects in the event; that is why it returns a vector.  
-    // FIXME:  Check whether evaluate() should return vector<Leaf> or vector<double>.
     ////////////////////////////////////////////////////////////////////////////
     void insert (const string &);
-    const vector<Leaf> &evaluate ();
+    const vector<double> &evaluate ();
     ////////////////////////////////////////////////////////////////////////////
 
     ////////////////////////////////////////////////////////////////////////////
     // Methods for retrieving various information about a collection.
     ////////////////////////////////////////////////////////////////////////////
     unsigned getLocalIndex (unsigned globalIndex, unsigned collectionIndex) const;
-    set<unsigned> getGlobalIndices (unsigned localIndex, const string &singleObjectCollection, string inputLabel) const;
+    const vector<vector<unsigned> > &getGlobalIndices (const string &singleObjectCollection, const string &inputLabel);
     unsigned getCollectionSize (const string &name) const;
     bool collectionIsFound (const string &name) const;
     ////////////////////////////////////////////////////////////////////////////
 
-  private:
-    // Method for destroying an entire tree, including all of its children.
-    void destroy (Node * const) const;
+    // Returns every collection which an expression reads when it is evaluated
+    // on the given input collections, so that modules know what to get from
+    // the event before any tree is built.
+    static vector<string> getRequiredCollections (const string &, vector<string>);
+
+    ////////////////////////////////////////////////////////////////////////////
+    // Methods for expressions compiled ahead of time. Every module asking for
+    // generated code calls requestCode() when it is constructed and
+    // releaseCode() when it has finished, and the last one to finish writes a
+    // C++ source file with a function for every expression in the process.
+    // Once that file is compiled into a library, loadPrecompiled() loads it,
+    // its functions are registered with registerPrecompiled(), and they are
+    // used instead of the interpreter for the same expression and input
+    // collections.
+    ////////////////////////////////////////////////////////////////////////////
+    typedef double (*Precompiled) (const void * const * const);
+    static bool registerPrecompiled (const string &, vector<string>, Precompiled);
+    static bool loadPrecompiled (const string &);
+    static void requestCode (const string &);
+    static void releaseCode (const string &);
+    ////////////////////////////////////////////////////////////////////////////
 
+  private:
     ////////////////////////////////////////////////////////////////////////////
     // Methods for removing commas and parentheses from a tree.
     ////////////////////////////////////////////////////////////////////////////
@@ -142,11 +246,35 @@ class ValueLookupTree
     ////////////////////////////////////////////////////////////////////////////
 
     ////////////////////////////////////////////////////////////////////////////
-    // Recursive methods for inserting an expression into the tree and then
-    // evaluating it.
+    // Methods for compiling the pruned tree into a flat program and for
+    // running that program on a single combination of objects, on all the
+    // objects of a single input collection at once, or, for a lone kinematic
+    // operator, on all the pairs of objects from two collections at once.
     ////////////////////////////////////////////////////////////////////////////
-    Node *insert_ (const string &, Node * const) const;
-    Leaf evaluate_ (const Node * const, const ObjMap &);
+    void compile ();
+    void compile_ (const Node * const, map<string, unsigned> &);
+    void compileNode (const Node * const, map<string, unsigned> &);
+    void emit (const Opcode, const unsigned nOperands = 0, const double value = 0.0);
+    unsigned emitJump (const Opcode);
+    void fold (const unsigned begin);
+    void emitLookup (const string &collection, const string &variable, const unsigned slot);
+    unsigned getSlot (const string &collection, map<string, unsigned> &references) const;
+    double execute (const vector<void *> &);
+    void executeBatch (const vector<void *> &);
+    bool executePairwise ();
+    static void generateCode (const string &);
+    static bool generateFunction (const vector<Instruction> &, const unsigned, const string &, ostream &);
+    ////////////////////////////////////////////////////////////////////////////
+
+    ////////////////////////////////////////////////////////////////////////////
+    // Methods for sharing the values of subexpressions between trees. share()
+    // brackets the candidate subexpressions of program_ with Load and Store,
+    // link() decides which of them actually use the shared values, and
+    // release() gives up the subexpressions registered by this tree.
+    ////////////////////////////////////////////////////////////////////////////
+    void share ();
+    void link ();
+    void release ();
     ////////////////////////////////////////////////////////////////////////////
 
     // Mainly for debugging:
@@ -154,13 +282,24 @@ class ValueLookupTree
     string printValue(Node* node) const;
 
     // Returns the result of an operator acting on its operands.
-    Leaf evaluateOperator (const string &op, const vector<Leaf> &operands, const ObjMap &objs);
+    double evaluateOperator (const Opcode op, const double * const operands, const unsigned nOperands) const;
+
+    ////////////////////////////////////////////////////////////////////////////
+    // Methods for enumerating the unique combinations of objects, in which the
+    // local indices increase from one copy of a collection to the next.
+    ////////////////////////////////////////////////////////////////////////////
+    bool resetCombination (const unsigned collectionIndex);
+    bool nextCombination ();
+    ////////////////////////////////////////////////////////////////////////////
 
     ////////////////////////////////////////////////////////////////////////////
-    // Methods for retrieving and deleting an object from a collection.
-    // i is the local index
+    // Methods for retrieving the addresses of all the objects in a collection,
+    // and its size or whether it was found, from the id given to its name by
+    // anatools::getCollectionId ().
     ////////////////////////////////////////////////////////////////////////////
-    void *getObject (const string &name, const unsigned i);
+    void getObjects (const unsigned id, vector<void *> &objects);
+    unsigned getCollectionSize (const unsigned id) const;
+    bool collectionIsFound (const unsigned id) const;
     ////////////////////////////////////////////////////////////////////////////
 
     // Returns the C++ type associated with the collection named in the first
@@ -176,54 +315,52 @@ class ValueLookupTree
     bool isnumber (const string &, double &) const;
     ////////////////////////////////////////////////////////////////////////////
 
-    // Method which returns true if the parentheses are not balanced, i.e., if
-    // the number of left parentheses does not equal the number of right
-    // parentheses.
-    bool splitParentheses (string) const;
-
-    ////////////////////////////////////////////////////////////////////////////
-    // Methods for finding the first instance within a string of any one of a
-    // vector of target strings.
-    ////////////////////////////////////////////////////////////////////////////
-    pair<size_t, string> findFirstOf (const string &s, const vector<string> &targets, const vector<string> &vetoTargets, const size_t pos = 0) const;
-    pair<size_t, string> findLastOf (const string &s, const vector<string> &targets, const vector<string> &vetoTargets, const size_t pos = string::npos) const;
-    bool vetoMatch (const string &, const string &, const size_t, const vector<string> &) const;
-    ////////////////////////////////////////////////////////////////////////////
-
-    // To avoid double counting. For a given set of objects, returns true only
-    // if they are all unique and in a specific order.
-    bool isUniqueCase (const ObjMap &, const unordered_set<string> &) const;
-
-    ////////////////////////////////////////////////////////////////////////////
-    // Methods for inserting different types of operators into the tree.
-    ////////////////////////////////////////////////////////////////////////////
-    bool insertBinaryInfixOperator (const string &, Node * const, const vector<string> &, const vector<string> & = {}) const;
-    bool insertUnaryPrefixOperator (const string &, Node * const, const vector<string> &, const vector<string> & = {}) const;
-    bool insertDots (const string &, Node * const) const;
-    bool insertParentheses (const string &, Node * const) const;
-    ////////////////////////////////////////////////////////////////////////////
-
     ////////////////////////////////////////////////////////////////////////////
     // Methods for retrieving values from objects.
     ////////////////////////////////////////////////////////////////////////////
-    double valueLookup (const string &collection, const ObjMap &objs, const string &variable, const bool iterateObj = true);
+    double valueLookup (const Instruction &, const vector<void *> &) const;
+    double trigobjDeltaR (const unsigned filter, const double eta, const double phi) const;
     ////////////////////////////////////////////////////////////////////////////
 
-    Node            *root_;
+    Node            *root_;  // owned by the cache of parsed expressions
     vector<string>  inputCollections_;
     bool            evaluationError_;
 
     Collections                                    *handles_;
-    unordered_map<string, ObjMap::const_iterator>  objIterators_;  // defined for each collection
-    unordered_map<string, bool>                    shouldIterate_; // defined for each collection 
-    vector<Leaf>                                   values_;
+    vector<Instruction>                            program_;
+    vector<double>                                 stack_;   // sized for the deepest point of program_
+    unsigned                                       depth_;   // used while compiling
+    vector<pair<unsigned, unsigned> >              subexpressions_;  // [begin, end) in program_ of each compiled node
+    vector<unsigned>                               sharedIds_;       // ids registered by share ()
+    unsigned                                       linkedGeneration_;
+    bool                                           batchable_;       // whether evaluate () can use executeBatch ()
+    bool                                           pairwise_;        // whether evaluate () can use executePairwise ()
+    ValueStore                                     *valueStore_;       // of the stream of handles_
+    FourVectorStore                                *fourVectorStore_;  // of the stream of handles_
+    vector<const FourVectors *>                    fourVectors_;     // four-vectors of each input collection used by FourVectorLookup
+    vector<double>                                 columns_;         // stack of columns used by executeBatch ()
+    Precompiled                                    precompiled_;     // used instead of program_ if not NULL
+    vector<double>                                 values_;
     vector<unsigned>                               collectionSizes_; // vector index corresponds to collection index
     vector<unsigned>                               nCombinations_;   // vector index corresponds to collection index
+    map<pair<string, string>, vector<vector<unsigned> > >  globalIndices_;  // filled on demand by getGlobalIndices ()
+    vector<void *>                                 trigobjs_;           // trigger objects for trigobjDeltaR ()
+    const FourVectors                              *trigobjFourVectors_;  // their four-vectors, or NULL if they were not found
+    vector<const vector<unsigned> *>               trigobjFilters_;     // indices of those which passed each filter of trigobjDeltaR ()
     // nCombinations[i] specifies the number of combinations that can be formed from objects 
     // in collections i to N, where N is the number of collections 
 
-    vector<void *> uservariablesToDelete_;
-    vector<void *> eventvariablesToDelete_;
+    ////////////////////////////////////////////////////////////////////////////
+    // Bookkeeping for iterating over combinations of objects without any
+    // allocation or hashing. The vector index corresponds to collection index.
+    ////////////////////////////////////////////////////////////////////////////
+    vector<vector<void *> >                        objects_;        // objects in each collection for the current event
+    vector<unsigned>                               previousCopy_;   // index of the previous copy of the same collection
+    vector<unsigned>                               collectionIds_;  // ids from anatools::getCollectionId ()
+    vector<unsigned>                               localIndices_;   // local indices of the current combination
+    vector<void *>                                 combination_;    // objects of the current combination
+    ////////////////////////////////////////////////////////////////////////////
+
 
     const int                                      verbose_ = 0;  // verbosity levels:  0, 1, ... 
     // Typically you want to use verbosity of 1 when running over a single event.  
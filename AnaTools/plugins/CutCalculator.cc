@@ -1,5 +1,8 @@
 #include <algorithm>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <mutex>
 #include <set>
 #include <unordered_map>
 
@@ -11,13 +14,75 @@
 
 #define EXIT_CODE 1
 
+namespace
+{
+  //////////////////////////////////////////////////////////////////////////////
+  // Every prefix of the list of cuts of each CutCalculator in the process is
+  // registered under a text which identifies its cuts and the products they
+  // are evaluated on, so that channels whose cuts start the same way get the
+  // same ids. prefixUsers counts the CutCalculators using each prefix. Both
+  // are only used while holding prefixLock.
+  //////////////////////////////////////////////////////////////////////////////
+  mutex                            prefixLock;
+  unordered_map<string, unsigned>  prefixIds;
+  vector<unsigned>                 prefixUsers;
+  //////////////////////////////////////////////////////////////////////////////
+
+  //////////////////////////////////////////////////////////////////////////////
+  // Flags for the current event after the cuts of each prefix shared by
+  // several CutCalculators, keyed by the id of the prefix, so that the first
+  // CutCalculator to evaluate a prefix saves the others from doing it again.
+  // Each stream keeps its own store, which is emptied whenever a CutCalculator
+  // is given a different event from that stream. CutCalculators of different
+  // channels may run for the same event on different threads, so the stores
+  // are only used while holding cutStateLock.
+  //////////////////////////////////////////////////////////////////////////////
+  struct CutState
+  {
+    FlagMap       cumulativeObjectFlags;
+    FlagMap       individualObjectFlags;
+    vector<bool>  cumulativeEventFlags;
+    vector<bool>  individualEventFlags;
+    bool          cutsDecision;
+  };
+
+  struct CutStateStore
+  {
+    edm::EventID                          eventID;
+    unordered_map<unsigned, CutState>     states;
+  };
+
+  mutex                                   cutStateLock;
+  unordered_map<unsigned, CutStateStore>  cutStateStores;
+  //////////////////////////////////////////////////////////////////////////////
+}
+
 CutCalculator::CutCalculator (const edm::ParameterSet &cfg) :
-  collections_  (cfg.getParameter<edm::ParameterSet>  ("collections")),
-  cuts_         (cfg.getParameter<edm::ParameterSet>  ("cuts")),
-  firstEvent_   (true)
+  collections_    (cfg.getParameter<edm::ParameterSet>  ("collections")),
+  cuts_           (cfg.getParameter<edm::ParameterSet>  ("cuts")),
+  generatedCode_  (cfg.getUntrackedParameter<string>  ("generatedCode", "")),
+  fastSkim_       (cuts_.exists ("fastSkim") && cuts_.getParameter<bool> ("fastSkim")),
+  cutOrderWarmUp_ (cuts_.exists ("cutOrderWarmUp") ? cuts_.getParameter<unsigned> ("cutOrderWarmUp") : 0),
+  moduleLabel_    (cfg.getParameter<string> ("@module_label")),
+  firstEvent_     (true),
+  nWarmUpEvents_  (0),
+  sw_             (new TStopwatch)
 {
   assert (strcmp (PROJECT_VERSION, SUPPORTED_VERSION) == 0);
 
+  // Run one at a time with the legacy modules, as before this was made a one
+  // module, since not all of the code used by the cuts is thread-safe.
+  usesResource ();
+
+  //////////////////////////////////////////////////////////////////////////////
+  // Load the expressions compiled ahead of time, if any, before any tree is
+  // built, and ask for the code of the expressions used in this job, if
+  // requested, so that later jobs can use them precompiled.
+  //////////////////////////////////////////////////////////////////////////////
+  ValueLookupTree::loadPrecompiled (cfg.getUntrackedParameter<string> ("precompiledCode", ""));
+  ValueLookupTree::requestCode (generatedCode_);
+  //////////////////////////////////////////////////////////////////////////////
+
   //////////////////////////////////////////////////////////////////////////////
   // Try to unpack the cuts ParameterSet and quit if there is a problem.
   //////////////////////////////////////////////////////////////////////////////
@@ -28,12 +93,18 @@ CutCalculator::CutCalculator (const edm::ParameterSet &cfg) :
     }
   //////////////////////////////////////////////////////////////////////////////
 
+  registerPrefixes ();
+
+  cutTimes_.assign (unpackedCuts_.size (), 0.0);
+  cutEvaluations_.assign (unpackedCuts_.size (), 0);
+  cutPasses_.assign (unpackedCuts_.size (), 0);
+
   produces<CutCalculatorPayload> ("cutDecisions");
+  produces<CutCalculatorConfiguration, edm::InRun> ("cutDecisions");
 }
 
 CutCalculator::~CutCalculator ()
 {
-
    for (auto &cut : unpackedCuts_)
      {
        if (cut.valueLookupTree)
@@ -41,6 +112,25 @@ CutCalculator::~CutCalculator ()
        if (cut.arbitrationTree)
          delete cut.arbitrationTree;
      }
+   delete sw_;
+}
+
+void
+CutCalculator::beginRunProduce (edm::Run &run, const edm::EventSetup &setup)
+{
+  //////////////////////////////////////////////////////////////////////////////
+  // Store the cuts and triggers in the run, with the same label as the cut
+  // decisions, so that they are not copied into the payload for every event.
+  //////////////////////////////////////////////////////////////////////////////
+  auto_ptr<CutCalculatorConfiguration> configuration (new CutCalculatorConfiguration);
+  configuration->cuts = unpackedCuts_;
+  configuration->collections = unpackedCollections_;
+  configuration->triggers = unpackedTriggers_;
+  configuration->triggersToVeto = unpackedTriggersToVeto_;
+  configuration->triggerFilters = unpackedTriggerFilters_;
+  configuration->fastSkim = fastSkim_;
+  run.put (configuration, "cutDecisions");
+  //////////////////////////////////////////////////////////////////////////////
 }
 
 void
@@ -65,17 +155,53 @@ CutCalculator::produce (edm::Event &event, const edm::EventSetup &setup)
   //////////////////////////////////////////////////////////////////////////////
   pl_ = auto_ptr<CutCalculatorPayload> (new CutCalculatorPayload);
   pl_->isValid = true;
-  pl_->cuts = unpackedCuts_;
-  pl_->triggers = unpackedTriggers_;
-  pl_->triggersToVeto = unpackedTriggersToVeto_;
-  pl_->triggerFilters = unpackedTriggerFilters_;
+  cumulativeObjectFlags_.clear ();
+  individualObjectFlags_.clear ();
   //////////////////////////////////////////////////////////////////////////////
 
+  // Decide whether the event passes the triggers specified by the user and
+  // store the decision in the payload.
+  evaluateTriggers (event);
+  evaluateTriggerFilters ();
+  pl_->cutsDecision = true;
+
+  //////////////////////////////////////////////////////////////////////////////
   // Loop over cuts to set flags for each object indicating whether it passed
-  // the cut.
-  for (unsigned currentCutIndex = 0; pl_->isValid && currentCutIndex != pl_->cuts.size (); currentCutIndex++)
+  // the cut, and then the flags for the event, starting after the last cut
+  // whose flags another channel has already set. In fast-skim mode, stop as soon
+  // as the event has failed the triggers or any cut, since the event decision
+  // can no longer change. The flags for the cuts which were evaluated are the
+  // same as without fast-skim mode, but there are none for the remaining cuts.
+  // During the warm-up events, every cut is evaluated and timed instead.
+  //////////////////////////////////////////////////////////////////////////////
+  bool isWarmUp = (nWarmUpEvents_ < cutOrderWarmUp_),
+       fastSkim = (fastSkim_ && !isWarmUp);
+  bool skip = fastSkim && !(pl_->triggerDecision && pl_->triggerFilterDecision);
+  unsigned firstCutIndex = skip ? 0 : loadSharedState (event.id ());
+  skip = skip || (fastSkim && !pl_->cutsDecision);
+
+  //////////////////////////////////////////////////////////////////////////////
+  // In fast-skim mode, first try to reject the event with the cuts which
+  // rejected the most events for their cost during the warm-up. An event which
+  // fails one of these by itself also fails it in order, so the cuts are then
+  // only evaluated in order up to it, stopping at the first one the event
+  // fails. The flags are thus the same as in fast-skim mode alone, which the
+  // cut flow needs to know which cut the event failed first.
+  //////////////////////////////////////////////////////////////////////////////
+  unsigned lastCutIndex = unpackedCuts_.size ();
+  for (auto screeningCut = screeningOrder_.begin (); fastSkim && !skip && lastCutIndex == unpackedCuts_.size () && screeningCut != screeningOrder_.end (); screeningCut++)
+    {
+      if (*screeningCut < firstCutIndex || passesScreening (*screeningCut))
+        continue;
+      lastCutIndex = *screeningCut + 1;
+    }
+  //////////////////////////////////////////////////////////////////////////////
+
+  for (unsigned currentCutIndex = firstCutIndex; !skip && pl_->isValid && currentCutIndex != lastCutIndex; currentCutIndex++)
     {
-      Cut currentCut = pl_->cuts.at (currentCutIndex);
+      const Cut &currentCut = unpackedCuts_.at (currentCutIndex);
+      if (isWarmUp)
+        sw_->Start ();
 
       // Sets the flags for the current cut only for the objects which are
       // being cut on.
@@ -84,7 +210,30 @@ CutCalculator::produce (edm::Event &event, const edm::EventSetup &setup)
       // Updates the flags for other objects based on those for the objects
       // which are being cut on.
       updateCrossTalk (currentCut, currentCutIndex);
+
+      // Decides whether the event passes the current cut. The flags of the
+      // objects for this cut are final at this point, since later cuts only
+      // add flags for other collections to it.
+      skip = !setEventFlags (currentCut, currentCutIndex) && fastSkim;
+
+      if (isWarmUp)
+        {
+          sw_->Stop ();
+          cutTimes_.at (currentCutIndex) += sw_->RealTime ();
+          cutEvaluations_.at (currentCutIndex)++;
+          pl_->individualEventFlags.back () && cutPasses_.at (currentCutIndex)++;
+        }
+
+      // Saves the flags for other channels which start with the same cuts.
+      if (isSharedPrefix_.at (currentCutIndex))
+        storeSharedState (currentCutIndex, event.id ());
     }
+  //////////////////////////////////////////////////////////////////////////////
+
+  // Once the warm-up is over, choose the cuts with which to reject events
+  // early.
+  if (isWarmUp && ++nWarmUpEvents_ == cutOrderWarmUp_ && fastSkim_)
+    setScreeningOrder ();
 
   //////////////////////////////////////////////////////////////////////////////
   // Quit if there was a problem setting the flags for any of the objects.
@@ -96,31 +245,87 @@ CutCalculator::produce (edm::Event &event, const edm::EventSetup &setup)
     }
   //////////////////////////////////////////////////////////////////////////////
 
-  // Decide whether the event passes the triggers specified by the user and
-  // store the decision in the payload.
-  evaluateTriggers (event);
-  evaluateTriggerFilters (event);
-  setEventFlags ();
+  // Store the logical AND of the trigger decision and the global cut decision
+  // as the global event decision in the payload.
+  pl_->eventDecision = (pl_->triggerDecision && pl_->triggerFilterDecision && pl_->cutsDecision);
+
+  // Pack the flags for each object into the payload, along with whether each
+  // object passes all the cuts, for the object selectors.
+  packObjectFlags (cumulativeObjectFlags_, pl_->cumulativeObjectFlags);
+  packObjectFlags (individualObjectFlags_, pl_->individualObjectFlags);
+  setPassesAllCuts ();
 
   event.put (pl_, "cutDecisions");
   pl_.reset ();
   firstEvent_ = false;
 }
 
+void
+CutCalculator::endJob ()
+{
+  // the code is written by whichever module asking for it finishes last
+  ValueLookupTree::releaseCode (generatedCode_);
+
+  if (!nWarmUpEvents_)
+    return;
+
+  //////////////////////////////////////////////////////////////////////////////
+  // Print the average time spent on each cut and the fraction of events which
+  // passed it by itself, followed by the cuts ordered by the time spent per
+  // event rejected, which is the order in which they would be evaluated most
+  // quickly if they did not depend on each other.
+  //////////////////////////////////////////////////////////////////////////////
+  unsigned longestCutName = 30;
+  for (const auto &cut : unpackedCuts_)
+    longestCutName = max<unsigned> (longestCutName, cut.name.size ());
+  longestCutName += 2;
+
+  clog << endl;
+  clog << moduleLabel_ << ": cost of each cut over the first " << nWarmUpEvents_ << " events:" << endl;
+  clog << setw (longestCutName + 48) << setfill ('-') << '-' << setfill (' ') << endl;
+  clog << setw (longestCutName) << left << "Cut Name" << right
+       << setw (16) << "Time (us)"
+       << setw (16) << "Indiv. Eff."
+       << setw (16) << "Early Reject."
+       << endl;
+  clog << setw (longestCutName + 48) << setfill ('-') << '-' << setfill (' ') << endl;
+  vector<unsigned> recommendedOrder;
+  for (unsigned i = 0; i < unpackedCuts_.size (); i++)
+    {
+      double time = cutEvaluations_.at (i) ? 1.0e6 * cutTimes_.at (i) / cutEvaluations_.at (i) : 0.0,
+             efficiency = cutEvaluations_.at (i) ? 100.0 * cutPasses_.at (i) / cutEvaluations_.at (i) : 0.0;
+      bool isScreening = (find (screeningOrder_.begin (), screeningOrder_.end (), i) != screeningOrder_.end ());
+      clog << setw (longestCutName) << left << unpackedCuts_.at (i).name << right << fixed
+           << setw (16) << setprecision (3) << time
+           << setw (15) << setprecision (3) << efficiency << "%"
+           << setw (16) << (isScreening ? "yes" : "no")
+           << endl;
+      recommendedOrder.push_back (i);
+    }
+  clog << setw (longestCutName + 48) << setfill ('-') << '-' << setfill (' ') << endl;
+
+  stable_sort (recommendedOrder.begin (), recommendedOrder.end (), [&](unsigned a, unsigned b) -> bool { return getRejectionCost (a) < getRejectionCost (b); });
+  clog << "Recommended order of the cuts:" << endl;
+  for (const auto &i : recommendedOrder)
+    clog << "  " << unpackedCuts_.at (i).name << endl;
+  clog << "Note that the selection may change if cuts which depend on each other are reordered." << endl;
+  //////////////////////////////////////////////////////////////////////////////
+}
+
 bool
-CutCalculator::setObjectFlags (const Cut &currentCut, unsigned currentCutIndex) const
+CutCalculator::setObjectFlags (const Cut &currentCut, unsigned currentCutIndex)
 {
   ////////////////////////////////////////////////////////////////////////////////
   // Prepare the flag maps for the new cut by increasing the size of the vector
   // and adding the input label as a key to the map.
   ////////////////////////////////////////////////////////////////////////////////
   string inputType = currentCut.inputLabel;
-  if (currentCutIndex >= pl_->individualObjectFlags.size ())
-    pl_->individualObjectFlags.resize (currentCutIndex + 1);
-  if (currentCutIndex >= pl_->cumulativeObjectFlags.size ())
-    pl_->cumulativeObjectFlags.resize (currentCutIndex + 1);
-  pl_->individualObjectFlags.at (currentCutIndex)[inputType];
-  pl_->cumulativeObjectFlags.at (currentCutIndex)[inputType];
+  if (currentCutIndex >= individualObjectFlags_.size ())
+    individualObjectFlags_.resize (currentCutIndex + 1);
+  if (currentCutIndex >= cumulativeObjectFlags_.size ())
+    cumulativeObjectFlags_.resize (currentCutIndex + 1);
+  individualObjectFlags_.at (currentCutIndex)[inputType];
+  cumulativeObjectFlags_.at (currentCutIndex)[inputType];
   ////////////////////////////////////////////////////////////////////////////////
 
   ////////////////////////////////////////////////////////////////////////////////
@@ -129,16 +334,16 @@ CutCalculator::setObjectFlags (const Cut &currentCut, unsigned currentCutIndex)
   for (auto cutDecision = currentCut.valueLookupTree->evaluate ().begin (); cutDecision != currentCut.valueLookupTree->evaluate ().end (); cutDecision++)
     {
       unsigned object = (cutDecision - currentCut.valueLookupTree->evaluate ().begin ());
-      double value = boost::get<double> (*cutDecision);
+      double value = *cutDecision;
       pair<bool, bool> flag = make_pair (value, !IS_INVALID(value));
 
       if (currentCut.isVeto)
         flag.first = !flag.first;
 
-      pl_->individualObjectFlags.at (currentCutIndex).at (inputType).push_back (flag);
-      if (currentCutIndex > 0 && pl_->cumulativeObjectFlags.at (currentCutIndex - 1).count (inputType))
-        flag.first = flag.first && pl_->cumulativeObjectFlags.at (currentCutIndex - 1).at (inputType).at (object).first;
-      pl_->cumulativeObjectFlags.at (currentCutIndex).at (inputType).push_back (flag);
+      individualObjectFlags_.at (currentCutIndex).at (inputType).push_back (flag);
+      if (currentCutIndex > 0 && cumulativeObjectFlags_.at (currentCutIndex - 1).count (inputType))
+        flag.first = flag.first && cumulativeObjectFlags_.at (currentCutIndex - 1).at (inputType).at (object).first;
+      cumulativeObjectFlags_.at (currentCutIndex).at (inputType).push_back (flag);
     }
   ////////////////////////////////////////////////////////////////////////////////
 
@@ -156,11 +361,11 @@ CutCalculator::setObjectFlags (const Cut &currentCut, unsigned currentCutIndex)
       for (auto arbitrationValue = currentCut.arbitrationTree->evaluate ().begin (); arbitrationValue != currentCut.arbitrationTree->evaluate ().end (); arbitrationValue++)
         {
           unsigned object = (arbitrationValue - currentCut.arbitrationTree->evaluate ().begin ());
-          double value = boost::get<double> (*arbitrationValue);
+          double value = *arbitrationValue;
           pair<bool, bool> flag = make_pair (value, !IS_INVALID(value));
 
-          if (!pl_->cumulativeObjectFlags.at (currentCutIndex).at (inputType).at (object).first
-           || !pl_->cumulativeObjectFlags.at (currentCutIndex).at (inputType).at (object).second
+          if (!cumulativeObjectFlags_.at (currentCutIndex).at (inputType).at (object).first
+           || !cumulativeObjectFlags_.at (currentCutIndex).at (inputType).at (object).second
            || !flag.second)
             continue;
           indicesToArbitrate.push_back (make_pair (object, value));
@@ -173,8 +378,8 @@ CutCalculator::setObjectFlags (const Cut &currentCut, unsigned currentCutIndex)
       bool isChosen = true;
       for (const auto &index : indicesToArbitrate)
         {
-          pl_->individualObjectFlags.at (currentCutIndex).at (inputType).at (index.first).first = isChosen;
-          pl_->cumulativeObjectFlags.at (currentCutIndex).at (inputType).at (index.first).first = isChosen;
+          individualObjectFlags_.at (currentCutIndex).at (inputType).at (index.first).first = isChosen;
+          cumulativeObjectFlags_.at (currentCutIndex).at (inputType).at (index.first).first = isChosen;
           isChosen = false;
         }
     }
@@ -184,7 +389,7 @@ CutCalculator::setObjectFlags (const Cut &currentCut, unsigned currentCutIndex)
 }
 
 void
-CutCalculator::updateCrossTalk (const Cut &currentCut, unsigned currentCutIndex) const
+CutCalculator::updateCrossTalk (const Cut &currentCut, unsigned currentCutIndex)
 {
   // Propagate forward any collections which have flags set for the previous
   // cut.
@@ -192,38 +397,45 @@ CutCalculator::updateCrossTalk (const Cut &currentCut, unsigned currentCutIndex)
   vector<string> singleObjects = anatools::getSingleObjects (inputType);
   if (currentCutIndex > 0)
     {
-      for (const auto &collection : pl_->cumulativeObjectFlags.at (currentCutIndex - 1))
+      for (const auto &collection : cumulativeObjectFlags_.at (currentCutIndex - 1))
         {
           if (collection.first == inputType)
             continue;
-          pl_->cumulativeObjectFlags.at (currentCutIndex)[collection.first] = pl_->cumulativeObjectFlags.at (currentCutIndex - 1).at (collection.first);
-          unordered_map<unsigned, bool> otherCumulativeFlags;
+          cumulativeObjectFlags_.at (currentCutIndex)[collection.first] = cumulativeObjectFlags_.at (currentCutIndex - 1).at (collection.first);
+          vector<pair<bool, bool> > &currentFlags = cumulativeObjectFlags_.at (currentCutIndex).at (inputType),
+                                    &otherFlags = cumulativeObjectFlags_.at (currentCutIndex).at (collection.first);
+
+          // For each of the other objects, whether it has been reached from
+          // any of the current objects (first) and whether any of these passed
+          // (second).
+          vector<pair<bool, bool> > otherCumulativeFlags (otherFlags.size (), make_pair (false, false));
           for (auto singleObject = singleObjects.begin (); singleObject != singleObjects.end (); singleObject++)
             {
-              for (auto flag = pl_->cumulativeObjectFlags.at (currentCutIndex).at (inputType).begin (); flag != pl_->cumulativeObjectFlags.at (currentCutIndex).at (inputType).end (); flag++)
+              const vector<vector<unsigned> > &globalIndexMap = currentCut.valueLookupTree->getGlobalIndices (*singleObject, collection.first);
+              for (unsigned iFlag = 0; iFlag < currentFlags.size (); iFlag++)
                 {
-                  unsigned iFlag = flag - pl_->cumulativeObjectFlags.at (currentCutIndex).at (inputType).begin ();
                   unsigned localIndex = currentCut.valueLookupTree->getLocalIndex (iFlag, singleObject - singleObjects.begin ());
-                  set<unsigned> globalIndices = currentCut.valueLookupTree->getGlobalIndices (localIndex, *singleObject, collection.first);
+                  const vector<unsigned> &globalIndices = globalIndexMap.at (localIndex);
                   if (!globalIndices.size ())
                     break;
-                  pair<bool, bool> currentFlag = pl_->cumulativeObjectFlags.at (currentCutIndex).at (inputType).at (iFlag), otherFlag;
+                  pair<bool, bool> currentFlag = currentFlags.at (iFlag);
                   bool cumulativeFlag = false;
                   for (const auto &globalIndex : globalIndices)
                     {
-                      otherFlag = pl_->cumulativeObjectFlags.at (currentCutIndex).at (collection.first).at (globalIndex);
+                      const pair<bool, bool> &otherFlag = otherFlags.at (globalIndex);
                       otherFlag.second && (cumulativeFlag = cumulativeFlag || otherFlag.first);
-                      if (!otherCumulativeFlags.count (globalIndex))
-                        otherCumulativeFlags[globalIndex] = false;
-                      currentFlag.second && (otherCumulativeFlags.at (globalIndex) = otherCumulativeFlags.at (globalIndex) || currentFlag.first);
+                      otherCumulativeFlags.at (globalIndex).first = true;
+                      currentFlag.second && (otherCumulativeFlags.at (globalIndex).second = otherCumulativeFlags.at (globalIndex).second || currentFlag.first);
                     }
-                  currentFlag.second && (pl_->cumulativeObjectFlags.at (currentCutIndex).at (inputType).at (iFlag).first = currentFlag.first && cumulativeFlag);
+                  currentFlag.second && (currentFlags.at (iFlag).first = currentFlag.first && cumulativeFlag);
                 }
             }
-          for (const auto &flag : otherCumulativeFlags)
+          for (unsigned globalIndex = 0; globalIndex < otherFlags.size (); globalIndex++)
             {
-              pair<bool, bool> otherFlag = pl_->cumulativeObjectFlags.at (currentCutIndex).at (collection.first).at (flag.first);
-              otherFlag.second && (pl_->cumulativeObjectFlags.at (currentCutIndex).at (collection.first).at (flag.first).first = otherFlag.first && flag.second);
+              if (!otherCumulativeFlags.at (globalIndex).first)
+                continue;
+              pair<bool, bool> &otherFlag = otherFlags.at (globalIndex);
+              otherFlag.second && (otherFlag.first = otherFlag.first && otherCumulativeFlags.at (globalIndex).second);
             }
         }
     }
@@ -235,13 +447,13 @@ CutCalculator::updateCrossTalk (const Cut &currentCut, unsigned currentCutIndex)
     {
       for (auto singleObject = singleObjects.begin (); singleObject != singleObjects.end (); singleObject++)
         {
-          if (pl_->cumulativeObjectFlags.at (currentCutIndex).count (*singleObject))
+          if (cumulativeObjectFlags_.at (currentCutIndex).count (*singleObject))
             continue;
-          pl_->cumulativeObjectFlags.at (currentCutIndex)[*singleObject] = vector<pair<bool, bool> > (currentCut.valueLookupTree->getCollectionSize (*singleObject), make_pair (false, true));
-          for (auto flag = pl_->cumulativeObjectFlags.at (currentCutIndex).at (inputType).begin (); flag != pl_->cumulativeObjectFlags.at (currentCutIndex).at (inputType).end (); flag++)
+          cumulativeObjectFlags_.at (currentCutIndex)[*singleObject] = vector<pair<bool, bool> > (currentCut.valueLookupTree->getCollectionSize (*singleObject), make_pair (false, true));
+          for (auto flag = cumulativeObjectFlags_.at (currentCutIndex).at (inputType).begin (); flag != cumulativeObjectFlags_.at (currentCutIndex).at (inputType).end (); flag++)
             {
-              unsigned localIndex = currentCut.valueLookupTree->getLocalIndex (flag - pl_->cumulativeObjectFlags.at (currentCutIndex).at (inputType).begin (), singleObject - singleObjects.begin ());
-              flag->second && (pl_->cumulativeObjectFlags.at (currentCutIndex).at (*singleObject).at (localIndex).first = pl_->cumulativeObjectFlags.at (currentCutIndex).at (*singleObject).at (localIndex).first || flag->first);
+              unsigned localIndex = currentCut.valueLookupTree->getLocalIndex (flag - cumulativeObjectFlags_.at (currentCutIndex).at (inputType).begin (), singleObject - singleObjects.begin ());
+              flag->second && (cumulativeObjectFlags_.at (currentCutIndex).at (*singleObject).at (localIndex).first = cumulativeObjectFlags_.at (currentCutIndex).at (*singleObject).at (localIndex).first || flag->first);
             }
         }
     }
@@ -250,9 +462,9 @@ CutCalculator::updateCrossTalk (const Cut &currentCut, unsigned currentCutIndex)
   // but not any previous cuts.
   if (currentCutIndex > 0)
     {
-      for (const auto &collection : pl_->cumulativeObjectFlags.at (currentCutIndex))
+      for (const auto &collection : cumulativeObjectFlags_.at (currentCutIndex))
         {
-          if (pl_->cumulativeObjectFlags.at (currentCutIndex - 1).count (collection.first))
+          if (cumulativeObjectFlags_.at (currentCutIndex - 1).count (collection.first))
             continue;
           singleObjects = anatools::getSingleObjects (inputType);
           for (unsigned i = 0; i < currentCutIndex; i++)
@@ -260,20 +472,21 @@ CutCalculator::updateCrossTalk (const Cut &currentCut, unsigned currentCutIndex)
               vector<pair<bool, bool> > cumulativeObjectFlags (collection.second.size (), make_pair (true, true));
               for (const auto &singleObject : singleObjects)
                 {
-                  if (!pl_->cumulativeObjectFlags.at (i).count (singleObject))
+                  if (!cumulativeObjectFlags_.at (i).count (singleObject))
                     continue;
-                  for (auto flag = pl_->cumulativeObjectFlags.at (i).at (singleObject).begin (); flag != pl_->cumulativeObjectFlags.at (i).at (singleObject).end (); flag++)
+                  const vector<vector<unsigned> > &globalIndexMap = currentCut.valueLookupTree->getGlobalIndices (singleObject, collection.first);
+                  for (auto flag = cumulativeObjectFlags_.at (i).at (singleObject).begin (); flag != cumulativeObjectFlags_.at (i).at (singleObject).end (); flag++)
                     {
-                      unsigned localIndex = flag - pl_->cumulativeObjectFlags.at (i).at (singleObject).begin ();
-                      set<unsigned> globalIndices = currentCut.valueLookupTree->getGlobalIndices (localIndex, singleObject, collection.first);
+                      unsigned localIndex = flag - cumulativeObjectFlags_.at (i).at (singleObject).begin ();
+                      const vector<unsigned> &globalIndices = globalIndexMap.at (localIndex);
                       for (const auto &globalIndex : globalIndices)
                         {
-                          cumulativeObjectFlags.at (globalIndex).second = pl_->cumulativeObjectFlags.at (currentCutIndex).at (collection.first).at (globalIndex).second;
-                          cumulativeObjectFlags.at (globalIndex).second && (cumulativeObjectFlags.at (globalIndex).first = cumulativeObjectFlags.at (globalIndex).first && pl_->cumulativeObjectFlags.at (i).at (singleObject).at (localIndex).first);
+                          cumulativeObjectFlags.at (globalIndex).second = cumulativeObjectFlags_.at (currentCutIndex).at (collection.first).at (globalIndex).second;
+                          cumulativeObjectFlags.at (globalIndex).second && (cumulativeObjectFlags.at (globalIndex).first = cumulativeObjectFlags.at (globalIndex).first && cumulativeObjectFlags_.at (i).at (singleObject).at (localIndex).first);
                         }
                     }
                 }
-              pl_->cumulativeObjectFlags.at (i)[collection.first] = cumulativeObjectFlags;
+              cumulativeObjectFlags_.at (i)[collection.first] = cumulativeObjectFlags;
             }
         }
     }
@@ -297,6 +510,10 @@ CutCalculator::unpackCuts ()
       unpackedTriggersToVeto_ = cuts_.getParameter<vector<string> > ("triggersToVeto");
       objectsToGet_.insert ("triggers");
     }
+  triggerIndex_.patterns = unpackedTriggers_;
+  triggerIndex_.isSubstring = false;
+  vetoTriggerIndex_.patterns = unpackedTriggersToVeto_;
+  vetoTriggerIndex_.isSubstring = false;
   if (cuts_.exists ("triggerFilters"))
     {
       unpackedTriggerFilters_ = cuts_.getParameter<vector<string> > ("triggerFilters");
@@ -334,6 +551,11 @@ CutCalculator::unpackCuts ()
       tempCut.cutString = cuts.at (currentCut).getParameter<string> ("cutString");
       //////////////////////////////////////////////////////////////////////////
 
+      // Get every collection read by the cut string as well, such as those
+      // used through number() or the trigger objects for trigobjDeltaR().
+      vector<string> requiredCollections = ValueLookupTree::getRequiredCollections (tempCut.cutString, tempInputCollection);
+      objectsToGet_.insert (requiredCollections.begin (), requiredCollections.end ());
+
       //////////////////////////////////////////////////////////////////////////
       // Extract the number of objects required by the cut.
       //////////////////////////////////////////////////////////////////////////
@@ -381,6 +603,11 @@ CutCalculator::unpackCuts ()
       tempCut.arbitration = "";
       if (cuts.at (currentCut).exists ("arbitration"))
         tempCut.arbitration = cuts.at (currentCut).getParameter<string> ("arbitration");
+      if (tempCut.arbitration != "" && tempCut.arbitration != "random")
+        {
+          requiredCollections = ValueLookupTree::getRequiredCollections (tempCut.arbitration, tempInputCollection);
+          objectsToGet_.insert (requiredCollections.begin (), requiredCollections.end ());
+        }
       //////////////////////////////////////////////////////////////////////////
 
       // Store the temporary cut variable into the vector of unpacked cuts, and
@@ -388,8 +615,24 @@ CutCalculator::unpackCuts ()
       tempCut.valueLookupTree = NULL;
       tempCut.arbitrationTree = NULL;
       unpackedCuts_.push_back (tempCut);
+
+      //////////////////////////////////////////////////////////////////////////
+      // Store the collections for which this cut sets flags, which are the
+      // constituent collections as well in the case of a composite
+      // collection.
+      //////////////////////////////////////////////////////////////////////////
+      unpackedCollections_.push_back (catInputCollection);
+      if (tempInputCollection.size () > 1)
+        {
+          vector<string> singleObjects = anatools::getSingleObjects (catInputCollection);
+          unpackedCollections_.insert (unpackedCollections_.end (), singleObjects.begin (), singleObjects.end ());
+        }
+      //////////////////////////////////////////////////////////////////////////
     }
 
+  sort (unpackedCollections_.begin (), unpackedCollections_.end ());
+  unpackedCollections_.erase (unique (unpackedCollections_.begin (), unpackedCollections_.end ()), unpackedCollections_.end ());
+
   return true;
 }
 
@@ -435,15 +678,15 @@ CutCalculator::splitString (const string &inputString) const
 }
 
 bool
-CutCalculator::evaluateTriggers (const edm::Event &event) const
+CutCalculator::evaluateTriggers (const edm::Event &event)
 {
   //////////////////////////////////////////////////////////////////////////////
   // Initialize the flags for each trigger which is required and each trigger
   // which is to be vetoed, as well as the event-wide flags for each of these.
   //////////////////////////////////////////////////////////////////////////////
-  bool triggerDecision = !pl_->triggers.size (), vetoTriggerDecision = true;
-  pl_->triggerFlags.resize (pl_->triggers.size (), false);
-  pl_->vetoTriggerFlags.resize (pl_->triggersToVeto.size (), true);
+  bool triggerDecision = !unpackedTriggers_.size (), vetoTriggerDecision = true;
+  pl_->triggerFlags.resize (unpackedTriggers_.size (), false);
+  pl_->vetoTriggerFlags.resize (unpackedTriggersToVeto_.size (), true);
   //////////////////////////////////////////////////////////////////////////////
 
   if (handles_.triggers.isValid ())
@@ -453,23 +696,15 @@ CutCalculator::evaluateTriggers (const edm::Event &event) const
         {
           string name = trigger.name;
           bool pass = trigger.pass;
-#elif DATA_FORMAT == MINI_AOD || DATA_FORMAT == AOD || DATA_FORMAT == MINI_AOD_CUSTOM 
-      const edm::TriggerNames &triggerNames = event.triggerNames (*handles_.triggers);
-      for (unsigned i = 0; i < triggerNames.size (); i++)
-        {
-          string name = triggerNames.triggerName (i);
-          bool pass = handles_.triggers->accept (i);
-#else
-  #error "Data format is not valid."
-#endif
+
           //////////////////////////////////////////////////////////////////////////
           // If the current trigger matches one of the triggers to veto, record its
           // decision. If any of these triggers is true, set the event-wide flag to
           // false;
           //////////////////////////////////////////////////////////////////////////
-          for (unsigned triggerIndex = 0; triggerIndex != pl_->triggersToVeto.size (); triggerIndex++)
+          for (unsigned triggerIndex = 0; triggerIndex != unpackedTriggersToVeto_.size (); triggerIndex++)
             {
-              if (name.find (pl_->triggersToVeto.at (triggerIndex)) == 0)
+              if (name.find (unpackedTriggersToVeto_.at (triggerIndex)) == 0)
                 {
                   vetoTriggerDecision = vetoTriggerDecision && !pass;
                   pl_->vetoTriggerFlags.at (triggerIndex) = pass;
@@ -482,9 +717,9 @@ CutCalculator::evaluateTriggers (const edm::Event &event) const
           // decision. If any of these triggers is true, set the event-wide flag to
           // true.
           //////////////////////////////////////////////////////////////////////////
-          for (unsigned triggerIndex = 0; triggerIndex != pl_->triggers.size (); triggerIndex++)
+          for (unsigned triggerIndex = 0; triggerIndex != unpackedTriggers_.size (); triggerIndex++)
             {
-              if (name.find (pl_->triggers.at (triggerIndex)) == 0)
+              if (name.find (unpackedTriggers_.at (triggerIndex)) == 0)
                 {
                   triggerDecision = triggerDecision || pass;
                   pl_->triggerFlags.at (triggerIndex) = pass;
@@ -492,6 +727,49 @@ CutCalculator::evaluateTriggers (const edm::Event &event) const
             }
           //////////////////////////////////////////////////////////////////////////
         }
+#elif DATA_FORMAT == MINI_AOD || DATA_FORMAT == AOD || DATA_FORMAT == MINI_AOD_CUSTOM 
+      //////////////////////////////////////////////////////////////////////////
+      // Look up the paths matching each trigger when the trigger names change,
+      // so that only the decisions of these paths need to be read for each
+      // event.
+      //////////////////////////////////////////////////////////////////////////
+      const edm::TriggerNames &triggerNames = event.triggerNames (*handles_.triggers);
+      anatools::updateTriggerIndex (vetoTriggerIndex_, triggerNames);
+      anatools::updateTriggerIndex (triggerIndex_, triggerNames);
+      //////////////////////////////////////////////////////////////////////////
+
+      //////////////////////////////////////////////////////////////////////////
+      // Record the decision of each trigger to veto. If any of these triggers
+      // is true, set the event-wide flag to false.
+      //////////////////////////////////////////////////////////////////////////
+      for (unsigned triggerIndex = 0; triggerIndex != unpackedTriggersToVeto_.size (); triggerIndex++)
+        {
+          for (const auto &path : vetoTriggerIndex_.paths.at (triggerIndex))
+            {
+              bool pass = handles_.triggers->accept (path);
+              vetoTriggerDecision = vetoTriggerDecision && !pass;
+              pl_->vetoTriggerFlags.at (triggerIndex) = pass;
+            }
+        }
+      //////////////////////////////////////////////////////////////////////////
+
+      //////////////////////////////////////////////////////////////////////////
+      // Record the decision of each required trigger. If any of these triggers
+      // is true, set the event-wide flag to true.
+      //////////////////////////////////////////////////////////////////////////
+      for (unsigned triggerIndex = 0; triggerIndex != unpackedTriggers_.size (); triggerIndex++)
+        {
+          for (const auto &path : triggerIndex_.paths.at (triggerIndex))
+            {
+              bool pass = handles_.triggers->accept (path);
+              triggerDecision = triggerDecision || pass;
+              pl_->triggerFlags.at (triggerIndex) = pass;
+            }
+        }
+      //////////////////////////////////////////////////////////////////////////
+#else
+  #error "Data format is not valid."
+#endif
     }
 
   // Store the logical AND of the two event-wide flags as the event-wide
@@ -500,111 +778,343 @@ CutCalculator::evaluateTriggers (const edm::Event &event) const
 }
 
 bool
-CutCalculator::evaluateTriggerFilters (const edm::Event &event) const
+CutCalculator::evaluateTriggerFilters () const
 {
-  bool triggerFilterDecision = !pl_->triggerFilters.size ();
-  pl_->triggerFilterFlags.resize (pl_->triggerFilters.size (), false);
+  bool triggerFilterDecision = !unpackedTriggerFilters_.size ();
+  pl_->triggerFilterFlags.resize (unpackedTriggerFilters_.size (), false);
 
+  //////////////////////////////////////////////////////////////////////////////
+  // Each filter is passed if any trigger object passed it, which is looked up
+  // in the index of the trigger objects by filter label built once per event.
+  //////////////////////////////////////////////////////////////////////////////
   if (handles_.triggers.isValid () && handles_.trigobjs.isValid ())
     {
-      const edm::TriggerNames &triggerNames = event.triggerNames (*handles_.triggers);
-      for (unsigned i = 0; i < pl_->triggerFilters.size (); i++)
+      const unordered_map<string, vector<unsigned> > &filters = anatools::getTrigobjFilterIndex (handles_);
+      for (unsigned i = 0; i < unpackedTriggerFilters_.size (); i++)
         {
-#if DATA_FORMAT == MINI_AOD || DATA_FORMAT == MINI_AOD_CUSTOM  
-          for (auto trigobj : *handles_.trigobjs)
-            {
-              trigobj.unpackPathNames (triggerNames);
-              for (const auto &filter : trigobj.filterLabels ())
-                {
-                  pl_->triggerFilterFlags.at (i) = (pl_->triggerFilters.at (i) == filter);
-                  if (pl_->triggerFilterFlags.at (i))
-                    break;
-                }
-              if (pl_->triggerFilterFlags.at (i))
-                break;
-            }
-#endif
+          pl_->triggerFilterFlags.at (i) = filters.count (unpackedTriggerFilters_.at (i));
           triggerFilterDecision = triggerFilterDecision || pl_->triggerFilterFlags.at (i);
         }
     }
+  //////////////////////////////////////////////////////////////////////////////
 
   return (pl_->triggerFilterDecision = triggerFilterDecision);
 }
 
 bool
-CutCalculator::setEventFlags () const
+CutCalculator::setEventFlags (const Cut &currentCut, unsigned currentCutIndex) const
 {
-  pl_->cutsDecision = true;
+  int numberPassing = 0;
+  int numberPassingPrev = 0;
+  int numberPassingIndividual = 0;
+
+  //////////////////////////////////////////////////////////////////////////////
+  // Count the number of objects passing the current cut and all previous cuts
+  // in the collection on which the cut acts.
+  //////////////////////////////////////////////////////////////////////////////
+  for (const auto &flag : cumulativeObjectFlags_.at (currentCutIndex).at (currentCut.inputLabel))
+    {
+      if (flag.second && flag.first)
+        numberPassing++;
+    }
+  //////////////////////////////////////////////////////////////////////////////
 
-  // Loop over the cuts, storing the event-wide decision for each in the
-  // payload.
-  for (unsigned currentCutIndex = 0; currentCutIndex != pl_->cuts.size (); currentCutIndex++)
+  //////////////////////////////////////////////////////////////////////////////
+  // Count the number of objects passing the current cut independently.
+  //////////////////////////////////////////////////////////////////////////////
+  for (const auto &flag : individualObjectFlags_.at (currentCutIndex).at (currentCut.inputLabel))
     {
-      Cut currentCut = pl_->cuts.at (currentCutIndex);
-      int numberPassing = 0;
-      int numberPassingPrev = 0;
-      int numberPassingIndividual = 0;
+      if (flag.second && flag.first)
+        numberPassingIndividual++;
+    }
+  //////////////////////////////////////////////////////////////////////////////
 
-      //////////////////////////////////////////////////////////////////////////
-      // Count the number of objects passing the current cut and all previous
-      // cuts in the collection on which the cut acts.
-      //////////////////////////////////////////////////////////////////////////
-      for (const auto &flag : pl_->cumulativeObjectFlags.at (currentCutIndex).at (currentCut.inputLabel))
+  //////////////////////////////////////////////////////////////////////////////
+  // Decide if the event passes this cut. If the cut is a veto, we have to test
+  // the number of objects which failed this cut but which passed all previous
+  // cuts. Remember, the object flags are inverted in the case of a veto.
+  //////////////////////////////////////////////////////////////////////////////
+  bool cutDecision;
+  bool cutDecisionIndividual;
+  if (!currentCut.isVeto)
+    {
+      cutDecision = evaluateComparison (numberPassing, currentCut.eventComparativeOperator, currentCut.numberRequired);
+      cutDecisionIndividual = evaluateComparison (numberPassingIndividual, currentCut.eventComparativeOperator, currentCut.numberRequired);
+    }
+  else
+    {
+      if (currentCutIndex > 0)
         {
-          if (flag.second && flag.first)
-            numberPassing++;
+          for (const auto &flag : cumulativeObjectFlags_.at (currentCutIndex - 1).at (currentCut.inputLabel))
+            (flag.second && flag.first) && numberPassingPrev++;
         }
-      //////////////////////////////////////////////////////////////////////////
+      int numberFailCut = numberPassingPrev - numberPassing;
+      cutDecision = evaluateComparison (numberFailCut, currentCut.eventComparativeOperator, currentCut.numberRequired);
+      cutDecisionIndividual = evaluateComparison (numberPassingIndividual, currentCut.eventComparativeOperator, currentCut.numberRequired);
+    }
+  //////////////////////////////////////////////////////////////////////////////
 
-      //////////////////////////////////////////////////////////////////////////
-      // Count the number of objects passing the current cut independently.
-      //////////////////////////////////////////////////////////////////////////
-      for (const auto &flag : pl_->individualObjectFlags.at (currentCutIndex).at (currentCut.inputLabel))
+  //////////////////////////////////////////////////////////////////////////////
+  // Store the decision for this cut in the payload and update the global cut
+  // decision flag.
+  //////////////////////////////////////////////////////////////////////////////
+  pl_->cumulativeEventFlags.push_back (cutDecision);
+  pl_->cutsDecision = pl_->cutsDecision && cutDecision;
+  pl_->individualEventFlags.push_back (cutDecisionIndividual);
+  //////////////////////////////////////////////////////////////////////////////
+
+  // Return whether the event has passed this cut and all previous cuts.
+  return pl_->cutsDecision;
+}
+
+void
+CutCalculator::packObjectFlags (const FlagMap &objectFlags, FlagMatrix &flagMatrix) const
+{
+  //////////////////////////////////////////////////////////////////////////////
+  // Lay out a row of the matrix, giving each collection as many bits as it has
+  // objects for any of the cuts.
+  //////////////////////////////////////////////////////////////////////////////
+  unsigned nCollections = unpackedCollections_.size ();
+  flagMatrix.offsets.assign (1, 0);
+  for (const auto &collection : unpackedCollections_)
+    {
+      unsigned size = 0;
+      for (const auto &cut : objectFlags)
         {
-          if (flag.second && flag.first)
-            numberPassingIndividual++;
+          auto flags = cut.find (collection);
+          if (flags != cut.end ())
+            size = max<unsigned> (size, flags->second.size ());
         }
-      //////////////////////////////////////////////////////////////////////////
+      flagMatrix.offsets.push_back (flagMatrix.offsets.back () + size);
+    }
+  unsigned rowSize = flagMatrix.offsets.back ();
+  //////////////////////////////////////////////////////////////////////////////
 
-      //////////////////////////////////////////////////////////////////////////
-      // Decide if the event passes this cut. If the cut is a veto, we have to
-      // test the number of objects which failed this cut but which passed all
-      // previous cuts. Remember, the object flags are inverted in the case of a
-      // veto.
-      //////////////////////////////////////////////////////////////////////////
-      bool cutDecision;
-      bool cutDecisionIndividual;
-      if (!currentCut.isVeto)
-	{
-        cutDecision = evaluateComparison (numberPassing, currentCut.eventComparativeOperator, currentCut.numberRequired);
-        cutDecisionIndividual = evaluateComparison (numberPassingIndividual, currentCut.eventComparativeOperator, currentCut.numberRequired);
-	}
-      else
+  //////////////////////////////////////////////////////////////////////////////
+  // Copy the flags for each cut into its row.
+  //////////////////////////////////////////////////////////////////////////////
+  flagMatrix.hasFlags.assign (objectFlags.size () * nCollections, false);
+  flagMatrix.flags.assign (objectFlags.size () * rowSize, false);
+  flagMatrix.isValid.assign (objectFlags.size () * rowSize, false);
+  for (unsigned iCut = 0; iCut < objectFlags.size (); iCut++)
+    {
+      for (unsigned iCollection = 0; iCollection < nCollections; iCollection++)
         {
-          if (currentCutIndex > 0)
+          auto flags = objectFlags.at (iCut).find (unpackedCollections_.at (iCollection));
+          if (flags == objectFlags.at (iCut).end ())
+            continue;
+          flagMatrix.hasFlags.at (iCut * nCollections + iCollection) = true;
+          unsigned bit = iCut * rowSize + flagMatrix.offsets.at (iCollection);
+          for (const auto &flag : flags->second)
             {
-              for (const auto &flag : pl_->cumulativeObjectFlags.at (currentCutIndex - 1).at (currentCut.inputLabel))
-                (flag.second && flag.first) && numberPassingPrev++;
+              flagMatrix.flags.at (bit) = flag.first;
+              flagMatrix.isValid.at (bit++) = flag.second;
             }
-          int numberFailCut = numberPassingPrev - numberPassing;
-          cutDecision = evaluateComparison (numberFailCut, currentCut.eventComparativeOperator, currentCut.numberRequired);
-	  cutDecisionIndividual = evaluateComparison (numberPassingIndividual, currentCut.eventComparativeOperator, currentCut.numberRequired);
         }
-      //////////////////////////////////////////////////////////////////////////
+    }
+  //////////////////////////////////////////////////////////////////////////////
+}
 
-      //////////////////////////////////////////////////////////////////////////
-      // Store the decision for this cut in the payload and update the global
-      // cut decision flag.
-      //////////////////////////////////////////////////////////////////////////
-      pl_->cumulativeEventFlags.push_back (cutDecision);
-      pl_->cutsDecision = pl_->cutsDecision && cutDecision;
-      pl_->individualEventFlags.push_back (cutDecisionIndividual);
-      //////////////////////////////////////////////////////////////////////////
+void
+CutCalculator::setPassesAllCuts () const
+{
+  //////////////////////////////////////////////////////////////////////////////
+  // For each object in each collection with flags, find the last cut with a
+  // valid flag for the object and store whether the object passes it. Objects
+  // with no valid flags pass.
+  //////////////////////////////////////////////////////////////////////////////
+  const FlagMatrix &flagMatrix = pl_->cumulativeObjectFlags;
+  pl_->collections = unpackedCollections_;
+  pl_->passesAllCuts.resize (flagMatrix.nCollections ());
+  for (unsigned iCollection = 0; iCollection < flagMatrix.nCollections (); iCollection++)
+    {
+      vector<bool> &passesAllCuts = pl_->passesAllCuts.at (iCollection);
+      passesAllCuts.assign (flagMatrix.size (iCollection), true);
+      for (unsigned iObject = 0; iObject < passesAllCuts.size (); iObject++)
+        {
+          for (int iCut = flagMatrix.nCuts () - 1; iCut >= 0 && flagMatrix.has (iCut, iCollection); iCut--)
+            {
+              pair<bool, bool> flag = flagMatrix.at (iCut, iCollection, iObject);
+              if (flag.second)
+                {
+                  passesAllCuts.at (iObject) = flag.first;
+                  break;
+                }
+            }
+        }
     }
+  //////////////////////////////////////////////////////////////////////////////
+}
 
-  // Store the logical AND of the trigger decision and the global cut decision
-  // as the global event decision in the payload and return it.
-  return (pl_->eventDecision = (pl_->triggerDecision && pl_->triggerFilterDecision && pl_->cutsDecision));
+void
+CutCalculator::registerPrefixes ()
+{
+  //////////////////////////////////////////////////////////////////////////////
+  // Describe each cut by everything which affects its flags: the cut itself
+  // and every product read by it or by its arbitration. A cut with random arbitration, and any
+  // cut after it, is given a unique prefix, since it would give a different
+  // result each time it is evaluated.
+  //////////////////////////////////////////////////////////////////////////////
+  lock_guard<mutex> guard (prefixLock);
+  string prefix = "";
+  bool isUnique = false;
+  for (const auto &cut : unpackedCuts_)
+    {
+      prefix += "\n\n" + cut.inputLabel + "\n" + cut.cutString + "\n" + cut.eventComparativeOperator + " " + to_string (cut.numberRequired) + "\n" + (cut.isVeto ? "veto" : "") + "\n" + cut.arbitration;
+      vector<string> collections = ValueLookupTree::getRequiredCollections (cut.cutString, cut.inputCollections);
+      if (cut.arbitration != "" && cut.arbitration != "random")
+        {
+          vector<string> arbitrationCollections = ValueLookupTree::getRequiredCollections (cut.arbitration, cut.inputCollections);
+          collections.insert (collections.end (), arbitrationCollections.begin (), arbitrationCollections.end ());
+        }
+      for (const auto &collection : collections)
+        {
+          if (!collections_.exists (collection))
+            continue;
+          if (collection == "uservariables" || collection == "eventvariables")
+            {
+              for (const auto &inputTag : collections_.getParameter<vector<edm::InputTag> > (collection))
+                prefix += "\n" + inputTag.encode ();
+            }
+          else
+            prefix += "\n" + collections_.getParameter<edm::InputTag> (collection).encode ();
+        }
+      if ((isUnique = isUnique || cut.arbitration == "random"))
+        prefix += "\nunique " + to_string (prefixIds.size ());
+
+      // Register the prefix ending with this cut.
+      auto id = prefixIds.insert (make_pair (prefix, prefixIds.size ()));
+      if (id.second)
+        prefixUsers.push_back (0);
+      prefixUsers.at (id.first->second)++;
+      prefixIds_.push_back (id.first->second);
+    }
+  //////////////////////////////////////////////////////////////////////////////
+}
+
+unsigned
+CutCalculator::loadSharedState (const edm::EventID &eventID)
+{
+  //////////////////////////////////////////////////////////////////////////////
+  // Once all the CutCalculators have registered their prefixes, decide which
+  // of the prefixes of this one to share, which are those used by more
+  // CutCalculators than the prefix one cut longer.
+  //////////////////////////////////////////////////////////////////////////////
+  if (isSharedPrefix_.size () != prefixIds_.size ())
+    {
+      lock_guard<mutex> guard (prefixLock);
+      isSharedPrefix_.assign (prefixIds_.size (), false);
+      for (unsigned i = 0; i < prefixIds_.size (); i++)
+        {
+          unsigned users = prefixUsers.at (prefixIds_.at (i)),
+                   nextUsers = (i + 1 < prefixIds_.size () ? prefixUsers.at (prefixIds_.at (i + 1)) : 0);
+          isSharedPrefix_.at (i) = (users > 1 && nextUsers < users);
+        }
+    }
+  //////////////////////////////////////////////////////////////////////////////
+
+  lock_guard<mutex> guard (cutStateLock);
+  CutStateStore &cutStateStore = cutStateStores[handles_.stream];
+  if (cutStateStore.eventID != eventID)
+    {
+      cutStateStore.states.clear ();
+      cutStateStore.eventID = eventID;
+    }
+
+  //////////////////////////////////////////////////////////////////////////////
+  // Copy the flags for the longest shared prefix which has already been
+  // evaluated for this event, and return the index of the first cut after it.
+  //////////////////////////////////////////////////////////////////////////////
+  for (int i = prefixIds_.size () - 1; i >= 0; i--)
+    {
+      if (!isSharedPrefix_.at (i))
+        continue;
+      auto state = cutStateStore.states.find (prefixIds_.at (i));
+      if (state == cutStateStore.states.end ())
+        continue;
+      cumulativeObjectFlags_ = state->second.cumulativeObjectFlags;
+      individualObjectFlags_ = state->second.individualObjectFlags;
+      pl_->cumulativeEventFlags = state->second.cumulativeEventFlags;
+      pl_->individualEventFlags = state->second.individualEventFlags;
+      pl_->cutsDecision = state->second.cutsDecision;
+      return i + 1;
+    }
+  //////////////////////////////////////////////////////////////////////////////
+
+  return 0;
+}
+
+void
+CutCalculator::storeSharedState (unsigned currentCutIndex, const edm::EventID &eventID) const
+{
+  lock_guard<mutex> guard (cutStateLock);
+  CutStateStore &cutStateStore = cutStateStores[handles_.stream];
+  if (cutStateStore.eventID != eventID || cutStateStore.states.count (prefixIds_.at (currentCutIndex)))
+    return;
+
+  CutState &state = cutStateStore.states[prefixIds_.at (currentCutIndex)];
+  state.cumulativeObjectFlags = cumulativeObjectFlags_;
+  state.individualObjectFlags = individualObjectFlags_;
+  state.cumulativeEventFlags = pl_->cumulativeEventFlags;
+  state.individualEventFlags = pl_->individualEventFlags;
+  state.cutsDecision = pl_->cutsDecision;
+}
+
+double
+CutCalculator::getRejectionCost (unsigned currentCutIndex) const
+{
+  //////////////////////////////////////////////////////////////////////////////
+  // Return the average time spent on the cut for each event it rejects by
+  // itself, which is infinite if it did not reject any of the warm-up events.
+  //////////////////////////////////////////////////////////////////////////////
+  unsigned evaluations = cutEvaluations_.at (currentCutIndex),
+           rejections = evaluations - cutPasses_.at (currentCutIndex);
+  if (!rejections)
+    return numeric_limits<double>::infinity ();
+  return cutTimes_.at (currentCutIndex) / rejections;
+  //////////////////////////////////////////////////////////////////////////////
+}
+
+void
+CutCalculator::setScreeningOrder ()
+{
+  //////////////////////////////////////////////////////////////////////////////
+  // An event which fails a cut by itself fails it together with the previous
+  // cuts as well, as long as the cut requires a minimum number of objects and
+  // is neither a veto nor arbitrated, since the previous cuts can then only
+  // reduce the number of passing objects. Such cuts which rejected any of the
+  // warm-up events are used to reject events early, cheapest first.
+  //////////////////////////////////////////////////////////////////////////////
+  screeningOrder_.clear ();
+  for (unsigned i = 0; i < unpackedCuts_.size (); i++)
+    {
+      const Cut &cut = unpackedCuts_.at (i);
+      if (cut.isVeto || cut.arbitration != "")
+        continue;
+      if (cut.eventComparativeOperator != ">=" && cut.eventComparativeOperator != ">")
+        continue;
+      if (getRejectionCost (i) == numeric_limits<double>::infinity ())
+        continue;
+      screeningOrder_.push_back (i);
+    }
+  stable_sort (screeningOrder_.begin (), screeningOrder_.end (), [&](unsigned a, unsigned b) -> bool { return getRejectionCost (a) < getRejectionCost (b); });
+  //////////////////////////////////////////////////////////////////////////////
+}
+
+bool
+CutCalculator::passesScreening (unsigned currentCutIndex) const
+{
+  //////////////////////////////////////////////////////////////////////////////
+  // Return whether enough objects pass the cut by itself. The values of the
+  // expression are kept by the ValueLookupTree, so they are not computed again
+  // if the cut is reached in order later.
+  //////////////////////////////////////////////////////////////////////////////
+  const Cut &currentCut = unpackedCuts_.at (currentCutIndex);
+  int numberPassing = 0;
+  for (const auto &value : currentCut.valueLookupTree->evaluate ())
+    (value && !IS_INVALID(value)) && numberPassing++;
+  return evaluateComparison (numberPassing, currentCut.eventComparativeOperator, currentCut.numberRequired);
+  //////////////////////////////////////////////////////////////////////////////
 }
 
 bool
@@ -3,37 +3,70 @@
 
 #include <unordered_set>
 
-#include "FWCore/Framework/interface/EDProducer.h"
+#include "FWCore/Framework/interface/one/EDProducer.h"
 #include "FWCore/Framework/interface/Event.h"
 #include "FWCore/Framework/interface/EventSetup.h"
+#include "FWCore/Framework/interface/Run.h"
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
 
+#include "TStopwatch.h"
+
 #include "OSUT3Analysis/AnaTools/interface/AnalysisTypes.h"
 
 // Declaration of the CutCalculator EDProducer which produces various flags
 // indicating whether the event and each object passed the user-defined cuts.
-class CutCalculator : public edm::EDProducer
+// The cuts and triggers themselves are put in each run rather than in each
+// event. When several channels start with the same cuts, evaluated on the same
+// products, the flags for these are set by the first of them to run in each
+// event and copied by the others. If requested, the cost and rejection of each
+// cut are measured over the first events, and a better order for the cuts is
+// recommended at the end of the job. Like a legacy module, it never runs at the
+// same time as the other modules using the shared legacy resource.
+class CutCalculator : public edm::one::EDProducer<edm::BeginRunProducer, edm::one::SharedResources>
 {
   public:
     CutCalculator (const edm::ParameterSet &);
     ~CutCalculator ();
 
+    void beginRunProduce (edm::Run &, const edm::EventSetup &);
     void produce (edm::Event &, const edm::EventSetup &);
+    void endJob ();
 
   private:
     ////////////////////////////////////////////////////////////////////////////
     // Private methods used in calculating the cut decisions.
     ////////////////////////////////////////////////////////////////////////////
-    bool setObjectFlags (const Cut &, unsigned) const;
-    void updateCrossTalk (const Cut &, unsigned) const;
+    bool setObjectFlags (const Cut &, unsigned);
+    void updateCrossTalk (const Cut &, unsigned);
     bool unpackCuts ();
     void getTwoObjs (string, string &, string &);
     bool evaluateComparison (int, const string &, int) const;
     string getObjToGet (string);
     vector<string> splitString (const string &) const;
-    bool evaluateTriggers (const edm::Event &) const;
-    bool evaluateTriggerFilters (const edm::Event &) const;
-    bool setEventFlags () const;
+    bool evaluateTriggers (const edm::Event &);
+    bool evaluateTriggerFilters () const;
+    bool setEventFlags (const Cut &, unsigned) const;
+    void packObjectFlags (const FlagMap &, FlagMatrix &) const;
+    void setPassesAllCuts () const;
+    ////////////////////////////////////////////////////////////////////////////
+
+    ////////////////////////////////////////////////////////////////////////////
+    // Private methods for sharing the flags for the cuts which several
+    // channels start with, so that each of these is only evaluated once per
+    // event.
+    ////////////////////////////////////////////////////////////////////////////
+    void registerPrefixes ();
+    unsigned loadSharedState (const edm::EventID &);
+    void storeSharedState (unsigned, const edm::EventID &) const;
+    ////////////////////////////////////////////////////////////////////////////
+
+    ////////////////////////////////////////////////////////////////////////////
+    // Private methods for ordering the cuts by their measured cost and
+    // rejection, and for rejecting events early with the cheapest of them.
+    ////////////////////////////////////////////////////////////////////////////
+    double getRejectionCost (unsigned) const;
+    void setScreeningOrder ();
+    bool passesScreening (unsigned) const;
     ////////////////////////////////////////////////////////////////////////////
 
     ////////////////////////////////////////////////////////////////////////////
@@ -41,6 +74,10 @@ class CutCalculator : public edm::EDProducer
     ////////////////////////////////////////////////////////////////////////////
     edm::ParameterSet  collections_;
     edm::ParameterSet  cuts_;
+    string             generatedCode_;  // file to write generated code for the expressions to, if not empty
+    bool               fastSkim_;       // whether to stop evaluating cuts once the event has failed
+    unsigned           cutOrderWarmUp_; // number of events over which to measure each cut, or zero not to
+    string             moduleLabel_;
     bool               firstEvent_;
     ////////////////////////////////////////////////////////////////////////////
 
@@ -49,14 +86,39 @@ class CutCalculator : public edm::EDProducer
     ////////////////////////////////////////////////////////////////////////////
     unordered_set<string>  objectsToGet_;
     Cuts                   unpackedCuts_;
+    vector<string>         unpackedCollections_;
     vector<string>         unpackedTriggersToVeto_;
     vector<string>         unpackedTriggers_;
     vector<string>         unpackedTriggerFilters_;
+    TriggerIndex           triggerIndex_;      // paths matching each of unpackedTriggers_
+    TriggerIndex           vetoTriggerIndex_;  // paths matching each of unpackedTriggersToVeto_
+    vector<unsigned>       prefixIds_;       // id of the prefix of the cuts ending with each cut
+    vector<bool>           isSharedPrefix_;  // whether to share the flags after each cut with other channels
+    ////////////////////////////////////////////////////////////////////////////
+
+    ////////////////////////////////////////////////////////////////////////////
+    // Statistics for each cut over the warm-up events, and the cuts with which
+    // to reject events early in fast-skim mode once these are over.
+    ////////////////////////////////////////////////////////////////////////////
+    unsigned          nWarmUpEvents_;
+    vector<double>    cutTimes_;        // total time spent on each cut, in seconds
+    vector<unsigned>  cutEvaluations_;  // number of events for which each cut was evaluated
+    vector<unsigned>  cutPasses_;       // number of these which passed the cut by itself
+    vector<unsigned>  screeningOrder_;
+    TStopwatch        *sw_;
     ////////////////////////////////////////////////////////////////////////////
 
     // Object collections which can be gotten from the event.
     Collections handles_;
 
+    ////////////////////////////////////////////////////////////////////////////
+    // Flags for each object in the current event, indexed by cut and then by
+    // collection, which are packed into the payload once they are all set.
+    ////////////////////////////////////////////////////////////////////////////
+    FlagMap  cumulativeObjectFlags_;
+    FlagMap  individualObjectFlags_;
+    ////////////////////////////////////////////////////////////////////////////
+
     // Payload for this EDProducer.
     auto_ptr<CutCalculatorPayload>  pl_;
 
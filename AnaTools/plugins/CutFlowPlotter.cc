@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
 
@@ -8,44 +9,89 @@
 
 #define EXIT_CODE 4
 
-CutFlowPlotter::CutFlowPlotter (const edm::ParameterSet &cfg) :
+std::unique_ptr<CutFlowPlotterCache>
+CutFlowPlotter::initializeGlobalCache (const edm::ParameterSet &cfg)
+{
+  //////////////////////////////////////////////////////////////////////////////
+  // Take the name of the channel from the module label, which is the channel
+  // name followed by the module type.
+  //////////////////////////////////////////////////////////////////////////////
+  TString channel = TString (cfg.getParameter<std::string> ("@module_label")).ReplaceAll (cfg.getParameter<std::string> ("@module_type"), "");
+  return std::unique_ptr<CutFlowPlotterCache> (new CutFlowPlotterCache ((const char *) channel));
+  //////////////////////////////////////////////////////////////////////////////
+}
+
+CutFlowPlotter::CutFlowPlotter (const edm::ParameterSet &cfg, const CutFlowPlotterCache *cache) :
   collections_  (cfg.getParameter<edm::ParameterSet> ("collections")),
   cutDecisions_ (cfg.getParameter<edm::InputTag> ("cutDecisions")),
-  module_type_  (cfg.getParameter<std::string>("@module_type")),
-  module_label_ (cfg.getParameter<std::string>("@module_label")),
   firstEvent_ (true)
 {
   assert (strcmp (PROJECT_VERSION, SUPPORTED_VERSION) == 0);
 
   //////////////////////////////////////////////////////////////////////////////
-  // Create a directory for this channel and book the cut flow histograms
-  // within.
+  // Book the cut flow histograms for this stream.
   //////////////////////////////////////////////////////////////////////////////
   TH1::SetDefaultSumw2 ();
-  oneDHists_["eventCounter"]  =  fs_->make<TH1D>  ("eventCounter",  ";;events",          1,  0.0,  1.0);
-  oneDHists_["cutFlow"]       =  fs_->make<TH1D>  ("cutFlow",       ";;passing events",  1,  0.0,  1.0);
-  oneDHists_["selection"]     =  fs_->make<TH1D>  ("selection",     ";;passing events",  1,  0.0,  1.0);
-  //  oneDHists_["minusOne"]      =  fs_->make<TH1D>  ("minusOne",      ";;passing events",  1,  0.0,  1.0);
+  TH1AddDirectorySentry sentry (false);
+  oneDHists_["eventCounter"]  =  new TH1D  ("eventCounter",  ";;events",          1,  0.0,  1.0);
+  oneDHists_["cutFlow"]       =  new TH1D  ("cutFlow",       ";;passing events",  1,  0.0,  1.0);
+  oneDHists_["selection"]     =  new TH1D  ("selection",     ";;passing events",  1,  0.0,  1.0);
+  oneDHists_["minusOne"]      =  new TH1D  ("minusOne",      ";;passing events",  1,  0.0,  1.0);
   //////////////////////////////////////////////////////////////////////////////
 }
 
 CutFlowPlotter::~CutFlowPlotter ()
 {
+}
+
+void
+CutFlowPlotter::releaseStreamHistograms (vector<TH1 *> &histograms, vector<string> &subdirectories)
+{
+  for (const auto &histogram : oneDHists_)
+    histograms.push_back (histogram.second);
+  oneDHists_.clear ();
+}
+
+void
+CutFlowPlotter::globalEndJob (const CutFlowPlotterCache *cache)
+{
+  map<string, TH1 *> hists;
+  for (const auto &histogram : anatools::writeStreamHistograms (*cache))
+    histogram && (hists[histogram->GetName ()] = histogram);
 
-  TString channel = TString(module_label_).ReplaceAll(module_type_, "");
-  // module_label_ = channel + module_type_  (module_type_ = "CutFlowPlotter")
+  const string &channel = cache->channel;
 
-  TH1D* cutFlow_   = oneDHists_["cutFlow"];
-  TH1D* selection_ = oneDHists_["selection"];
-  //  TH1D* minusOne_  = oneDHists_["minusOne"];
+  TH1* cutFlow_   = hists.at ("cutFlow");
+  TH1* selection_ = hists.count ("selection") ? hists.at ("selection") : NULL;
+  TH1* minusOne_  = hists.count ("minusOne") ? hists.at ("minusOne") : NULL;
 
-  // Print all the cutflow information stored in histograms when this class is destroyed.
+  //////////////////////////////////////////////////////////////////////////////
+  // The streams drop the individual and minus-one cut flows in fast-skim mode,
+  // so any copies left are from streams which saw no events and are removed
+  // from the output along with their columns.
+  //////////////////////////////////////////////////////////////////////////////
+  if (selection_ && !selection_->GetEntries () && cutFlow_->GetEntries ())
+    {
+      delete selection_;
+      selection_ = NULL;
+    }
+  if (minusOne_ && !minusOne_->GetEntries () && cutFlow_->GetEntries ())
+    {
+      delete minusOne_;
+      minusOne_ = NULL;
+    }
+  if (!selection_ || !minusOne_)
+    clog << "INFO: the individual and minus-one cut flows of the " << channel << " channel are omitted, since in fast-skim mode there are no decisions for the cuts after the first one an event fails." << endl;
+  //////////////////////////////////////////////////////////////////////////////
+
+  // Print all the cutflow information stored in histograms at the end of the job.
   int totalEvents;
   clog << endl;
   clog.setf(std::ios::fixed);
   uint longestCutName = 30;
-  //  uint textWidth = 58;  // including minusOne
-  uint textWidth = 42;  // without minusOne
+  uint textWidth = 26;
+  selection_ && (textWidth += 16);
+  minusOne_ && (textWidth += 16);
 
   for (int i=1; i<=cutFlow_->GetNbinsX(); i++) {
     string cutName = cutFlow_->GetXaxis()->GetBinLabel(i);
@@ -56,23 +102,24 @@ CutFlowPlotter::~CutFlowPlotter ()
   clog << setw (textWidth+longestCutName) << setfill ('-') << '-' << setfill (' ') << endl;
   clog << setw (longestCutName) << left << "Cut Name" << right
        << setw (10) << setprecision(1) << "Events"
-       << setw (16) << "Cumul. Eff."
-       << setw (16) << "Indiv. Eff."
-    //       << setw (16) << "Minus One" // FIXME:  Minus one efficiencies are not correctly calculated.
-       << endl;
+       << setw (16) << "Cumul. Eff.";
+  if (selection_)
+    clog << setw (16) << "Indiv. Eff.";
+  if (minusOne_)
+    clog << setw (16) << "Minus One";
+  clog << endl;
   clog << setw (textWidth+longestCutName) << setfill ('-') << '-' << setfill (' ') << endl;
   totalEvents = cutFlow_->GetBinContent (1);
   for (int i = 1; i <= cutFlow_->GetNbinsX(); i++) {
     double cutFlow   =   cutFlow_->GetBinContent (i);
-    double selection = selection_->GetBinContent (i);
-    //    double minusOne  =  minusOne_->GetBinContent (i);
-    //    minusOne *= 1.0; // Dummy statement to avoid compilation error for unused variable.
     TString name = cutFlow_->GetXaxis()->GetBinLabel(i);
     clog << setw (longestCutName) << left << name << right << setw (10) << setprecision(1) << cutFlow
-         << setw (15) << setprecision(3) << 100.0 * (cutFlow   / (double) totalEvents) << "%"
-         << setw (15) << setprecision(3) << 100.0 * (selection / (double) totalEvents) << "%"
-      //         << setw (15) << setprecision(3) << 100.0 * (minusOne  / (double) totalEvents) << "%"
-         << endl;
+         << setw (15) << setprecision(3) << 100.0 * (cutFlow   / (double) totalEvents) << "%";
+    if (selection_)
+      clog << setw (15) << setprecision(3) << 100.0 * (selection_->GetBinContent (i) / (double) totalEvents) << "%";
+    if (minusOne_)
+      clog << setw (15) << setprecision(3) << 100.0 * (minusOne_->GetBinContent (i) / (double) totalEvents) << "%";
+    clog << endl;
   }
   clog << setw (textWidth+longestCutName) << setfill ('-') << '-' << setfill (' ') << endl;
 
@@ -82,14 +129,17 @@ void
 CutFlowPlotter::analyze (const edm::Event &event, const edm::EventSetup &setup)
 {
   //////////////////////////////////////////////////////////////////////////////
-  // Try to retrieve the cut decisions from the event and print a warning if
-  // there is a problem.
+  // Try to retrieve the cut decisions from the event, and the cuts themselves
+  // from the run, and print a warning if there is a problem.
   //////////////////////////////////////////////////////////////////////////////
   event.getByLabel (cutDecisions_, cutDecisions);
+  event.getRun ().getByLabel (cutDecisions_, cutConfiguration);
   if (collections_.exists ("generatorweights"))
     event.getByLabel (collections_.getParameter<edm::InputTag> ("generatorweights"), generatorweights);
   if (firstEvent_ && !cutDecisions.isValid ())
     clog << "WARNING: failed to retrieve cut decisions from the event." << endl;
+  if (firstEvent_ && !cutConfiguration.isValid ())
+    clog << "WARNING: failed to retrieve cuts from the run." << endl;
   if (firstEvent_ && !generatorweights.isValid ())
     clog << "WARNING: failed to retrieve generator weights from the event." << endl;
   //////////////////////////////////////////////////////////////////////////////
@@ -107,17 +157,36 @@ CutFlowPlotter::analyze (const edm::Event &event, const edm::EventSetup &setup)
 bool
 CutFlowPlotter::initializeCutFlow ()
 {
+  //////////////////////////////////////////////////////////////////////////////
+  // In fast-skim mode, there are no decisions for the cuts after the first one
+  // an event fails, so the individual and minus-one cut flows would only count
+  // the events which reached each cut and are dropped. They are left in the
+  // map as NULL, so that the histograms of every stream are still in the same
+  // order when they are added together.
+  //////////////////////////////////////////////////////////////////////////////
+  TH1D *&selection = oneDHists_.at ("selection");
+  TH1D *&minusOne = oneDHists_.at ("minusOne");
+  if (cutConfiguration.isValid () && cutConfiguration->fastSkim)
+    {
+      delete selection;
+      delete minusOne;
+      selection = minusOne = NULL;
+    }
+  //////////////////////////////////////////////////////////////////////////////
+
   //////////////////////////////////////////////////////////////////////////////
   // Set the bin label for the first bin, which counts the total number of
-  // events. If the cut decisions could not be retrieved from the event, we can
+  // events. If the cuts could not be retrieved from the run, we can
   // do no more, so return false.
   //////////////////////////////////////////////////////////////////////////////
   unsigned bin = 1;
   oneDHists_.at ("cutFlow")->GetXaxis    ()->SetBinLabel  (bin,  "total");
-  oneDHists_.at ("selection")->GetXaxis  ()->SetBinLabel  (bin,  "total");
-  //  oneDHists_.at ("minusOne")->GetXaxis   ()->SetBinLabel  (bin,  "total");
+  if (selection)
+    selection->GetXaxis ()->SetBinLabel (bin, "total");
+  if (minusOne)
+    minusOne->GetXaxis ()->SetBinLabel (bin, "total");
   bin++;
-  if (!cutDecisions.isValid ())
+  if (!cutConfiguration.isValid ())
     return false;
   //////////////////////////////////////////////////////////////////////////////
 
@@ -126,37 +195,45 @@ CutFlowPlotter::initializeCutFlow ()
   // If triggers have been specified, add a special bin for the trigger
   // decision.
   //////////////////////////////////////////////////////////////////////////////
-  unsigned nCuts = cutDecisions->cuts.size ();
-  cutDecisions->triggers.size () && nCuts++;
-  cutDecisions->triggerFilters.size () && nCuts++;
+  unsigned nCuts = cutConfiguration->cuts.size ();
+  cutConfiguration->triggers.size () && nCuts++;
+  cutConfiguration->triggerFilters.size () && nCuts++;
   oneDHists_.at ("cutFlow")->SetBins    (nCuts + 1,  0.0,  nCuts + 1);
-  oneDHists_.at ("selection")->SetBins  (nCuts + 1,  0.0,  nCuts + 1);
-  //  oneDHists_.at ("minusOne")->SetBins   (nCuts + 1,  0.0,  nCuts + 1);
+  if (selection)
+    selection->SetBins (nCuts + 1, 0.0, nCuts + 1);
+  if (minusOne)
+    minusOne->SetBins (nCuts + 1, 0.0, nCuts + 1);
   //////////////////////////////////////////////////////////////////////////////
 
   //////////////////////////////////////////////////////////////////////////////
   // Set the bin labels for the rest of the bins according to the name of the
   // cut. The special bin for the trigger decision is simply labeled "trigger".
   //////////////////////////////////////////////////////////////////////////////
-  if (cutDecisions->triggers.size ())
+  if (cutConfiguration->triggers.size ())
     {
       oneDHists_.at ("cutFlow")->GetXaxis    ()->SetBinLabel  (bin,  "trigger");
-      oneDHists_.at ("selection")->GetXaxis  ()->SetBinLabel  (bin,  "trigger");
-      //      oneDHists_.at ("minusOne")->GetXaxis   ()->SetBinLabel  (bin,  "trigger");
+      if (selection)
+        selection->GetXaxis ()->SetBinLabel (bin, "trigger");
+      if (minusOne)
+        minusOne->GetXaxis ()->SetBinLabel (bin, "trigger");
       bin++;
     }
-  if (cutDecisions->triggerFilters.size ())
+  if (cutConfiguration->triggerFilters.size ())
     {
       oneDHists_.at ("cutFlow")->GetXaxis    ()->SetBinLabel  (bin,  "trigger filter");
-      oneDHists_.at ("selection")->GetXaxis  ()->SetBinLabel  (bin,  "trigger filter");
-      //      oneDHists_.at ("minusOne")->GetXaxis   ()->SetBinLabel  (bin,  "trigger filter");
+      if (selection)
+        selection->GetXaxis ()->SetBinLabel (bin, "trigger filter");
+      if (minusOne)
+        minusOne->GetXaxis ()->SetBinLabel (bin, "trigger filter");
       bin++;
     }
-  for (vector<Cut>::const_iterator cut = cutDecisions->cuts.begin (); cut != cutDecisions->cuts.end (); cut++, bin++)
+  for (vector<Cut>::const_iterator cut = cutConfiguration->cuts.begin (); cut != cutConfiguration->cuts.end (); cut++, bin++)
     {
       oneDHists_.at ("cutFlow")->GetXaxis    ()->SetBinLabel  (bin,  cut->name.c_str  ());
-      oneDHists_.at ("selection")->GetXaxis  ()->SetBinLabel  (bin,  cut->name.c_str  ());
-      //      oneDHists_.at ("minusOne")->GetXaxis   ()->SetBinLabel  (bin,  cut->name.c_str  ());
+      if (selection)
+        selection->GetXaxis ()->SetBinLabel (bin, cut->name.c_str ());
+      if (minusOne)
+        minusOne->GetXaxis ()->SetBinLabel (bin, cut->name.c_str ());
     }
   //////////////////////////////////////////////////////////////////////////////
 
@@ -174,11 +251,16 @@ CutFlowPlotter::fillCutFlow (double w)
   //////////////////////////////////////////////////////////////////////////////
   double bin = 0.5;
   bool passes = true;
+  TH1D *selection = oneDHists_.at ("selection");
+  TH1D *minusOne = oneDHists_.at ("minusOne");
   oneDHists_.at ("eventCounter")->Fill  (bin,  w);
   oneDHists_.at ("cutFlow")->Fill       (bin,  w);
-  oneDHists_.at ("selection")->Fill     (bin,  w);
+  if (selection)
+    selection->Fill (bin, w);
+  if (minusOne)
+    minusOne->Fill (bin, w);
   bin++;
-  if (!cutDecisions.isValid ())
+  if (!cutDecisions.isValid () || !cutConfiguration.isValid ())
     return false;
   //////////////////////////////////////////////////////////////////////////////
 
@@ -186,20 +268,20 @@ CutFlowPlotter::fillCutFlow (double w)
   // Fill the rest of the bins according to the flags in the cut decisions
   // object.
   //////////////////////////////////////////////////////////////////////////////
-  if (cutDecisions->triggers.size ())
+  if (cutConfiguration->triggers.size ())
     {
       passes = passes && cutDecisions->triggerDecision;
-      if (cutDecisions->triggerDecision)
-        oneDHists_.at ("selection")->Fill  (bin,  w);
+      if (selection && cutDecisions->triggerDecision)
+        selection->Fill (bin, w);
       if (passes)
         oneDHists_.at ("cutFlow")->Fill    (bin,  w);
       bin++;
     }
-  if (cutDecisions->triggerFilters.size ())
+  if (cutConfiguration->triggerFilters.size ())
     {
       passes = passes && cutDecisions->triggerFilterDecision;
-      if (cutDecisions->triggerFilterDecision)
-        oneDHists_.at ("selection")->Fill  (bin,  w);
+      if (selection && cutDecisions->triggerFilterDecision)
+        selection->Fill (bin, w);
       if (passes)
         oneDHists_.at ("cutFlow")->Fill    (bin,  w);
       bin++;
@@ -212,10 +294,33 @@ CutFlowPlotter::fillCutFlow (double w)
         oneDHists_.at ("cutFlow")->Fill (bin, w);
     }
   bin = firstBin;  // reset to the first bin with an actual cut
-  for (vector<bool>::const_iterator flag = cutDecisions->individualEventFlags.begin (); flag != cutDecisions->individualEventFlags.end (); flag++, bin++)
+  for (vector<bool>::const_iterator flag = cutDecisions->individualEventFlags.begin (); selection && flag != cutDecisions->individualEventFlags.end (); flag++, bin++)
     {
       if (*flag)
-        oneDHists_.at ("selection")->Fill (bin, w);
+        selection->Fill (bin, w);
+    }
+  //////////////////////////////////////////////////////////////////////////////
+
+  //////////////////////////////////////////////////////////////////////////////
+  // Fill the minus-one bins from the individual decisions of the trigger, the
+  // trigger filter, and each cut. An event counts towards the bin of one of
+  // these if it passes all the others, so an event which fails none of them
+  // counts towards every bin, and one which fails exactly one only towards the
+  // bin of that one. There is no minus-one cut flow in fast-skim mode.
+  //////////////////////////////////////////////////////////////////////////////
+  if (!minusOne || cutDecisions->individualEventFlags.size () != cutConfiguration->cuts.size ())
+    return true;
+  vector<bool> decisions;
+  if (cutConfiguration->triggers.size ())
+    decisions.push_back (cutDecisions->triggerDecision);
+  if (cutConfiguration->triggerFilters.size ())
+    decisions.push_back (cutDecisions->triggerFilterDecision);
+  decisions.insert (decisions.end (), cutDecisions->individualEventFlags.begin (), cutDecisions->individualEventFlags.end ());
+  unsigned nFailed = count (decisions.begin (), decisions.end (), false);
+  for (unsigned i = 0; nFailed < 2 && i < decisions.size (); i++)
+    {
+      if (!nFailed || !decisions.at (i))
+        minusOne->Fill (i + 1.5, w);
     }
   //////////////////////////////////////////////////////////////////////////////
 
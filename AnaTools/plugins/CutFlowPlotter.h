@@ -2,24 +2,43 @@
 #define CUT_FLOW_PLOTTER
 
 #include "CommonTools/UtilAlgos/interface/TFileService.h"
+#include "CommonTools/Utils/interface/TH1AddDirectorySentry.h"
 
-#include "FWCore/Framework/interface/EDAnalyzer.h"
+#include "FWCore/Framework/interface/stream/EDAnalyzer.h"
 #include "FWCore/Framework/interface/Event.h"
 #include "FWCore/Framework/interface/EventSetup.h"
+#include "FWCore/Framework/interface/Run.h"
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
 #include "FWCore/ServiceRegistry/interface/Service.h"
 
 #include "TH1D.h"
 
 #include "OSUT3Analysis/AnaTools/interface/AnalysisTypes.h"
+#include "OSUT3Analysis/AnaTools/interface/CommonUtils.h"
 
-class CutFlowPlotter : public edm::EDAnalyzer
+// Global cache of the CutFlowPlotter, shared by its instances in each stream,
+// which fill their own copies of the cut flow histograms.
+struct CutFlowPlotterCache : public anatools::StreamHistograms
+{
+  CutFlowPlotterCache (const string &channel) :
+    channel (channel)
+  {
+  }
+
+  string channel;
+};
+
+class CutFlowPlotter : public anatools::StreamHistogramAnalyzer<CutFlowPlotter, CutFlowPlotterCache>
 {
   public:
-    CutFlowPlotter (const edm::ParameterSet &);
+    CutFlowPlotter (const edm::ParameterSet &, const CutFlowPlotterCache *);
     ~CutFlowPlotter ();
 
     void analyze (const edm::Event &, const edm::EventSetup &);
+    void releaseStreamHistograms (vector<TH1 *> &, vector<string> &);
+
+    static std::unique_ptr<CutFlowPlotterCache> initializeGlobalCache (const edm::ParameterSet &);
+    static void globalEndJob (const CutFlowPlotterCache *);
 
   private:
     bool initializeCutFlow ();
@@ -30,22 +49,16 @@ class CutFlowPlotter : public edm::EDAnalyzer
     ////////////////////////////////////////////////////////////////////////////
     edm::ParameterSet  collections_;
     edm::InputTag      cutDecisions_;
-    string             module_type_;
-    string             module_label_;
     bool               firstEvent_;
     ////////////////////////////////////////////////////////////////////////////
 
-    // Objects which can be gotten from the event.
+    // Objects which can be gotten from the event and the run.
     edm::Handle<CutCalculatorPayload> cutDecisions;
+    edm::Handle<CutCalculatorConfiguration> cutConfiguration;
     edm::Handle<TYPE(generatorweights)> generatorweights;
 
-    ////////////////////////////////////////////////////////////////////////////
-    // TFileService object used for interacting with the ROOT file of
-    // histograms and a map for storing the histogram objects.
-    ////////////////////////////////////////////////////////////////////////////
-    edm::Service<TFileService> fs_;
+    // Map for storing the histogram objects of this stream.
     map<string, TH1D *> oneDHists_;
-    ////////////////////////////////////////////////////////////////////////////
 };
 
 #endif
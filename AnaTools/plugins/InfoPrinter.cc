@@ -34,6 +34,10 @@ InfoPrinter::InfoPrinter (const edm::ParameterSet &cfg) :
   sw_->Start ();
 
   unpackValuesToPrint ();
+
+  // Every path starts with the empty string.
+  allTriggers_.patterns.push_back ("");
+  allTriggers_.isSubstring = false;
 }
 
 InfoPrinter::~InfoPrinter ()
@@ -61,11 +65,14 @@ InfoPrinter::analyze (const edm::Event &event, const edm::EventSetup &setup)
   anatools::getRequiredCollections (objectsToGet_, collections_, handles_, event);
 
   //////////////////////////////////////////////////////////////////////////////
-  // Get the cut decisions out of the event.
+  // Get the cut decisions out of the event and the cuts out of the run.
   //////////////////////////////////////////////////////////////////////////////
   event.getByLabel (cutDecisions_, cutDecisions);
+  event.getRun ().getByLabel (cutDecisions_, cutConfiguration);
   if (firstEvent_ && !cutDecisions.isValid ())
     clog << "WARNING: failed to retrieve cut decisions from the event." << endl;
+  if (firstEvent_ && !cutConfiguration.isValid ())
+    clog << "WARNING: failed to retrieve cuts from the run." << endl;
   //////////////////////////////////////////////////////////////////////////////
 
   //////////////////////////////////////////////////////////////////////////////
@@ -169,17 +176,17 @@ InfoPrinter::printTriggerDecision ()
 bool
 InfoPrinter::printCumulativeEventFlags ()
 {
-  if (!cutDecisions.isValid ())
+  if (!cutDecisions.isValid () || !cutConfiguration.isValid ())
     return false;
 
   ss_ << endl;
-  !maxCutWidth_ && (maxCutWidth_ = getMaxWidth (cutDecisions->cuts));
+  !maxCutWidth_ && (maxCutWidth_ = getMaxWidth (cutConfiguration->cuts));
   ss_ << "--------------------------------------------------------------------------------" << endl;
   ss_ << "\033[1;35mcumulative event flags" << "\033[0m" << endl;
   ss_ << "--------------------------------------------------------------------------------" << endl;
   for (auto flag = cutDecisions->cumulativeEventFlags.begin (); flag != cutDecisions->cumulativeEventFlags.end (); flag++)
     {
-      ss_ << "\033[1;34m" << setw (maxCutWidth_) << left << cutDecisions->cuts.at (flag - cutDecisions->cumulativeEventFlags.begin ()).name << "\033[0m";
+      ss_ << "\033[1;34m" << setw (maxCutWidth_) << left << cutConfiguration->cuts.at (flag - cutDecisions->cumulativeEventFlags.begin ()).name << "\033[0m";
       if (*flag)
         ss_ << "\033[1;32mtrue\033[0m" << endl;
       else
@@ -191,17 +198,17 @@ InfoPrinter::printCumulativeEventFlags ()
 bool
 InfoPrinter::printIndividualEventFlags ()
 {
-  if (!cutDecisions.isValid ())
+  if (!cutDecisions.isValid () || !cutConfiguration.isValid ())
     return false;
 
   ss_ << endl;
-  !maxCutWidth_ && (maxCutWidth_ = getMaxWidth (cutDecisions->cuts));
+  !maxCutWidth_ && (maxCutWidth_ = getMaxWidth (cutConfiguration->cuts));
   ss_ << "--------------------------------------------------------------------------------" << endl;
   ss_ << "\033[1;35mindividual event flags" << "\033[0m" << endl;
   ss_ << "--------------------------------------------------------------------------------" << endl;
   for (auto flag = cutDecisions->individualEventFlags.begin (); flag != cutDecisions->individualEventFlags.end (); flag++)
     {
-      ss_ << "\033[1;34m" << setw (maxCutWidth_) << left << cutDecisions->cuts.at (flag - cutDecisions->individualEventFlags.begin ()).name << "\033[0m";
+      ss_ << "\033[1;34m" << setw (maxCutWidth_) << left << cutConfiguration->cuts.at (flag - cutDecisions->individualEventFlags.begin ()).name << "\033[0m";
       if (*flag)
         ss_ << "\033[1;32mtrue\033[0m" << endl;
       else
@@ -213,34 +220,38 @@ InfoPrinter::printIndividualEventFlags ()
 bool
 InfoPrinter::printCumulativeObjectFlags ()
 {
-  if (!cutDecisions.isValid ())
+  if (!cutDecisions.isValid () || !cutConfiguration.isValid ())
     return false;
 
   ss_ << endl;
-  if (!cutDecisions->cumulativeObjectFlags.size ())
+  const FlagMatrix &objectFlags = cutDecisions->cumulativeObjectFlags;
+  if (!objectFlags.nCuts ())
     return true;
-  vector<string> collections;
-  for (const auto &collection : cutDecisions->cumulativeObjectFlags.at (0))
-    collections.push_back (collection.first);
-  sort (collections.begin (), collections.end ());
-  !maxCutWidth_ && (maxCutWidth_ = getMaxWidth (cutDecisions->cuts));
+  vector<unsigned> collections;
+  for (unsigned collection = 0; collection < objectFlags.nCollections (); collection++)
+    {
+      if (objectFlags.has (0, collection))
+        collections.push_back (collection);
+    }
+  !maxCutWidth_ && (maxCutWidth_ = getMaxWidth (cutConfiguration->cuts));
   for (auto collection = collections.begin (); collection != collections.end (); collection++)
     {
       if (collection != collections.begin ())
         ss_ << endl;
       ss_ << "--------------------------------------------------------------------------------" << endl;
-      ss_ << "\033[1;35mcumulative object flags for " << *collection << "\033[0m" << endl;
+      ss_ << "\033[1;35mcumulative object flags for " << cutConfiguration->collections.at (*collection) << "\033[0m" << endl;
       ss_ << "--------------------------------------------------------------------------------" << endl;
-      for (auto cut = cutDecisions->cumulativeObjectFlags.begin (); cut != cutDecisions->cumulativeObjectFlags.end (); cut++)
+      for (unsigned cut = 0; cut < objectFlags.nCuts (); cut++)
         {
-          ss_ << "\033[1;34m" << setw (maxCutWidth_) << left << cutDecisions->cuts.at (cut - cutDecisions->cumulativeObjectFlags.begin ()).name << "\033[0m";
-          for (auto flag = cut->at (*collection).begin (); flag != cut->at (*collection).end (); flag++)
+          ss_ << "\033[1;34m" << setw (maxCutWidth_) << left << cutConfiguration->cuts.at (cut).name << "\033[0m";
+          for (unsigned object = 0; objectFlags.has (cut, *collection) && object < objectFlags.size (*collection); object++)
             {
-              if (flag != cut->at (*collection).begin ())
+              pair<bool, bool> flag = objectFlags.at (cut, *collection, object);
+              if (object)
                 ss_ << ", ";
-              if (flag->second)
+              if (flag.second)
                 {
-                  if (flag->first)
+                  if (flag.first)
                     ss_ << "\033[1;32m1\033[0m";
                   else
                     ss_ << "\033[1;31m0\033[0m";
@@ -259,34 +270,38 @@ InfoPrinter::printCumulativeObjectFlags ()
 bool
 InfoPrinter::printIndividualObjectFlags ()
 {
-  if (!cutDecisions.isValid ())
+  if (!cutDecisions.isValid () || !cutConfiguration.isValid ())
     return false;
 
   ss_ << endl;
-  if (!cutDecisions->individualObjectFlags.size ())
+  const FlagMatrix &objectFlags = cutDecisions->individualObjectFlags;
+  if (!objectFlags.nCuts ())
     return true;
-  vector<string> collections;
-  for (const auto &collection : cutDecisions->individualObjectFlags.at (0))
-    collections.push_back (collection.first);
-  sort (collections.begin (), collections.end ());
-  !maxCutWidth_ && (maxCutWidth_ = getMaxWidth (cutDecisions->cuts));
+  vector<unsigned> collections;
+  for (unsigned collection = 0; collection < objectFlags.nCollections (); collection++)
+    {
+      if (objectFlags.has (0, collection))
+        collections.push_back (collection);
+    }
+  !maxCutWidth_ && (maxCutWidth_ = getMaxWidth (cutConfiguration->cuts));
   for (auto collection = collections.begin (); collection != collections.end (); collection++)
     {
       if (collection != collections.begin ())
         ss_ << endl;
       ss_ << "--------------------------------------------------------------------------------" << endl;
-      ss_ << "\033[1;35mindividual object flags for " << *collection << "\033[0m" << endl;
+      ss_ << "\033[1;35mindividual object flags for " << cutConfiguration->collections.at (*collection) << "\033[0m" << endl;
       ss_ << "--------------------------------------------------------------------------------" << endl;
-      for (auto cut = cutDecisions->individualObjectFlags.begin (); cut != cutDecisions->individualObjectFlags.end (); cut++)
+      for (unsigned cut = 0; cut < objectFlags.nCuts (); cut++)
         {
-          ss_ << "\033[1;34m" << setw (maxCutWidth_) << left << cutDecisions->cuts.at (cut - cutDecisions->individualObjectFlags.begin ()).name << "\033[0m";
-          for (auto flag = cut->at (*collection).begin (); flag != cut->at (*collection).end (); flag++)
+          ss_ << "\033[1;34m" << setw (maxCutWidth_) << left << cutConfiguration->cuts.at (cut).name << "\033[0m";
+          for (unsigned object = 0; objectFlags.has (cut, *collection) && object < objectFlags.size (*collection); object++)
             {
-              if (flag != cut->at (*collection).begin ())
+              pair<bool, bool> flag = objectFlags.at (cut, *collection, object);
+              if (object)
                 ss_ << ", ";
-              if (flag->second)
+              if (flag.second)
                 {
-                  if (flag->first)
+                  if (flag.first)
                     ss_ << "\033[1;32m1\033[0m";
                   else
                     ss_ << "\033[1;31m0\033[0m";
@@ -305,14 +320,14 @@ InfoPrinter::printIndividualObjectFlags ()
 bool
 InfoPrinter::printTriggerFlags ()
 {
-  if (!cutDecisions.isValid ())
+  if (!cutDecisions.isValid () || !cutConfiguration.isValid ())
     return false;
 
   ss_ << endl;
-  !maxTriggerWidth_ && (maxTriggerWidth_ = getMaxWidth (cutDecisions->triggers));
+  !maxTriggerWidth_ && (maxTriggerWidth_ = getMaxWidth (cutConfiguration->triggers));
   for (auto flag = cutDecisions->triggerFlags.begin (); flag != cutDecisions->triggerFlags.end (); flag++)
     {
-      ss_ << "\033[1;34m" << setw (maxTriggerWidth_) << left << cutDecisions->triggers.at (flag - cutDecisions->triggerFlags.begin ()) << "\033[0m";
+      ss_ << "\033[1;34m" << setw (maxTriggerWidth_) << left << cutConfiguration->triggers.at (flag - cutDecisions->triggerFlags.begin ()) << "\033[0m";
       if (*flag)
         ss_ << "\033[1;32mtrue\033[0m" << endl;
       else
@@ -324,14 +339,14 @@ InfoPrinter::printTriggerFlags ()
 bool
 InfoPrinter::printVetoTriggerFlags ()
 {
-  if (!cutDecisions.isValid ())
+  if (!cutDecisions.isValid () || !cutConfiguration.isValid ())
     return false;
 
   ss_ << endl;
-  !maxVetoTriggerWidth_ && (maxVetoTriggerWidth_ = getMaxWidth (cutDecisions->triggersToVeto));
+  !maxVetoTriggerWidth_ && (maxVetoTriggerWidth_ = getMaxWidth (cutConfiguration->triggersToVeto));
   for (auto flag = cutDecisions->vetoTriggerFlags.begin (); flag != cutDecisions->vetoTriggerFlags.end (); flag++)
     {
-      ss_ << "\033[1;34m" << setw (maxVetoTriggerWidth_) << left << cutDecisions->triggersToVeto.at (flag - cutDecisions->vetoTriggerFlags.begin ()) << "\033[0m";
+      ss_ << "\033[1;34m" << setw (maxVetoTriggerWidth_) << left << cutConfiguration->triggersToVeto.at (flag - cutDecisions->vetoTriggerFlags.begin ()) << "\033[0m";
       if (*flag)
         ss_ << "\033[1;32mtrue\033[0m" << endl;
       else
@@ -355,7 +370,7 @@ InfoPrinter::printValuesToPrint ()
         {
           if (value != valueToPrint.valueLookupTree->evaluate ().begin ())
             ss_ << ", ";
-          double v = boost::get<double> (*value);
+          double v = *value;
           if (!IS_INVALID(v))
             ss_ << v;
           else
@@ -375,7 +390,6 @@ InfoPrinter::printAllTriggers (const edm::Event &event)
   ss_ << "--------------------------------------------------------------------------------" << endl;
   ss_ << "\033[1;35mavailable triggers\033[0m" << endl;
   ss_ << "--------------------------------------------------------------------------------" << endl;
-  map<string, pair<bool, unsigned> > triggers;
   if (!handles_.triggers.isValid()) {
     ss_ << "\033[1;31mERROR\033[0m" << " [InfoPrinter::printAllTriggers]:  Invalid triggers handle." << endl;  
     return false; 
@@ -384,38 +398,52 @@ InfoPrinter::printAllTriggers (const edm::Event &event)
     ss_ << "\033[1;31mERROR\033[0m" << " [InfoPrinter::printAllTriggers]:  Invalid prescales handle." << endl;  
     return false; 
   } 
-    
+
+  auto printTrigger = [&](const string &name, bool pass, unsigned prescale)
+    {
+      ss_ << "\033[1;34m" << setw (maxAllTriggerWidth_) << left << name << "\033[0m";
+      if (pass)
+        ss_ << "\033[1;32maccept\033[0m  ";
+      else
+        ss_ << "\033[1;31mreject\033[0m  ";
+      if (prescale == 1)
+        ss_ << "\033[1;33m" << prescale << "\033[0m" << endl;
+      else
+        ss_ << "\033[2;33m" << prescale << "\033[0m" << endl;
+    };
+
 #if DATA_FORMAT == BEAN
+  map<string, pair<bool, unsigned> > triggers;
   for (const auto &trigger : *handles_.triggers)
-    {
-      string name = trigger.name;
-      bool pass = trigger.pass;
-      unsigned prescale = trigger.prescale;
+    triggers[trigger.name] = make_pair (trigger.pass, trigger.prescale);
+  !maxAllTriggerWidth_ && (maxAllTriggerWidth_ = getMaxWidth (triggers));
+  for (const auto &trigger : triggers)
+    printTrigger (trigger.first, trigger.second.first, trigger.second.second);
 #elif DATA_FORMAT == MINI_AOD || DATA_FORMAT == AOD || DATA_FORMAT == MINI_AOD_CUSTOM  
+  //////////////////////////////////////////////////////////////////////////////
+  // Sort the paths by name only when the trigger names change, rather than
+  // for every event.
+  //////////////////////////////////////////////////////////////////////////////
   const edm::TriggerNames &triggerNames = event.triggerNames (*handles_.triggers);
-  for (unsigned i = 0; i < triggerNames.size (); i++)
+  if (anatools::updateTriggerIndex (allTriggers_, triggerNames))
     {
-      string name = triggerNames.triggerName (i);
-      bool pass = handles_.triggers->accept (i);
-      unsigned prescale = handles_.prescales->getPrescaleForIndex (i);
-#else
-  #error "Data format is not valid."
-#endif
-      triggers[name] = make_pair (pass, prescale);
+      vector<unsigned> &paths = allTriggers_.paths.at (0);
+      sort (paths.begin (), paths.end (), [&](unsigned a, unsigned b) -> bool { return triggerNames.triggerName (a) < triggerNames.triggerName (b); });
+      allTriggerNames_.clear ();
+      for (const auto &path : paths)
+        allTriggerNames_.push_back (triggerNames.triggerName (path));
     }
-  !maxAllTriggerWidth_ && (maxAllTriggerWidth_ = getMaxWidth (triggers));
-  for (const auto &trigger : triggers)
+  //////////////////////////////////////////////////////////////////////////////
+
+  !maxAllTriggerWidth_ && (maxAllTriggerWidth_ = getMaxWidth (allTriggerNames_));
+  for (unsigned i = 0; i < allTriggers_.paths.at (0).size (); i++)
     {
-      ss_ << "\033[1;34m" << setw (maxAllTriggerWidth_) << left << trigger.first << "\033[0m";
-      if (trigger.second.first)
-        ss_ << "\033[1;32maccept\033[0m  ";
-      else
-        ss_ << "\033[1;31mreject\033[0m  ";
-      if (trigger.second.second == 1)
-        ss_ << "\033[1;33m" << trigger.second.second << "\033[0m" << endl;
-      else
-        ss_ << "\033[2;33m" << trigger.second.second << "\033[0m" << endl;
+      unsigned path = allTriggers_.paths.at (0).at (i);
+      printTrigger (allTriggerNames_.at (i), handles_.triggers->accept (path), handles_.prescales->getPrescaleForIndex (path));
     }
+#else
+  #error "Data format is not valid."
+#endif
 
   return true;
 }
@@ -573,7 +601,8 @@ InfoPrinter::unpackValuesToPrint ()
       valuesToPrint.back ().inputLabel = anatools::concatenateInputCollection (valuesToPrint.back ().inputCollections);
       valuesToPrint.back ().valueToPrint = value.getParameter<string> ("valueToPrint");
 
-      objectsToGet_.insert (valuesToPrint.back ().inputCollections.begin (), valuesToPrint.back ().inputCollections.end ());
+      vector<string> requiredCollections = ValueLookupTree::getRequiredCollections (valuesToPrint.back ().valueToPrint, valuesToPrint.back ().inputCollections);
+      objectsToGet_.insert (requiredCollections.begin (), requiredCollections.end ());
     }
   if (printAllTriggers_)
     {
@@ -11,6 +11,7 @@
 #include "FWCore/Framework/interface/EDAnalyzer.h"
 #include "FWCore/Framework/interface/Event.h"
 #include "FWCore/Framework/interface/EventSetup.h"
+#include "FWCore/Framework/interface/Run.h"
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
 
 #include "TStopwatch.h"
@@ -95,13 +96,20 @@ class InfoPrinter : public edm::EDAnalyzer
     // destructor is called, where it is printed to the screen.
     stringstream ss_;
 
-    // Cut decisions which are gotten from the event.
+    // Cut decisions which are gotten from the event, and the cuts themselves,
+    // which are gotten from the run.
     edm::Handle<CutCalculatorPayload> cutDecisions;
+    edm::Handle<CutCalculatorConfiguration> cutConfiguration;
 
     ValuesToPrint valuesToPrint;
 
     unordered_set<string>  objectsToGet_;
 
+    // All the trigger paths, sorted by name, which are only sorted again when
+    // the trigger names change.
+    TriggerIndex    allTriggers_;
+    vector<string>  allTriggerNames_;
+
     ////////////////////////////////////////////////////////////////////////////
     // Variables for holding the widths of columns of cut names and trigger
     // names.
@@ -1,17 +1,26 @@
 #include "OSUT3Analysis/AnaTools/plugins/PUAnalyzer.h"
 
-PUAnalyzer::PUAnalyzer (const edm::ParameterSet &cfg) :
+PUAnalyzer::PUAnalyzer (const edm::ParameterSet &cfg, const anatools::StreamHistograms *cache) :
   pileUpInfo_ (cfg.getParameter<edm::InputTag> ("pileUpInfos"))
 {
   TH1::SetDefaultSumw2 ();
   
-  oneDHists_["pileup"] = fs_->make<TH1D> ("pileup",";pileup", 65, 0, 65);
+  TH1AddDirectorySentry sentry (false);
+  oneDHists_["pileup"] = new TH1D ("pileup",";pileup", 65, 0, 65);
 }
 
 PUAnalyzer::~PUAnalyzer ()
 {
 }
 
+void
+PUAnalyzer::releaseStreamHistograms (vector<TH1 *> &histograms, vector<string> &subdirectories)
+{
+  for (const auto &histogram : oneDHists_)
+    histograms.push_back (histogram.second);
+  oneDHists_.clear ();
+}
+
 void
 PUAnalyzer::analyze (const edm::Event &event, const edm::EventSetup &setup)
 {
@@ -10,7 +10,7 @@
 #include "TROOT.h"
 #include "TStyle.h"
 
-#include "FWCore/Framework/interface/EDAnalyzer.h"
+#include "FWCore/Framework/interface/stream/EDAnalyzer.h"
 #include "FWCore/Framework/interface/Event.h"
 #include "FWCore/Framework/interface/Run.h"
 #include "FWCore/Framework/interface/EventSetup.h"
@@ -19,23 +19,23 @@
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
 #include "DataFormats/Common/interface/Handle.h"
 #include "CommonTools/UtilAlgos/interface/TFileService.h"
+#include "CommonTools/Utils/interface/TH1AddDirectorySentry.h"
 #include "SimDataFormats/PileupSummaryInfo/interface/PileupSummaryInfo.h"
 #include "OSUT3Analysis/AnaTools/interface/AnalysisTypes.h"
+#include "OSUT3Analysis/AnaTools/interface/CommonUtils.h"
 
-class PUAnalyzer : public edm::EDAnalyzer
+class PUAnalyzer : public anatools::StreamHistogramAnalyzer<PUAnalyzer>
 {
  public:
-  PUAnalyzer (const edm::ParameterSet &);
+  PUAnalyzer (const edm::ParameterSet &, const anatools::StreamHistograms *);
   virtual ~PUAnalyzer ();
-  void beginJob () {};
   void analyze (const edm::Event &, const edm::EventSetup &);
-  void endJob () {};
+  void releaseStreamHistograms (vector<TH1 *> &, vector<string> &);
 
  private:
   edm::InputTag pileUpInfo_;
 
   std::map<std::string, TH1D*> oneDHists_;
-  edm::Service<TFileService> fs_;
 
 };
 
@@ -4,17 +4,37 @@
 
 #define EXIT_CODE 5
 
+// number of values buffered for each histogram before they are filled
+#define FILL_BUFFER_SIZE 256
+
 // The Plotter class handles user-defined histograms
 // As input, it takes:
 //   1. histogram definitions
 //   2. names of miniAOD collections to be used
 // It outputs a root file with corresponding histograms
+// There is one Plotter for each stream, filling its own copies of the
+// histograms, and the copies are added together at the end of the job
+
+std::unique_ptr<PlotterCache>
+Plotter::initializeGlobalCache (const edm::ParameterSet &cfg)
+{
+  // load the expressions compiled ahead of time, if any, before any tree is
+  // built, and ask for the code of the expressions used in this job, if
+  // requested
+  string generatedCode = cfg.getUntrackedParameter<string> ("generatedCode", "");
+  ValueLookupTree::loadPrecompiled (cfg.getUntrackedParameter<string> ("precompiledCode", ""));
+  ValueLookupTree::requestCode (generatedCode);
+
+  return std::unique_ptr<PlotterCache> (new PlotterCache (generatedCode));
+}
 
-Plotter::Plotter (const edm::ParameterSet &cfg) :
+////////////////////////////////////////////////////////////////////////
+
+Plotter::Plotter (const edm::ParameterSet &cfg, const PlotterCache *cache) :
 
   // In the constructor, we parse the input histogram definitions
-  // We create the appropriate directory structure in the output file
-  // Then we book the TH1/TH2 objects in these directories
+  // Then we book the TH1/TH2 objects for this stream, which are put in the
+  // appropriate directories of the output file at the end of the job
 
   /// Retrieve parameters from the configuration file.
   collections_ (cfg.getParameter<edm::ParameterSet> ("collections")),
@@ -29,11 +49,15 @@ Plotter::Plotter (const edm::ParameterSet &cfg) :
   if (verbose_) clog << "Beginning Plotter::Plotter constructor." << endl;
 
   TH1::SetDefaultSumw2();
+  TH1AddDirectorySentry sentry(false);
 
   /////////////////////////////////////
   // parse the histogram definitions //
   /////////////////////////////////////
 
+  // keys of the form "directory/name" of the histograms found so far
+  unordered_set<string> histogramKeys;
+
   // loop over each histogram set the user has included
   for(unsigned histoSet = 0; histoSet != histogramSets_.size(); histoSet++){
 
@@ -56,11 +80,14 @@ Plotter::Plotter (const edm::ParameterSet &cfg) :
       // parse the definition to get the relevant info
       HistoDef histoDefinition = parseHistoDef(*histogram,inputCollection,catInputCollection,directoryName);
 
+      // get every collection read by the variables, e.g., the trigger objects for trigobjDeltaR()
+      for(vector<string>::const_iterator inputVariable = histoDefinition.inputVariables.begin(); inputVariable != histoDefinition.inputVariables.end(); ++inputVariable){
+        vector<string> requiredCollections = ValueLookupTree::getRequiredCollections(*inputVariable, inputCollection);
+        objectsToGet_.insert(requiredCollections.begin(), requiredCollections.end());
+      }
+
       // check whether a histogram of the same name / directory already exists; if not, add to the master list
-      bool alreadyExists = false;
-      for (vector<HistoDef>::iterator h = histogramDefinitions.begin(); h != histogramDefinitions.end(); ++h)
-        if (h->name      == histoDefinition.name &&
-            h->directory == histoDefinition.directory) { alreadyExists = true; break; }
+      bool alreadyExists = !histogramKeys.insert(histoDefinition.directory + "/" + histoDefinition.name).second;
       if (alreadyExists) cerr << "WARNING:  Found duplicate histogram in directory " << histoDefinition.directory
                               << " with name " << histoDefinition.name
                               << "; will only keep the first instance." << endl;
@@ -74,7 +101,7 @@ Plotter::Plotter (const edm::ParameterSet &cfg) :
   vector<HistoDef>::iterator histogram;
   for(histogram = histogramDefinitions.begin(); histogram != histogramDefinitions.end(); ++histogram){
 
-    // book a TH1/TH2 in the appropriate folder
+    // book a TH1/TH2 and keep a pointer to it
     bookHistogram(*histogram);
 
   } // end loop on parsed histograms
@@ -85,11 +112,9 @@ Plotter::Plotter (const edm::ParameterSet &cfg) :
 
   for(unsigned weightDef = 0; weightDef != weightDefs_.size(); weightDef++){
     vector<string> inputCollections = weightDefs_.at(weightDef).getParameter<vector<string> > ("inputCollections");
-    vector<string>::iterator inputCollection;
-    for(inputCollection = inputCollections.begin(); inputCollection != inputCollections.end(); ++inputCollection){
-      objectsToGet_.insert(*inputCollection);
-    }
     string inputVariable = weightDefs_.at(weightDef).getParameter<string> ("inputVariable");
+    vector<string> requiredCollections = ValueLookupTree::getRequiredCollections(inputVariable, inputCollections);
+    objectsToGet_.insert(requiredCollections.begin(), requiredCollections.end());
     Weight weight;
     weight.inputCollections = inputCollections;
     weight.inputVariable = inputVariable;
@@ -124,28 +149,59 @@ Plotter::analyze (const edm::Event &event, const edm::EventSetup &setup)
       exit (EXIT_CODE);
     }
 
+  double eventWeight = 1.0;
+  if (handles_.generatorweights.isValid ())
+    eventWeight *= anatools::getGeneratorWeight (*handles_.generatorweights);
   for (vector<Weight>::iterator weight = weights.begin (); weight != weights.end (); weight++)
     {
       weight->product = 1.0;
-      for(vector<Leaf>::const_iterator leaf = weight->valueLookupTree->evaluate ().begin (); leaf != weight->valueLookupTree->evaluate ().end (); leaf++){
- 	double value = boost::get<double> (*leaf);
+      for(vector<double>::const_iterator leaf = weight->valueLookupTree->evaluate ().begin (); leaf != weight->valueLookupTree->evaluate ().end (); leaf++){
+ 	double value = *leaf;
  	if(IS_INVALID(value))
  	  continue;
         weight->product *= value;
       }
+      eventWeight *= weight->product;
     }
 
   // now we'll loop over the histograms, filling each one as we go
 
   vector<HistoDef>::iterator histogram;
   for(histogram = histogramDefinitions.begin(); histogram != histogramDefinitions.end(); ++histogram)
-    fillHistogram (*histogram);
+    fillHistogram (*histogram, eventWeight);
 
   firstEvent_ = false;
 }
 
 ////////////////////////////////////////////////////////////////////////
 
+void
+Plotter::releaseStreamHistograms (vector<TH1 *> &histograms, vector<string> &directories)
+{
+  // fill whatever values are still buffered before the histograms are handed
+  // over
+  for (auto &histogram : histogramDefinitions)
+    {
+      flushHistogram (histogram);
+      histograms.push_back (histogram.histogram);
+      directories.push_back (histogram.directory);
+      histogram.histogram = NULL;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////
+
+void
+Plotter::globalEndJob (const PlotterCache *cache)
+{
+  anatools::writeStreamHistograms (*cache);
+
+  // the code is written by whichever module asking for it finishes last
+  ValueLookupTree::releaseCode (cache->generatedCode);
+}
+
+////////////////////////////////////////////////////////////////////////
+
 Plotter::~Plotter ()
 {
   for (auto &histogram : histogramDefinitions)
@@ -195,6 +251,7 @@ HistoDef Plotter::parseHistoDef(const edm::ParameterSet &definition, const vecto
   parsedDef.hasVariableBinsY = parsedDef.binsY.size() > 3;
   parsedDef.inputVariables = definition.getParameter<vector<string> >("inputVariables");
   parsedDef.dimensions = parsedDef.inputVariables.size();
+  parsedDef.histogram = NULL;
 
   // for 1D histograms, set the appropriate y-axis label
   parsedDef.title = setYaxisLabel(parsedDef);
@@ -205,8 +262,8 @@ HistoDef Plotter::parseHistoDef(const edm::ParameterSet &definition, const vecto
 
 ////////////////////////////////////////////////////////////////////////
 
-// book TH1 or TH2 in appropriate directory with correct bin options
-void Plotter::bookHistogram(const HistoDef definition){
+// book TH1 or TH2 for this stream with correct bin options
+void Plotter::bookHistogram(HistoDef &definition){
 
   // check for valid bins
   bool hasValidBinsX = definition.binsX.size() >= 3;
@@ -223,67 +280,65 @@ void Plotter::bookHistogram(const HistoDef definition){
     return;
   }
 
-  TFileDirectory subdir = fs_->mkdir(definition.directory);
-
   // book 1D histogram
   if(definition.dimensions == 1){
     // equal X bins
     if(!definition.hasVariableBinsX){
-      subdir.make<TH1D>(TString(definition.name),
-                        TString(definition.title),
-                        definition.binsX.at(0),
-                        definition.binsX.at(1),
-                        definition.binsX.at(2));
+      definition.histogram = new TH1D(TString(definition.name),
+                                      TString(definition.title),
+                                      definition.binsX.at(0),
+                                      definition.binsX.at(1),
+                                      definition.binsX.at(2));
     }
     // variable X bins
     else{
-      subdir.make<TH1D>(TString(definition.name),
-                        TString(definition.title),
-                        definition.binsX.size() - 1,
-                        definition.binsX.data());
+      definition.histogram = new TH1D(TString(definition.name),
+                                      TString(definition.title),
+                                      definition.binsX.size() - 1,
+                                      definition.binsX.data());
     }
   }
   // book 2D histogram
   else if(definition.dimensions == 2){
     // equal X bins and equal Y bins
     if(!definition.hasVariableBinsX && !definition.hasVariableBinsY){
-      subdir.make<TH2D>(TString(definition.name),
-                        TString(definition.title),
-                        definition.binsX.at(0),
-                        definition.binsX.at(1),
-                        definition.binsX.at(2),
-                        definition.binsY.at(0),
-                        definition.binsY.at(1),
-                        definition.binsY.at(2));
+      definition.histogram = new TH2D(TString(definition.name),
+                                      TString(definition.title),
+                                      definition.binsX.at(0),
+                                      definition.binsX.at(1),
+                                      definition.binsX.at(2),
+                                      definition.binsY.at(0),
+                                      definition.binsY.at(1),
+                                      definition.binsY.at(2));
     }
     // variable X bins and equal Y bins
     else if(definition.hasVariableBinsX && !definition.hasVariableBinsY){
-      subdir.make<TH2D>(TString(definition.name),
-                        TString(definition.title),
-                        definition.binsX.size() - 1,
-                        definition.binsX.data(),
-                        definition.binsY.at(0),
-                        definition.binsY.at(1),
-                        definition.binsY.at(2));
+      definition.histogram = new TH2D(TString(definition.name),
+                                      TString(definition.title),
+                                      definition.binsX.size() - 1,
+                                      definition.binsX.data(),
+                                      definition.binsY.at(0),
+                                      definition.binsY.at(1),
+                                      definition.binsY.at(2));
     }
     // equal X bins and variable Y bins
     else if(!definition.hasVariableBinsX && definition.hasVariableBinsY){
-      subdir.make<TH2D>(TString(definition.name),
-                        TString(definition.title),
-                        definition.binsX.at(0),
-                        definition.binsX.at(1),
-                        definition.binsX.at(2),
-                        definition.binsY.size() - 1,
-                        definition.binsY.data());
+      definition.histogram = new TH2D(TString(definition.name),
+                                      TString(definition.title),
+                                      definition.binsX.at(0),
+                                      definition.binsX.at(1),
+                                      definition.binsX.at(2),
+                                      definition.binsY.size() - 1,
+                                      definition.binsY.data());
     }
     // variable X bins and variable Y bins
     else if(definition.hasVariableBinsX && definition.hasVariableBinsY){
-      subdir.make<TH2D>(TString(definition.name),
-                        TString(definition.title),
-                        definition.binsX.size() - 1,
-                        definition.binsX.data(),
-                        definition.binsY.size() - 1,
-                        definition.binsY.data());
+      definition.histogram = new TH2D(TString(definition.name),
+                                      TString(definition.title),
+                                      definition.binsX.size() - 1,
+                                      definition.binsX.data(),
+                                      definition.binsY.size() - 1,
+                                      definition.binsY.data());
     }
   }
   else{
@@ -291,46 +346,67 @@ void Plotter::bookHistogram(const HistoDef definition){
     return;
   }
 
+  setHistoAxis(definition.axisX, definition.histogram->GetXaxis());
+  setHistoAxis(definition.axisY, definition.histogram->GetYaxis());
+
+}
+
+////////////////////////////////////////////////////////////////////////
+
+// copy the binning of a booked axis so that values can be binned without it
+void Plotter::setHistoAxis(HistoAxis &axis, const TAxis *bookedAxis){
+
+  axis.nBins = bookedAxis->GetNbins();
+  axis.min = bookedAxis->GetXmin();
+  axis.max = bookedAxis->GetXmax();
+
+  const TArrayD *edges = bookedAxis->GetXbins();
+  axis.edges.assign(edges->GetArray(), edges->GetArray() + edges->GetSize());
+
+  // TAxis::GetBinWidth gives the underflow and overflow the widths of the
+  // first and last bins
+  axis.widths.resize(axis.nBins + 2);
+  for(int bin = 0; bin <= axis.nBins + 1; bin++)
+    axis.widths.at(bin) = bookedAxis->GetBinWidth(bin);
+
 }
 
 ////////////////////////////////////////////////////////////////////////
 
 // fill TH1 or TH2 using one collection
-void Plotter::fillHistogram(const HistoDef &definition){
+void Plotter::fillHistogram(HistoDef &definition, const double weight){
+
+  // nothing to fill if the histogram could not be booked
+  if(!definition.histogram) return;
 
- if(definition.dimensions == 1){
-   fill1DHistogram(definition);
+  if(definition.dimensions == 1){
+    fill1DHistogram(definition, weight);
   }
   else if(definition.dimensions == 2){
-    fill2DHistogram(definition);
+    fill2DHistogram(definition, weight);
   }
   else{
     cout << "WARNING - Histogram dimension error" << endl;
   }
 
+  if(definition.bufferWeights.size() >= FILL_BUFFER_SIZE)
+    flushHistogram(definition);
+
 }
 
 ////////////////////////////////////////////////////////////////////////
 
 // fill TH1 using one collection
-void Plotter::fill1DHistogram(const HistoDef &definition){
+void Plotter::fill1DHistogram(HistoDef &definition, const double weight){
 
-  TH1D *histogram = fs_->getObject<TH1D>(definition.name, definition.directory);
-
-  // loop over objects in input collection and fill histogram
-  for(vector<Leaf>::const_iterator leaf = definition.valueLookupTrees.at (0)->evaluate ().begin (); leaf != definition.valueLookupTrees.at (0)->evaluate ().end (); leaf++){
-    double value = boost::get<double> (*leaf),
-           weight = 1.0;
+  // loop over objects in input collection and buffer their values
+  const vector<double> &values = definition.valueLookupTrees.at (0)->evaluate ();
+  for(vector<double>::const_iterator leaf = values.begin (); leaf != values.end (); leaf++){
+    double value = *leaf;
     if(IS_INVALID(value))
       continue;
-    if(definition.hasVariableBinsX){
-      weight /= getBinSize(histogram,value);
-    }
-    if (handles_.generatorweights.isValid ())
-      weight *= anatools::getGeneratorWeight (*handles_.generatorweights);
-    for (vector<Weight>::iterator sf = weights.begin (); sf != weights.end (); sf++)
-      weight *= sf->product;
-    histogram->Fill(value, weight);
+    definition.bufferX.push_back(value);
+    definition.bufferWeights.push_back(weight);
     if (verbose_) clog << "Filled histogram " << definition.name << " with value=" << value << ", weight=" << weight << endl;
 
   }
@@ -340,32 +416,31 @@ void Plotter::fill1DHistogram(const HistoDef &definition){
 ////////////////////////////////////////////////////////////////////////
 
 // fill TH2 using one collection
-void Plotter::fill2DHistogram(const HistoDef &definition){
+void Plotter::fill2DHistogram(HistoDef &definition, const double weight){
 
-  double weight = 1.0;
-  for (vector<Weight>::iterator sf = weights.begin (); sf != weights.end (); sf++)
-    weight *= sf->product;
+  const vector<double> &valuesX = definition.valueLookupTrees.at (0)->evaluate (),
+                       &valuesY = definition.valueLookupTrees.at (1)->evaluate ();
 
   if (definition.inputCollections.size() == 1) {
     // If there is only one input collection, then fill the 2D histogram once per object.
     // To do that, increment each lookup tree in parallel.
-    for (vector<Leaf>::const_iterator leafX = definition.valueLookupTrees.at (0)->evaluate ().begin (),
-	   leafY = definition.valueLookupTrees.at (1)->evaluate ().begin();
-	 leafX != definition.valueLookupTrees.at (0)->evaluate ().end () &&
-         leafY != definition.valueLookupTrees.at (1)->evaluate ().end ();
+    for (vector<double>::const_iterator leafX = valuesX.begin (),
+	   leafY = valuesY.begin();
+	 leafX != valuesX.end () &&
+         leafY != valuesY.end ();
 	 leafX++, leafY++) {
-      double valueX = boost::get<double> (*leafX),
-	valueY = boost::get<double> (*leafY);
+      double valueX = *leafX,
+	valueY = *leafY;
       fill2DHistogram(definition, valueX, valueY, weight);
     }
 
   } else {
     // If there is more than one input collection, then fill the 2D histogram for each combination of objects.
     // Warning:  This histogram may be difficult to interpret!
-    for(vector<Leaf>::const_iterator leafX = definition.valueLookupTrees.at (0)->evaluate ().begin (); leafX != definition.valueLookupTrees.at (0)->evaluate ().end (); leafX++){
-      for(vector<Leaf>::const_iterator leafY = definition.valueLookupTrees.at (1)->evaluate ().begin (); leafY != definition.valueLookupTrees.at (1)->evaluate ().end (); leafY++){
-	double valueX = boost::get<double> (*leafX),
-	  valueY = boost::get<double> (*leafY);
+    for(vector<double>::const_iterator leafX = valuesX.begin (); leafX != valuesX.end (); leafX++){
+      for(vector<double>::const_iterator leafY = valuesY.begin (); leafY != valuesY.end (); leafY++){
+	double valueX = *leafX,
+	  valueY = *leafY;
 	fill2DHistogram(definition, valueX, valueY, weight);
       }
     }
@@ -375,51 +450,92 @@ void Plotter::fill2DHistogram(const HistoDef &definition){
 
 ////////////////////////////////////////////////////////////////////////
 
-void Plotter::fill2DHistogram(const HistoDef & definition, double valueX, double valueY, double weight) {
+void Plotter::fill2DHistogram(HistoDef & definition, double valueX, double valueY, double weight) {
 
-  TH2D *histogram = fs_->getObject<TH2D>(definition.name, definition.directory);
-  if (!histogram) {
-    clog << "ERROR [Plotter::fill2DHistogram]:  Could not find histogram with name " << definition.name
-	 << " in directory " << definition.directory << endl;
-    return;
-  }
   if(IS_INVALID(valueX) || IS_INVALID(valueY))
     return;
-  if(definition.hasVariableBinsX){
-    weight /= getBinSize(histogram,valueX,valueY).first;
-  }
-  if(definition.hasVariableBinsY){
-    weight /= getBinSize(histogram,valueX,valueY).second;
-  }
-  if (handles_.generatorweights.isValid ())
-    weight *= anatools::getGeneratorWeight (*handles_.generatorweights);
-  histogram->Fill(valueX, valueY, weight);
+  definition.bufferX.push_back(valueX);
+  definition.bufferY.push_back(valueY);
+  definition.bufferWeights.push_back(weight);
   if (verbose_) clog << "Filled histogram " << definition.name << " with valueX=" << valueX << ", valueY=" << valueY << ", weight=" << weight << endl;
 
 }
 
-
 ////////////////////////////////////////////////////////////////////////
 
-double Plotter::getBinSize(TH1D *histogram,
-                           const double value){
+// fill the buffered values of a histogram in one go, binning them with the
+// axes copied at booking rather than with TH1::Fill, and updating the
+// statistics the same way TH1::Fill would
+void Plotter::flushHistogram(HistoDef &definition){
 
-  int binIndex = histogram->FindBin(value);
-  double binSize = histogram->GetBinWidth(binIndex);
+  TH1 *histogram = definition.histogram;
+  unsigned nValues = definition.bufferWeights.size();
+  if(!histogram || !nValues) return;
 
-  return binSize;
+  if(!histogram->GetSumw2N()) histogram->Sumw2();
+  TArrayD &sumw2 = *histogram->GetSumw2();
+  bool statOverflows = TH1::GetStatOverflows();
 
-}
+  double stats[TH1::kNstat];
+  fill(stats, stats + TH1::kNstat, 0.0);
+  histogram->GetStats(stats);
 
-pair<double,double>  Plotter::getBinSize(TH2D *histogram,
-                                         const double valueX,
-                                         const double valueY){
+  const HistoAxis &axisX = definition.axisX,
+                  &axisY = definition.axisY;
+
+  if(definition.dimensions == 1){
+    for(unsigned i = 0; i < nValues; i++){
+      double x = definition.bufferX.at(i),
+             w = definition.bufferWeights.at(i);
+      int binX = axisX.findBin(x);
+
+      // weight by the inverse of the bin width if the bins are variable
+      if(definition.hasVariableBinsX) w /= axisX.widths.at(binX);
+
+      histogram->AddBinContent(binX, w);
+      sumw2[binX] += w * w;
+      if((binX == 0 || binX > axisX.nBins) && !statOverflows) continue;
+      stats[0] += w;
+      stats[1] += w * w;
+      stats[2] += w * x;
+      stats[3] += w * x * x;
+    }
+  }
+  else{
+    for(unsigned i = 0; i < nValues; i++){
+      double x = definition.bufferX.at(i),
+             y = definition.bufferY.at(i),
+             w = definition.bufferWeights.at(i);
+      int binX = axisX.findBin(x),
+          binY = axisY.findBin(y),
+          bin = binX + (axisX.nBins + 2) * binY;
+
+      // weight by the inverse of the widths of the x and y bins of the value;
+      // before the fill buffers, the widths were looked up with the global bin
+      // number instead, so 2D histograms with variable bins differ from those
+      // made with earlier versions
+      if(definition.hasVariableBinsX) w /= axisX.widths.at(binX);
+      if(definition.hasVariableBinsY) w /= axisY.widths.at(binY);
+
+      histogram->AddBinContent(bin, w);
+      sumw2[bin] += w * w;
+      if((binX == 0 || binX > axisX.nBins || binY == 0 || binY > axisY.nBins) && !statOverflows) continue;
+      stats[0] += w;
+      stats[1] += w * w;
+      stats[2] += w * x;
+      stats[3] += w * x * x;
+      stats[4] += w * y;
+      stats[5] += w * y * y;
+      stats[6] += w * x * y;
+    }
+  }
 
-  int binIndex = histogram->FindBin(valueX, valueY);
-  double binSizeX = histogram->GetXaxis()->GetBinWidth(binIndex);
-  double binSizeY = histogram->GetYaxis()->GetBinWidth(binIndex);
+  histogram->PutStats(stats);
+  histogram->SetEntries(histogram->GetEntries() + nValues);
 
-  return make_pair(binSizeX, binSizeY);
+  definition.bufferX.clear();
+  definition.bufferY.clear();
+  definition.bufferWeights.clear();
 
 }
 
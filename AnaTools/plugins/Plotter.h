@@ -3,25 +3,43 @@
 
 #include <unordered_set>
 
-#include "FWCore/Framework/interface/EDAnalyzer.h"
+#include "FWCore/Framework/interface/stream/EDAnalyzer.h"
 #include "FWCore/Framework/interface/Event.h"
 #include "FWCore/Framework/interface/EventSetup.h"
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
 #include "FWCore/ServiceRegistry/interface/Service.h"
 #include "CommonTools/UtilAlgos/interface/TFileService.h"
+#include "CommonTools/Utils/interface/TH1AddDirectorySentry.h"
 
 #include "OSUT3Analysis/AnaTools/interface/AnalysisTypes.h"
+#include "OSUT3Analysis/AnaTools/interface/CommonUtils.h"
 
 #include "TH1.h"
 #include "TH2.h"
 
-class Plotter : public edm::EDAnalyzer
+// Global cache of the Plotter, shared by its instances in each stream, which
+// book and fill their own copies of the histograms.
+struct PlotterCache : public anatools::StreamHistograms
+{
+  PlotterCache (const string &generatedCode) :
+    generatedCode (generatedCode)
+  {
+  }
+
+  string generatedCode;
+};
+
+class Plotter : public anatools::StreamHistogramAnalyzer<Plotter, PlotterCache>
 {
     public:
 
-      Plotter (const edm::ParameterSet &);
+      Plotter (const edm::ParameterSet &, const PlotterCache *);
       ~Plotter ();
       void analyze(const edm::Event&, const edm::EventSetup&);
+      void releaseStreamHistograms(vector<TH1 *> &, vector<string> &);
+
+      static std::unique_ptr<PlotterCache> initializeGlobalCache(const edm::ParameterSet &);
+      static void globalEndJob(const PlotterCache *);
 
     private:
 
@@ -37,8 +55,6 @@ class Plotter : public edm::EDAnalyzer
       bool initializeValueLookupForest (vector<HistoDef> &, Collections *);
       bool initializeValueLookupForest (vector<Weight> &, Collections *);
 
-      edm::Service<TFileService> fs_;
-
       unordered_set<string> objectsToGet_;
 
       vector<TFileDirectory> subDirs;
@@ -51,19 +67,18 @@ class Plotter : public edm::EDAnalyzer
       vector<string> getInputTypes(const string);
       string fixOrdering(const string);
       HistoDef parseHistoDef(const edm::ParameterSet &, const vector<string> &, const string &, const string &);
-      void bookHistogram(const HistoDef);
+      void bookHistogram(HistoDef &);
+      void setHistoAxis(HistoAxis &, const TAxis *);
       pair<string,string> getVariableAndFunction(const string);
 
       template <class InputCollection> void fillHistogram(const HistoDef, const InputCollection);
       template <class InputCollection1, class InputCollection2> void fillHistogram(const HistoDef, const InputCollection1, const InputCollection2);
 
-      void fillHistogram(const HistoDef &);
-      void fill1DHistogram(const HistoDef &);
-      void fill2DHistogram(const HistoDef &);
-      void fill2DHistogram(const HistoDef & definition, double valueX, double valueY, double weight); 
-
-      double getBinSize(TH1D *, const double);
-      pair<double,double> getBinSize(TH2D *, const double, const double);
+      void fillHistogram(HistoDef &, const double);
+      void fill1DHistogram(HistoDef &, const double);
+      void fill2DHistogram(HistoDef &, const double);
+      void fill2DHistogram(HistoDef & definition, double valueX, double valueY, double weight);
+      void flushHistogram(HistoDef &);
       string setYaxisLabel(const HistoDef);
 
 
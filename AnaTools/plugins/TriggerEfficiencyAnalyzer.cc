@@ -1,15 +1,15 @@
+#include "OSUT3Analysis/AnaTools/interface/CommonUtils.h"
 #include "OSUT3Analysis/AnaTools/plugins/TriggerEfficiencyAnalyzer.h"
 
-TriggerEfficiencyAnalyzer::TriggerEfficiencyAnalyzer (const edm::ParameterSet &cfg) :
+TriggerEfficiencyAnalyzer::TriggerEfficiencyAnalyzer (const edm::ParameterSet &cfg, const TriggerEfficiencyAnalyzerCache *cache) :
   Trigger_ (cfg.getParameter<edm::InputTag> ("Trigger")),
   triggers_  (cfg.getParameter<vector<edm::ParameterSet> >("triggers"))
 {
 
-  timer = new TStopwatch();
-  timer->Start();
-
   TH1D::SetDefaultSumw2 ();
 
+  TH1AddDirectorySentry sentry (false);
+
   //include all trigger paths of interest, divided up into one histogram for each element of "TriggerTypes"
   for (uint iType=0; iType<triggers_.size(); iType++) {
     string typeName = triggers_.at(iType).getParameter<string>("trigType");
@@ -18,6 +18,8 @@ TriggerEfficiencyAnalyzer::TriggerEfficiencyAnalyzer (const edm::ParameterSet &c
     for (uint iTrig=0; iTrig<trigs_.size(); iTrig++) {
       TriggerNameMap[typeName].push_back(trigs_.at(iTrig));
     }
+    TriggerIndexMap[typeName].patterns = TriggerNameMap[typeName];
+    TriggerIndexMap[typeName].isSubstring = true;
   }
 
   //Set Axis Labels of histograms to names of triggers
@@ -26,8 +28,8 @@ TriggerEfficiencyAnalyzer::TriggerEfficiencyAnalyzer (const edm::ParameterSet &c
     const char* histName = (*triggerType).c_str();
     TString effName = histName;
     effName += "Eff";
-    TriggerHistogramMap[*triggerType] = fs->make<TH1D> (histName, histName, nTriggers+2, 0.0, nTriggers+2);
-    TriggerHistEffMap  [*triggerType] = fs->make<TH1D> (effName,  effName,  nTriggers+2, 0.0, nTriggers+2);
+    TriggerHistogramMap[*triggerType] = new TH1D (histName, histName, nTriggers+2, 0.0, nTriggers+2);
+    TriggerHistEffMap  [*triggerType] = new TH1D (effName,  effName,  nTriggers+2, 0.0, nTriggers+2);
     TriggerHistogramMap[*triggerType]->GetXaxis()->SetBinLabel (1,"Total Events");
     TriggerHistEffMap  [*triggerType]->GetXaxis()->SetBinLabel (1,"Total Events");
     for(int bin = 0; bin != nTriggers; bin++){
@@ -44,10 +46,29 @@ TriggerEfficiencyAnalyzer::TriggerEfficiencyAnalyzer (const edm::ParameterSet &c
 
 TriggerEfficiencyAnalyzer::~TriggerEfficiencyAnalyzer ()
 {
-   for (std::vector<string>::const_iterator triggerType = TriggerTypes.begin(); triggerType != TriggerTypes.end(); triggerType++) {
-     TH1D* h    = TriggerHistogramMap[*triggerType];
-     TH1D* heff = TriggerHistEffMap  [*triggerType];
-     if (!h || !heff) { clog << "ERROR [TriggerEfficiencyAnalyzer]:  could not find histogram." << endl; }
+}
+
+void
+TriggerEfficiencyAnalyzer::releaseStreamHistograms (vector<TH1 *> &histograms, vector<string> &subdirectories)
+{
+  //each histogram is followed by its efficiency
+  for (std::vector<string>::const_iterator triggerType = TriggerTypes.begin(); triggerType != TriggerTypes.end(); triggerType++) {
+    histograms.push_back (TriggerHistogramMap[*triggerType]);
+    histograms.push_back (TriggerHistEffMap  [*triggerType]);
+  }
+  TriggerHistogramMap.clear ();
+  TriggerHistEffMap.clear ();
+}
+
+void
+TriggerEfficiencyAnalyzer::globalEndJob (const TriggerEfficiencyAnalyzerCache *cache)
+{
+   //the efficiencies are computed from the sums of the histograms of all the streams
+   vector<TH1 *> histograms = anatools::writeStreamHistograms (*cache);
+   for (uint iType = 0; iType + 1 < histograms.size(); iType += 2) {
+     TH1* h    = histograms.at(iType);
+     TH1* heff = histograms.at(iType + 1);
+     if (!h || !heff) { clog << "ERROR [TriggerEfficiencyAnalyzer]:  could not find histogram." << endl; continue; }
      double total = h->GetBinContent(1);  // Total number of events.
      heff->SetBinContent(1, 1.0);         // Efficiency in first bin (no trigger requirement) is defined to be 100%.
      heff->SetBinError  (1, h->GetBinError(1) / h->GetBinContent(1));
@@ -62,7 +83,7 @@ TriggerEfficiencyAnalyzer::~TriggerEfficiencyAnalyzer ()
      heff->SetMaximum(1.5);
    }
 
-   timer->Print();
+   cache->timer.Print();
    clog << endl;
    clog << "Successfully completed TriggerEfficiencyAnalyzer." << endl;
 
@@ -88,21 +109,16 @@ TriggerEfficiencyAnalyzer::analyze (const edm::Event &event, const edm::EventSet
   }
 
 
-  //loop over all trigger paths in the event
-  for (unsigned triggerIndex = 0; triggerIndex < triggerNames.size (); triggerIndex++){
-    string name = triggerNames.triggerName(triggerIndex);
-    bool pass = TriggerCollection->accept(triggerIndex);
-    if(pass != 1) continue;
-
-    //loop over the different types of triggers of interest
-    for(std::vector<string>::const_iterator triggerType = TriggerTypes.begin(); triggerType != TriggerTypes.end(); triggerType++){
-      //loop over the different trigger names as specified by the user
-      for(std::vector<string>::const_iterator triggerName = TriggerNameMap[*triggerType].begin(); triggerName != TriggerNameMap[*triggerType].end(); triggerName++){
-        if(name.find(*triggerName)!=std::string::npos){
-	  //	  cout << name << "  " << *triggerName << " " << name.find(*triggerName) << endl;
-          TriggerHistogramMap[*triggerType]->Fill(triggerName-TriggerNameMap[*triggerType].begin()+1);
-          InclusiveORMap[*triggerType] = true;
-        }
+  //loop over the different types of triggers of interest, looking up the paths matching each trigger name only when the trigger names change
+  for(std::vector<string>::const_iterator triggerType = TriggerTypes.begin(); triggerType != TriggerTypes.end(); triggerType++){
+    TriggerIndex &triggerIndex = TriggerIndexMap[*triggerType];
+    anatools::updateTriggerIndex (triggerIndex, triggerNames);
+    //loop over the different trigger names as specified by the user, and over the paths matching each
+    for(uint iTrig = 0; iTrig < triggerIndex.paths.size(); iTrig++){
+      for(std::vector<unsigned>::const_iterator path = triggerIndex.paths.at(iTrig).begin(); path != triggerIndex.paths.at(iTrig).end(); path++){
+        if(!TriggerCollection->accept(*path)) continue;
+        TriggerHistogramMap[*triggerType]->Fill(iTrig+1);
+        InclusiveORMap[*triggerType] = true;
       }
     }
   }
@@ -8,40 +8,58 @@
 #include "TString.h"
 #include "TStopwatch.h"
 
-#include "FWCore/Framework/interface/EDAnalyzer.h"
+#include "FWCore/Framework/interface/stream/EDAnalyzer.h"
 #include "FWCore/Framework/interface/Event.h"
 #include "FWCore/Framework/interface/EventSetup.h"
 #include "FWCore/ParameterSet/interface/ParameterSet.h"
 #include "FWCore/ServiceRegistry/interface/Service.h"
 #include "DataFormats/Common/interface/Handle.h"
 #include "CommonTools/UtilAlgos/interface/TFileService.h"
+#include "CommonTools/Utils/interface/TH1AddDirectorySentry.h"
 #include "FWCore/Framework/interface/MakerMacros.h"
 
 #include "DataFormats/Common/interface/TriggerResults.h"
 #include "FWCore/Common/interface/TriggerNames.h"
 
+#include "OSUT3Analysis/AnaTools/interface/AnalysisTypes.h"
+#include "OSUT3Analysis/AnaTools/interface/CommonUtils.h"
+
 using namespace std;
 
-class TriggerEfficiencyAnalyzer : public edm::EDAnalyzer
+// Global cache of the TriggerEfficiencyAnalyzer, shared by its instances in
+// each stream, which fill their own copies of the histograms.
+struct TriggerEfficiencyAnalyzerCache : public anatools::StreamHistograms
+{
+  TriggerEfficiencyAnalyzerCache ()
+  {
+    timer.Start();
+  }
+
+  mutable TStopwatch timer;
+};
+
+class TriggerEfficiencyAnalyzer : public anatools::StreamHistogramAnalyzer<TriggerEfficiencyAnalyzer, TriggerEfficiencyAnalyzerCache>
   {
     public:
-      TriggerEfficiencyAnalyzer (const edm::ParameterSet &);
+      TriggerEfficiencyAnalyzer (const edm::ParameterSet &, const TriggerEfficiencyAnalyzerCache *);
       ~TriggerEfficiencyAnalyzer ();
 
+      static void globalEndJob (const TriggerEfficiencyAnalyzerCache *);
+
       std::vector<string> TriggerTypes;
       std::map< string, std::vector<string> > TriggerNameMap;
+      std::map< string, TriggerIndex > TriggerIndexMap;
       std::map< string, TH1D* > TriggerHistogramMap;
       std::map< string, TH1D* > TriggerHistEffMap;
       std::map< string, bool > InclusiveORMap;
 
       void analyze (const edm::Event &, const edm::EventSetup &);
-      const edm::Service<TFileService> fs;
+      void releaseStreamHistograms (vector<TH1 *> &, vector<string> &);
 
     private:
       edm::Handle<edm::TriggerResults> TriggerCollection;
       edm::InputTag Trigger_;
       vector<edm::ParameterSet> triggers_;
-      TStopwatch* timer;
 
   };
 
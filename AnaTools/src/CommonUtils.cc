@@ -1,4 +1,10 @@
+#include <atomic>
+#include <mutex>
+
 #include "OSUT3Analysis/AnaTools/interface/CommonUtils.h"
+#include "OSUT3Analysis/AnaTools/interface/MemberTable.h"
+
+#include "TH1.h"
 
 /**
  * Splits the concatenated object label into a vector of individual labels.
@@ -122,57 +128,466 @@ anatools::trim (string &s)
 }
 
 /**
- * Returns whether the first members of the tuples are in ascending order.
+ * Returns the slot of an event variable.
  *
- * This function is meant to be used with std::sort to sort a vector of tuples
- * so that the first members of the tuples are in ascending order.
+ * Each event variable is given a slot the first time its name is seen, either
+ * when an expression using it is compiled or when it is first read from the
+ * event, and keeps it for the rest of the job. The values of all the event
+ * variables in the current event are kept in a flat array indexed by slot.
  *
- * @param  a first of two tuples to compare
- * @param  b second of two tuples to compare
- * @return boolean representing whether the first members of the two tuples are
- *         in ascending order
+ * @param  name name of the event variable
+ * @return index of the event variable in Collections::eventvariableValues
  */
-bool
-anatools::firstOfTupleAscending (tuple<size_t, size_t, string> a, tuple<size_t, size_t, string> b)
+unsigned
+anatools::getEventvariableSlot (const string &name)
 {
-  return (get<0> (a) < get<0> (b));
+  static unordered_map<string, unsigned> slots;
+  return getSlot (slots, name);
 }
 
 /**
- * Returns whether the first members of the tuples are in descending order.
+ * Returns the slot of an event variable, remembering it in the given handles.
  *
- * This function is meant to be used with std::sort to sort a vector of tuples
- * so that the first members of the tuples are in descending order.
+ * The slots of the event variables read by a module are the same in every
+ * event, so they are only looked up in the process-wide table, which is
+ * shared by the modules in every stream, the first time each is seen.
  *
- * @param  a first of two tuples to compare
- * @param  b second of two tuples to compare
- * @return boolean representing whether the first members of the two tuples are
- *         in descending order
+ * @param  name name of the event variable
+ * @param  handles structure in which the slots seen so far are kept
+ * @return index of the event variable in Collections::eventvariableValues
  */
-bool
-anatools::firstOfTupleDescending (tuple<size_t, size_t, string> a, tuple<size_t, size_t, string> b)
+unsigned
+anatools::getEventvariableSlot (const string &name, Collections &handles)
+{
+  auto slot = handles.eventvariableSlots.find (name);
+  if (slot == handles.eventvariableSlots.end ())
+    slot = handles.eventvariableSlots.insert (make_pair (name, getEventvariableSlot (name))).first;
+  return slot->second;
+}
+
+/**
+ * Returns the slot of a user variable.
+ *
+ * Works like getEventvariableSlot, except that the slots index
+ * Collections::uservariableColumns.
+ *
+ * @param  name name of the user variable
+ * @return index of the user variable in Collections::uservariableColumns
+ */
+unsigned
+anatools::getUservariableSlot (const string &name)
+{
+  static unordered_map<string, unsigned> slots;
+  return getSlot (slots, name);
+}
+
+/**
+ * Returns the slot of a user variable, remembering it in the given handles.
+ *
+ * Works like the corresponding getEventvariableSlot.
+ *
+ * @param  name name of the user variable
+ * @param  handles structure in which the slots seen so far are kept
+ * @return index of the user variable in Collections::uservariableColumns
+ */
+unsigned
+anatools::getUservariableSlot (const string &name, Collections &handles)
+{
+  auto slot = handles.uservariableSlots.find (name);
+  if (slot == handles.uservariableSlots.end ())
+    slot = handles.uservariableSlots.insert (make_pair (name, getUservariableSlot (name))).first;
+  return slot->second;
+}
+
+/**
+ * Returns the slot of a name in the given table, adding it if it is new.
+ *
+ * @param  slots table of the names seen so far and their slots
+ * @param  name name to look up
+ * @return slot of the name
+ */
+unsigned
+anatools::getSlot (unordered_map<string, unsigned> &slots, const string &name)
+{
+  static mutex lock;
+
+  lock_guard<mutex> guard (lock);
+  auto slot = slots.find (name);
+  if (slot == slots.end ())
+    slot = slots.insert (make_pair (name, slots.size ())).first;
+  return slot->second;
+}
+
+namespace
+{
+  //////////////////////////////////////////////////////////////////////////////
+  // Functions acting on one member of Collections, instantiated for each
+  // member in the registry of collections. A handle to a vector holds one
+  // object per element, and any other handle holds a single object.
+  //////////////////////////////////////////////////////////////////////////////
+  template<class T> unsigned
+  countObjects (const edm::Handle<vector<T> > &handle)
+  {
+    return handle->size ();
+  }
+
+  template<class T> unsigned
+  countObjects (const edm::Handle<T> &)
+  {
+    return 1;
+  }
+
+  template<class T> void
+  addObjects (const edm::Handle<vector<T> > &handle, vector<void *> &objects)
+  {
+    for (const auto &object : *handle)
+      objects.push_back ((void *) &object);
+  }
+
+  template<class T> void
+  addObjects (const edm::Handle<T> &handle, vector<void *> &objects)
+  {
+    objects.push_back ((void *) &(*handle));
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+  // Only objects whose exact type has a getObjectClass have a hash, since
+  // getObjectHash looks up their momentum by class name. For the others, which
+  // include the collections not valid for the data format, nothing is added.
+  //////////////////////////////////////////////////////////////////////////////
+  template<class T> auto
+  addHash (const T &object, vector<int> &hashes, int) -> decltype (static_cast<string (*) (const T &)> (&anatools::getObjectClass), void ())
+  {
+    hashes.push_back (anatools::getObjectHash (object));
+  }
+
+  template<class T> void
+  addHash (const T &, vector<int> &, long)
+  {
+  }
+
+  template<class T> void
+  addHashes (const edm::Handle<vector<T> > &handle, vector<int> &hashes)
+  {
+    for (const auto &object : *handle)
+      addHash (object, hashes, 0);
+  }
+
+  template<class T> void
+  addHashes (const edm::Handle<T> &handle, vector<int> &hashes)
+  {
+    addHash (*handle, hashes, 0);
+  }
+  //////////////////////////////////////////////////////////////////////////////
+
+  template<class H, H Collections::*member> struct CollectionMember
+  {
+    static bool
+    isFound (const Collections &handles)
+    {
+      return (handles.*member).isValid ();
+    }
+
+    static unsigned
+    getSize (const Collections &handles)
+    {
+      return countObjects (handles.*member);
+    }
+
+    static void
+    getObjects (const Collections &handles, vector<void *> &objects)
+    {
+      addObjects (handles.*member, objects);
+    }
+
+    static void
+    getHashes (const Collections &handles, vector<int> &hashes)
+    {
+      addHashes (handles.*member, hashes);
+    }
+
+    static void
+    retrieve (const edm::InputTag &label, Collections &handles, const edm::Event &event)
+    {
+      anatools::getCollection (label, handles.*member, event);
+    }
+  };
+  //////////////////////////////////////////////////////////////////////////////
+}
+
+/**
+ * Returns the registry of the collections which can be used in expressions.
+ *
+ * Each entry holds the name of a collection, the type of its objects, and
+ * functions acting directly on the corresponding member of Collections, so
+ * that a collection only needs to be looked up by name once. Collections
+ * which are not valid for the data format are left out. The user and event
+ * variables each count as a single object, which is always found, and have
+ * no retrieve function, since getRequiredCollections treats them separately.
+ *
+ * @return entries of the registry, indexed by the ids from getCollectionId
+ */
+const vector<anatools::CollectionEntry> &
+anatools::getCollectionRegistry ()
+{
+#define REGISTER_COLLECTION(x, type) \
+  if (string (TYPE_STR(x)) != XSTR(INVALID_TYPE)) \
+    registry.push_back ({XSTR(x), type, \
+                         &CollectionMember<decltype (Collections::x), &Collections::x>::isFound, \
+                         &CollectionMember<decltype (Collections::x), &Collections::x>::getSize, \
+                         &CollectionMember<decltype (Collections::x), &Collections::x>::getObjects, \
+                         &CollectionMember<decltype (Collections::x), &Collections::x>::getHashes, \
+                         &CollectionMember<decltype (Collections::x), &Collections::x>::retrieve})
+
+  static const vector<CollectionEntry> collections = [] ()
+    {
+      vector<CollectionEntry> registry;
+      REGISTER_COLLECTION(beamspots,         "osu::Beamspot");
+      REGISTER_COLLECTION(bxlumis,           "osu::Bxlumi");
+      REGISTER_COLLECTION(electrons,         "osu::Electron");
+      REGISTER_COLLECTION(events,            "osu::Event");
+      REGISTER_COLLECTION(genjets,           "osu::Genjet");
+      REGISTER_COLLECTION(generatorweights,  "osu::Generatorweight");
+      REGISTER_COLLECTION(jets,              "osu::Jet");
+      REGISTER_COLLECTION(bjets,             "osu::Bjet");
+      REGISTER_COLLECTION(basicjets,         "osu::Basicjet");
+      REGISTER_COLLECTION(mcparticles,       "osu::Mcparticle");
+      REGISTER_COLLECTION(mets,              "osu::Met");
+      REGISTER_COLLECTION(muons,             "osu::Muon");
+      REGISTER_COLLECTION(photons,           "osu::Photon");
+      REGISTER_COLLECTION(primaryvertexs,    "osu::Primaryvertex");
+      REGISTER_COLLECTION(superclusters,     "osu::Supercluster");
+      REGISTER_COLLECTION(taus,              "osu::Tau");
+      REGISTER_COLLECTION(tracks,            "osu::Track");
+      REGISTER_COLLECTION(pileupinfos,       "osu::PileUpInfo");
+      REGISTER_COLLECTION(trigobjs,          "osu::Trigobj");
+      if (string (TYPE_STR(uservariables)) != XSTR(INVALID_TYPE))
+        registry.push_back ({"uservariables", "osu::Uservariable",
+                             [] (const Collections &) { return true; },
+                             [] (const Collections &) { return 1u; },
+                             [] (const Collections &handles, vector<void *> &objects) { objects.push_back ((void *) &handles.uservariableColumns); },
+                             NULL,
+                             NULL});
+      if (string (TYPE_STR(eventvariables)) != XSTR(INVALID_TYPE))
+        registry.push_back ({"eventvariables", "osu::Eventvariable",
+                             [] (const Collections &) { return true; },
+                             [] (const Collections &) { return 1u; },
+                             [] (const Collections &handles, vector<void *> &objects) { objects.push_back ((void *) &handles.eventvariableValues); },
+                             NULL,
+                             NULL});
+      return registry;
+    } ();
+
+#undef REGISTER_COLLECTION
+  return collections;
+}
+
+/**
+ * Returns the id of a collection, i.e., the index of its entry in the
+ * registry of collections.
+ *
+ * @param  name name of the collection, e.g., "muons"
+ * @return id of the collection, or the size of the registry if there is no
+ *         collection with this name
+ */
+unsigned
+anatools::getCollectionId (const string &name)
 {
-  return (get<0> (a) > get<0> (b));
+  static const unordered_map<string, unsigned> ids = [] ()
+    {
+      unordered_map<string, unsigned> ids;
+      for (const auto &collection : getCollectionRegistry ())
+        ids.insert (make_pair (collection.name, ids.size ()));
+      return ids;
+    } ();
+
+  auto id = ids.find (name);
+  return (id != ids.end () ? id->second : getCollectionRegistry ().size ());
 }
 
 /**
- * Returns whether the collection indices are in ascending order.
- *
- * This function is meant to be used with std::sort to sort a vector so that
- * the collection indices are in ascending order. The collection index is the
- * first member of the tuple in the input pairs. This sorting is used in
- * determining which combinations of objects should be ignored to avoid double
- * counting in ValueLookupTree.
- *
- * @param  a first of two objects to compare
- * @param  b second of two objects to compare
- * @return boolean representing whether the collection indices of the two
- *         objects are in ascending order
+ * Finds the trigger paths matching the patterns of a trigger index.
+ *
+ * The trigger names only change at run boundaries, so nothing is done if they
+ * are the same as when the index was last updated. Otherwise the paths are
+ * looked up in a table shared by all modules, so that the names are only
+ * searched once for each list of patterns, however many modules use it.
+ *
+ * @param  triggerIndex index whose paths are to be updated
+ * @param  triggerNames names of the trigger paths in the current event
+ * @return whether the trigger names had changed
  */
 bool
-anatools::collectionIndexAscending (pair<string, DressedObject> a, pair<string, DressedObject> b)
+anatools::updateTriggerIndex (TriggerIndex &triggerIndex, const edm::TriggerNames &triggerNames)
+{
+  if (triggerIndex.paths.size () == triggerIndex.patterns.size () && triggerIndex.parameterSetID == triggerNames.parameterSetID ())
+    return false;
+
+  static mutex lock;
+  static map<pair<edm::ParameterSetID, string>, vector<vector<unsigned> > > table;
+
+  string key = (triggerIndex.isSubstring ? "substring" : "prefix");
+  for (const auto &pattern : triggerIndex.patterns)
+    key += "\n" + pattern;
+
+  lock_guard<mutex> guard (lock);
+  auto paths = table.find (make_pair (triggerNames.parameterSetID (), key));
+  if (paths == table.end ())
+    {
+      vector<vector<unsigned> > matches (triggerIndex.patterns.size ());
+      for (unsigned i = 0; i < triggerNames.size (); i++)
+        {
+          const string &name = triggerNames.triggerName (i);
+          for (unsigned j = 0; j < triggerIndex.patterns.size (); j++)
+            {
+              size_t position = name.find (triggerIndex.patterns.at (j));
+              if (triggerIndex.isSubstring ? position != string::npos : position == 0)
+                matches.at (j).push_back (i);
+            }
+        }
+      paths = table.insert (make_pair (make_pair (triggerNames.parameterSetID (), key), matches)).first;
+    }
+  triggerIndex.paths = paths->second;
+  triggerIndex.parameterSetID = triggerNames.parameterSetID ();
+  return true;
+}
+
+namespace
+{
+  //////////////////////////////////////////////////////////////////////////////
+  // Indices of the trigger objects passing each filter in the current event.
+  // There is an index for every stream, shared by all of its modules whichever
+  // thread they run on, which is rebuilt whenever it is asked for a different
+  // event or a different collection of trigger objects. The table of indices
+  // is only used while holding trigobjFilterLock, while the index of a stream
+  // is only used by the modules of that stream, which run one at a time.
+  //////////////////////////////////////////////////////////////////////////////
+  struct TrigobjFilterIndex
+  {
+    edm::EventID                              eventID;
+    const void                                *trigobjs;
+    unordered_map<string, vector<unsigned> >  filters;
+  };
+
+  mutex                                         trigobjFilterLock;
+  unordered_map<unsigned, TrigobjFilterIndex>  trigobjFilterIndices;
+  //////////////////////////////////////////////////////////////////////////////
+}
+
+/**
+ * Returns the trigger objects of the current event which passed each filter.
+ *
+ * Each trigger object is copied and unpacked only once per event, however
+ * many modules and filters ask about it, and a filter is then looked up by
+ * its label rather than by comparing it to the labels of every object.
+ *
+ * @param  handles collections of the current event
+ * @return indices of the trigger objects passing each filter, keyed by the
+ *         label of the filter, which is empty if there are no trigger objects
+ */
+const unordered_map<string, vector<unsigned> > &
+anatools::getTrigobjFilterIndex (const Collections &handles)
+{
+  unique_lock<mutex> lock (trigobjFilterLock);
+  TrigobjFilterIndex &index = trigobjFilterIndices[handles.stream];
+  lock.unlock ();
+  const void *trigobjs = (handles.trigobjs.isValid () ? (const void *) &*handles.trigobjs : NULL);
+  if (index.eventID == handles.eventID && index.trigobjs == trigobjs)
+    return index.filters;
+
+  index.eventID = handles.eventID;
+  index.trigobjs = trigobjs;
+  index.filters.clear ();
+#if DATA_FORMAT == MINI_AOD || DATA_FORMAT == MINI_AOD_CUSTOM
+  for (unsigned i = 0; trigobjs && i < handles.trigobjs->size (); i++)
+    {
+      osu::Trigobj trigobj = handles.trigobjs->at (i);
+      if (handles.triggerNames)
+        trigobj.unpackPathNames (*handles.triggerNames);
+      for (const auto &filter : trigobj.filterLabels ())
+        {
+          vector<unsigned> &objects = index.filters[filter];
+          if (!objects.size () || objects.back () != i)
+            objects.push_back (i);
+        }
+    }
+#endif
+  return index.filters;
+}
+
+/**
+ * Hands the histograms filled by a stream over to the global cache of its
+ * module, which owns them from then on.
+ *
+ * @param  streamHistograms histograms of the module
+ * @param  stream index of the stream which filled the histograms
+ * @param  histograms copies of the histograms filled by the stream, in the
+ *         same order for every stream, with NULL for any which were not booked
+ * @param  subdirectories subdirectory of each histogram within that of the
+ *         module, or empty if they are all in the directory of the module
+ */
+void
+anatools::storeStreamHistograms (const StreamHistograms &streamHistograms, const unsigned stream, const vector<TH1 *> &histograms, const vector<string> &subdirectories)
+{
+  lock_guard<mutex> lock (streamHistograms.streamMutex);
+
+  if (streamHistograms.histograms.size () <= stream)
+    streamHistograms.histograms.resize (stream + 1);
+  streamHistograms.histograms.at (stream) = histograms;
+  if (streamHistograms.subdirectories.empty ())
+    streamHistograms.subdirectories = subdirectories;
+}
+
+/**
+ * Adds together the copies of each histogram filled by the streams and writes
+ * the sums to the output file.
+ *
+ * The copies are added in order of stream, so that the sums do not depend on
+ * the order in which the streams ended. A sum starts from the first copy with
+ * any entries, since the copies of a stream which saw no events may not have
+ * been fully set up, e.g., the bins of the cut flow histograms are only set in
+ * the first event. The sums are put in the directory of the module, or the
+ * subdirectories given along with the copies, and are owned by the output file.
+ *
+ * @param  streamHistograms histograms of the module
+ * @return sum of the copies of each histogram, in the same order as these,
+ *         with NULL for any which were not booked
+ */
+vector<TH1 *>
+anatools::writeStreamHistograms (const StreamHistograms &streamHistograms)
 {
-  return (a.second.collectionIndex < b.second.collectionIndex);
+  lock_guard<mutex> lock (streamHistograms.streamMutex);
+
+  unsigned nHistograms = 0;
+  for (const auto &histograms : streamHistograms.histograms)
+    nHistograms = max (nHistograms, (unsigned) histograms.size ());
+
+  vector<TH1 *> sums (nHistograms, NULL);
+  for (unsigned i = 0; i < nHistograms; i++)
+    {
+      TH1 *&sum = sums.at (i);
+      for (auto &histograms : streamHistograms.histograms)
+        {
+          if (i >= histograms.size () || !histograms.at (i))
+            continue;
+          TH1 *copy = histograms.at (i);
+          histograms.at (i) = NULL;
+
+          if (!sum || (!sum->GetEntries () && copy->GetEntries ()))
+            swap (sum, copy);
+          else if (copy->GetEntries ())
+            sum->Add (copy);
+          delete copy;
+        }
+      if (!sum)
+        continue;
+
+      const string &subdirectory = (i < streamHistograms.subdirectories.size () ? streamHistograms.subdirectories.at (i) : "");
+      sum->SetDirectory (subdirectory.empty () ? streamHistograms.directory.getBareDirectory () : streamHistograms.directory.mkdir (subdirectory).getBareDirectory ());
+    }
+  streamHistograms.histograms.clear ();
+
+  return sums;
 }
 
 /**
@@ -189,33 +604,34 @@ anatools::collectionIndexAscending (pair<string, DressedObject> a, pair<string,
 void
 anatools::getRequiredCollections (const unordered_set<string> &objectsToGet, const edm::ParameterSet &collections, Collections &handles, const edm::Event &event)
 {
-  static bool firstEvent = true;
+  static atomic<bool> firstEvent (true);  // shared by the modules in every stream
+
+  handles.eventID = event.id ();
+  handles.stream = event.streamID ().value ();
 
   //////////////////////////////////////////////////////////////////////////////
   // Retrieve each object collection which we need and print a warning if it is
   // missing.
   //////////////////////////////////////////////////////////////////////////////
-  if  (VEC_CONTAINS  (objectsToGet,  "beamspots")         &&  collections.exists  ("beamspots"))         getCollection  (collections.getParameter<edm::InputTag>  ("beamspots"),         handles.beamspots,         event);
-  if  (VEC_CONTAINS  (objectsToGet,  "bxlumis")           &&  collections.exists  ("bxlumis"))           getCollection  (collections.getParameter<edm::InputTag>  ("bxlumis"),           handles.bxlumis,           event);
-  if  (VEC_CONTAINS  (objectsToGet,  "electrons")         &&  collections.exists  ("electrons"))         getCollection  (collections.getParameter<edm::InputTag>  ("electrons"),         handles.electrons,         event);
-  if  (VEC_CONTAINS  (objectsToGet,  "events")            &&  collections.exists  ("events"))            getCollection  (collections.getParameter<edm::InputTag>  ("events"),            handles.events,            event);
-  if  (VEC_CONTAINS  (objectsToGet,  "genjets")           &&  collections.exists  ("genjets"))           getCollection  (collections.getParameter<edm::InputTag>  ("genjets"),           handles.genjets,           event);
-  if  (VEC_CONTAINS  (objectsToGet,  "jets")              &&  collections.exists  ("jets"))              getCollection  (collections.getParameter<edm::InputTag>  ("jets"),              handles.jets,              event);
-  if  (VEC_CONTAINS  (objectsToGet,  "bjets")              &&  collections.exists  ("bjets"))              getCollection  (collections.getParameter<edm::InputTag>  ("bjets"),              handles.bjets,              event);
-  if  (VEC_CONTAINS  (objectsToGet,  "basicjets")         &&  collections.exists  ("basicjets"))         getCollection  (collections.getParameter<edm::InputTag>  ("basicjets"),         handles.basicjets,         event);
-  if  (VEC_CONTAINS  (objectsToGet,  "generatorweights")  &&  collections.exists  ("generatorweights"))  getCollection  (collections.getParameter<edm::InputTag>  ("generatorweights"),  handles.generatorweights,  event);
-  if  (VEC_CONTAINS  (objectsToGet,  "mcparticles")       &&  collections.exists  ("mcparticles"))       getCollection  (collections.getParameter<edm::InputTag>  ("mcparticles"),       handles.mcparticles,       event);
-  if  (VEC_CONTAINS  (objectsToGet,  "mets")              &&  collections.exists  ("mets"))              getCollection  (collections.getParameter<edm::InputTag>  ("mets"),              handles.mets,              event);
-  if  (VEC_CONTAINS  (objectsToGet,  "muons")             &&  collections.exists  ("muons"))             getCollection  (collections.getParameter<edm::InputTag>  ("muons"),             handles.muons,             event);
-  if  (VEC_CONTAINS  (objectsToGet,  "photons")           &&  collections.exists  ("photons"))           getCollection  (collections.getParameter<edm::InputTag>  ("photons"),           handles.photons,           event);
+  for (const auto &collection : getCollectionRegistry ())
+    {
+      if (collection.retrieve && VEC_CONTAINS (objectsToGet, collection.name) && collections.exists (collection.name))
+        collection.retrieve (collections.getParameter<edm::InputTag> (collection.name), handles, event);
+    }
   if  (VEC_CONTAINS  (objectsToGet,  "prescales")         &&  collections.exists  ("prescales"))         getCollection  (collections.getParameter<edm::InputTag>  ("prescales"),         handles.prescales,         event);
-  if  (VEC_CONTAINS  (objectsToGet,  "primaryvertexs")    &&  collections.exists  ("primaryvertexs"))    getCollection  (collections.getParameter<edm::InputTag>  ("primaryvertexs"),    handles.primaryvertexs,    event);
-  if  (VEC_CONTAINS  (objectsToGet,  "superclusters")     &&  collections.exists  ("superclusters"))     getCollection  (collections.getParameter<edm::InputTag>  ("superclusters"),     handles.superclusters,     event);
-  if  (VEC_CONTAINS  (objectsToGet,  "taus")              &&  collections.exists  ("taus"))              getCollection  (collections.getParameter<edm::InputTag>  ("taus"),              handles.taus,              event);
-  if  (VEC_CONTAINS  (objectsToGet,  "tracks")            &&  collections.exists  ("tracks"))            getCollection  (collections.getParameter<edm::InputTag>  ("tracks"),            handles.tracks,            event);
-  if  (VEC_CONTAINS  (objectsToGet,  "pileupinfos")            &&  collections.exists  ("pileupinfos"))            getCollection  (collections.getParameter<edm::InputTag>  ("pileupinfos"),            handles.pileupinfos,            event);
   if  (VEC_CONTAINS  (objectsToGet,  "triggers")          &&  collections.exists  ("triggers"))          getCollection  (collections.getParameter<edm::InputTag>  ("triggers"),          handles.triggers,          event);
-  if  (VEC_CONTAINS  (objectsToGet,  "trigobjs")          &&  collections.exists  ("trigobjs"))          getCollection  (collections.getParameter<edm::InputTag>  ("trigobjs"),          handles.trigobjs,          event);
+
+  //////////////////////////////////////////////////////////////////////////////
+  // The trigger names are needed to unpack the trigger objects, which is only
+  // done on demand by getTrigobjFilterIndex.
+  //////////////////////////////////////////////////////////////////////////////
+  handles.triggerNames = NULL;
+#if DATA_FORMAT == MINI_AOD || DATA_FORMAT == MINI_AOD_CUSTOM
+  if (handles.triggers.isValid ())
+    handles.triggerNames = &event.triggerNames (*handles.triggers);
+#endif
+  //////////////////////////////////////////////////////////////////////////////
+
   if  (VEC_CONTAINS  (objectsToGet,  "uservariables")     &&  collections.exists  ("uservariables"))
     {
       handles.uservariables.clear ();
@@ -224,6 +640,7 @@ anatools::getRequiredCollections (const unordered_set<string> &objectsToGet, con
           handles.uservariables.resize (handles.uservariables.size () + 1);
           getCollection (collection, handles.uservariables.back (), event);
         }
+      indexUservariables (handles);
     }
   if  (VEC_CONTAINS  (objectsToGet,  "eventvariables")   &&  collections.exists  ("eventvariables"))
     {
@@ -233,6 +650,35 @@ anatools::getRequiredCollections (const unordered_set<string> &objectsToGet, con
           handles.eventvariables.resize (handles.eventvariables.size () + 1);
           getCollection (collection, handles.eventvariables.back (), event);
         }
+
+      //////////////////////////////////////////////////////////////////////////
+      // The event variables from all the producers are merged once per event
+      // into a flat array indexed by slot. Variables missing from the event
+      // are left invalid, and the first producer wins if several produce the
+      // same variable, even if its value is invalid.
+      //////////////////////////////////////////////////////////////////////////
+      handles.eventvariableValues.clear ();
+      vector<bool> isFilled;
+      for (const auto &eventvariables : handles.eventvariables)
+        {
+          if (!eventvariables.isValid ())
+            continue;
+          for (const auto &eventvariable : *eventvariables)
+            {
+              unsigned slot = getEventvariableSlot (eventvariable.first, handles);
+              if (slot >= handles.eventvariableValues.size ())
+                {
+                  handles.eventvariableValues.resize (slot + 1, INVALID_VALUE);
+                  isFilled.resize (slot + 1, false);
+                }
+              if (!isFilled.at (slot))
+                {
+                  handles.eventvariableValues.at (slot) = eventvariable.second;
+                  isFilled.at (slot) = true;
+                }
+            }
+        }
+      //////////////////////////////////////////////////////////////////////////
     }
 
 
@@ -287,6 +733,124 @@ anatools::getRequiredCollections (const unordered_set<string> &objectsToGet, con
   firstEvent = false;
 }
 
+/**
+ * Joins the user variables in the event to the objects they were computed
+ * from.
+ *
+ * Each user variable is stored with the hashes of the objects it depends on.
+ * These are matched once per event to the indices of the objects in their
+ * collections, and the values are stored in one column per variable, indexed
+ * by the combination of those indices, so that ValueLookupTree can find the
+ * value for a combination of objects without any search. Within a collection,
+ * the indices are sorted in ascending order, as in the unique combinations
+ * enumerated by ValueLookupTree. If several producers make the same variable,
+ * the first one wins, even if none of its objects are found.
+ *
+ * @param  handles structure containing the user variables and the collections
+ *         of the objects they depend on, where the columns are stored
+ */
+void
+anatools::indexUservariables (Collections &handles)
+{
+  handles.uservariableColumns.clear ();
+  map<string, unordered_map<int, unsigned> > objectIndices;  // index of each hash, for each collection
+  map<string, unsigned> collectionSizes;
+  vector<bool> isFilled;
+  for (const auto &uservariables : handles.uservariables)
+    {
+      if (!uservariables.isValid ())
+        continue;
+      for (const auto &uservariable : *uservariables)
+        {
+          unsigned slot = getUservariableSlot (uservariable.first, handles);
+          if (slot >= handles.uservariableColumns.size ())
+            {
+              handles.uservariableColumns.resize (slot + 1);
+              isFilled.resize (slot + 1, false);
+            }
+          UservariableColumn &column = handles.uservariableColumns.at (slot);
+          if (isFilled.at (slot))
+            continue;
+          isFilled.at (slot) = true;
+
+          for (const auto &value : uservariable.second)
+            {
+              //////////////////////////////////////////////////////////////////
+              // Find the collection and the index of each object the value
+              // depends on, skipping values whose objects are not all found.
+              //////////////////////////////////////////////////////////////////
+              vector<pair<string, unsigned> > objects;
+              for (const auto &object : value.objects)
+                {
+                  string collection = plural (object.first);
+                  if (!objectIndices.count (collection))
+                    {
+                      vector<int> hashes = getObjectHashes (collection, handles);
+                      unordered_map<int, unsigned> &indices = objectIndices[collection];
+                      for (unsigned i = 0; i < hashes.size (); i++)
+                        indices.insert (make_pair (hashes.at (i), i));
+                      collectionSizes[collection] = hashes.size ();
+                    }
+                  auto index = objectIndices.at (collection).find (object.second);
+                  if (index == objectIndices.at (collection).end ())
+                    break;
+                  objects.push_back (make_pair (collection, index->second));
+                }
+              if (objects.size () != value.objects.size ())
+                continue;
+              sort (objects.begin (), objects.end ());
+              //////////////////////////////////////////////////////////////////
+
+              //////////////////////////////////////////////////////////////////
+              // The layout of the column is set by the first value which is
+              // found, and any values depending on different collections are
+              // skipped.
+              //////////////////////////////////////////////////////////////////
+              if (!column.values.size ())
+                {
+                  column.strides.assign (objects.size (), 1);
+                  for (unsigned j = objects.size (); j-- > 0; )
+                    {
+                      column.collections.insert (column.collections.begin (), objects.at (j).first);
+                      if (j)
+                        column.strides.at (j - 1) = column.strides.at (j) * collectionSizes.at (objects.at (j).first);
+                    }
+                  column.values.assign (objects.size () ? column.strides.at (0) * collectionSizes.at (objects.at (0).first) : 1, INVALID_VALUE);
+                }
+              unsigned index = 0;
+              for (unsigned j = 0; j < objects.size () && j < column.collections.size (); j++)
+                index += objects.at (j).second * column.strides.at (j);
+              if (objects.size () == column.collections.size () && equal (objects.begin (), objects.end (), column.collections.begin (), [](const pair<string, unsigned> &a, const string &b) { return a.first == b; }))
+                column.values.at (index) = value.value;
+              //////////////////////////////////////////////////////////////////
+            }
+        }
+    }
+}
+
+/**
+ * Returns the hashes of all the objects in a collection.
+ *
+ * @param  collection name of the collection, e.g., "muons"
+ * @param  handles structure containing the edm::Handle objects of the
+ *         collections
+ * @return hash of each object in the collection, in order, or an empty vector
+ *         if the collection was not retrieved
+ */
+vector<int>
+anatools::getObjectHashes (const string &collection, const Collections &handles)
+{
+  vector<int> hashes;
+  unsigned id = getCollectionId (collection);
+  if (id < getCollectionRegistry ().size ())
+    {
+      const CollectionEntry &entry = getCollectionRegistry ().at (id);
+      if (entry.getHashes && entry.isFound (handles))
+        entry.getHashes (handles, hashes);
+    }
+  return hashes;
+}
+
 #ifdef ROOT6
   #include "FWCore/Utilities/interface/BaseWithDict.h"
   #include "FWCore/Utilities/interface/FunctionWithDict.h"
@@ -297,6 +861,10 @@ anatools::getRequiredCollections (const unordered_set<string> &objectsToGet, con
   double
   anatools::getMember (const string &type, const void * const obj, const string &member)
   {
+    DirectAccessor directAccessor = getDirectAccessor (type, member);
+    if (directAccessor)
+      return directAccessor (obj);
+
     double value = INVALID_VALUE;
     edm::TypeWithDict t = edm::TypeWithDict::byName (type);
     edm::ObjectWithDict *o = new edm::ObjectWithDict (t, (void *) obj);
@@ -397,9 +965,29 @@ anatools::getRequiredCollections (const unordered_set<string> &objectsToGet, con
   #include "Reflex/Object.h"
   #include "Reflex/Type.h"
 
+namespace
+{
+  // Reflex is not thread-safe, so its dictionaries are only used while holding
+  // this lock, by any thread.
+  mutex reflexLock;
+
+  // Reads a member of a known fundamental type and converts it to a double.
+  template<class T> double
+  convertMember (const void * const address)
+  {
+    return *((const T *) address);
+  }
+}
+
 /**
  * Returns the value of a member of an object.
  *
+ * The member is resolved with getMemberAccessor the first time a given
+ * (type, member) pair is seen, so that later calls do not go through the
+ * Reflex dictionaries by name. Members in the table of direct accessors (see
+ * MemberTable.h) do not go through the dictionaries at all, so they do not
+ * need the lock held while following the steps to any other member.
+ *
  * @param  type string giving the type of the object
  * @param  obj void pointer to the object
  * @param  member string giving the member, data or function, to evaluate
@@ -408,162 +996,228 @@ anatools::getRequiredCollections (const unordered_set<string> &objectsToGet, con
   double
   anatools::getMember (const string &type, const void * const obj, const string &member)
   {
+    MemberAccessor &accessor = getMemberAccessor (type, member);
+    if (!accessor.isValid)
+      return INVALID_VALUE;
+
     double value = INVALID_VALUE;
-    Reflex::Type t = Reflex::Type::ByName (type);
-    Reflex::Object *o = new Reflex::Object (t, (void *) obj);
+    unique_lock<mutex> guard (reflexLock, defer_lock);
+    if (accessor.steps.size ())
+      guard.lock ();
+    try
+      {
+        void *address = (void *) obj;
+        for (auto &step : accessor.steps)
+          {
+            if (step.kind == MemberStep::Dereference)
+              address = *((void **) address);
+            else if (step.kind == MemberStep::BaseClass)
+              address = Reflex::Object (step.type, address).CastObject (step.baseType).Address ();
+            else if (step.kind == MemberStep::DataMember)
+              address = step.member.Get (Reflex::Object (step.type, address)).Address ();
+            else
+              {
+                step.member.Invoke (Reflex::Object (step.type, address), &step.returnValue);
+                address = step.returnValue.Address ();
+              }
+          }
+        value = accessor.convert (address);
+      }
+    catch (...)
+      {
+        if (!accessor.hasWarned)
+          clog << "WARNING: unable to access member \"" << member << "\" from \"" << type << "\"" << endl;
+        accessor.hasWarned = true;
+      }
+
+    return value;
+  }
+
+/**
+ * Destructs the storage constructed by resolveMember for the values returned
+ * by function members.
+ */
+  anatools::MemberAccessor::~MemberAccessor ()
+  {
+    lock_guard<mutex> guard (reflexLock);
+    truncateMemberSteps (steps, 0);
+  }
+
+/**
+ * Removes the steps after the first n, destructing the storage of any
+ * FunctionMember steps among them.
+ *
+ * @param  steps steps to be truncated
+ * @param  n number of steps to keep
+ */
+  void
+  anatools::truncateMemberSteps (vector<MemberStep> &steps, const size_t n)
+  {
+    for (size_t i = n; i < steps.size (); i++)
+      {
+        if (steps.at (i).kind == MemberStep::FunctionMember && steps.at (i).returnValue)
+          steps.at (i).returnValue.Destruct ();
+      }
+    if (n < steps.size ())
+      steps.resize (n);
+  }
+
+/**
+ * Returns the cached accessor for a member of a type, resolving it first if
+ * this is the first time the pair has been seen.
+ *
+ * Failed resolutions are cached as well, with isValid set to false, so that a
+ * warning is printed only once and later calls can return immediately. The
+ * cache is kept per thread, since the steps hold storage for the values
+ * returned by function members, but the dictionaries are shared, so the
+ * resolution holds the same lock as getMember.
+ *
+ * @param  type string giving the type of the object
+ * @param  member string giving the member, data or function, to evaluate
+ * @return accessor for the member
+ */
+  anatools::MemberAccessor &
+  anatools::getMemberAccessor (const string &type, const string &member)
+  {
+    static thread_local unordered_map<string, unordered_map<string, MemberAccessor> > accessors;
+
+    auto &accessorsForType = accessors[type];
+    auto accessor = accessorsForType.find (member);
+    if (accessor != accessorsForType.end ())
+      return accessor->second;
+
+    static const map<string, double (*) (const void * const)> converters = {
+      {"float",               &convertMember<float>},
+      {"double",              &convertMember<double>},
+      {"long double",         &convertMember<long double>},
+      {"char",                &convertMember<char>},
+      {"int",                 &convertMember<int>},
+      {"unsigned",            &convertMember<unsigned>},
+      {"bool",                &convertMember<bool>},
+      {"unsigned int",        &convertMember<unsigned int>},
+      {"unsigned short int",  &convertMember<unsigned short int>},
+      {"unsigned long int",   &convertMember<unsigned long int>}
+    };
+
+    MemberAccessor &newAccessor = accessorsForType[member];
     string memberType;
 
+    //////////////////////////////////////////////////////////////////////////////
+    // Members in the table of direct accessors need no steps at all.
+    //////////////////////////////////////////////////////////////////////////////
+    if ((newAccessor.convert = getDirectAccessor (type, member)))
+      {
+        newAccessor.isValid = true;
+        return newAccessor;
+      }
+    //////////////////////////////////////////////////////////////////////////////
+
     try
       {
-        const Reflex::Object * const retObj = getMember (t, *o, member, memberType);
-        if (memberType == "float")
-          value = Reflex::Object_Cast<float> (*retObj);
-        else if (memberType == "double")
-          value = Reflex::Object_Cast<double> (*retObj);
-        else if (memberType == "long double")
-          value = Reflex::Object_Cast<long double> (*retObj);
-        else if (memberType == "char")
-          value = Reflex::Object_Cast<char> (*retObj);
-        else if (memberType == "int")
-          value = Reflex::Object_Cast<int> (*retObj);
-        else if (memberType == "unsigned")
-          value = Reflex::Object_Cast<unsigned> (*retObj);
-        else if (memberType == "bool")
-          value = Reflex::Object_Cast<bool> (*retObj);
-        else if (memberType == "unsigned int")
-          value = Reflex::Object_Cast<unsigned int> (*retObj);
-        else if (memberType == "unsigned short int")
-          value = Reflex::Object_Cast<unsigned short int> (*retObj);
-        else if (memberType == "unsigned long int")
-          value = Reflex::Object_Cast<unsigned long int> (*retObj);
-        else
-          clog << "WARNING: \"" << member << "\" has unrecognized type \"" << memberType << "\"" << endl;
-        delete retObj;
+        lock_guard<mutex> guard (reflexLock);
+        newAccessor.isValid = resolveMember (Reflex::Type::ByName (type), member, newAccessor.steps, memberType);
       }
     catch (...)
       {
-        clog << "WARNING: unable to access member \"" << member << "\" from \"" << type << "\"" << endl;
+        newAccessor.isValid = false;
       }
-    delete o;
+    if (!newAccessor.isValid)
+      clog << "WARNING: unable to access member \"" << member << "\" from \"" << type << "\"" << endl;
+    else if (!converters.count (memberType))
+      {
+        clog << "WARNING: \"" << member << "\" has unrecognized type \"" << memberType << "\"" << endl;
+        newAccessor.isValid = false;
+      }
+    else
+      newAccessor.convert = converters.at (memberType);
 
-    return value;
+    return newAccessor;
   }
 
 /**
- * Helper function that returns a member of an object as a Reflex::Object.
+ * Helper function that resolves a member of a type into the chain of steps
+ * needed to reach it from an object of that type.
  *
  * @param  t Reflex::Type corresponding to the type of the object
- * @param  o Reflex::Object corresponding to the object
  * @param  member string giving the member, data or function, to evaluate
- * @param  memberType string in which the type of the retrieved member is
- *         stored
- * @return Reflex::Object corresponding to the value of the member of the given
- *         object
+ * @param  steps vector to which the steps are appended
+ * @param  memberType string in which the type of the member is stored
+ * @return boolean representing whether the member was found
  */
-  const Reflex::Object * const
-  anatools::getMember (const Reflex::Type &t, const Reflex::Object &o, const string &member, string &memberType)
+  bool
+  anatools::resolveMember (const Reflex::Type &t, const string &member, vector<MemberStep> &steps, string &memberType)
   {
     string typeName = t.Name (Reflex::FINAL | Reflex::SCOPED);
     size_t dot = member.find ('.'),
-           asterisk = typeName.rfind ('*');
+           asterisk = typeName.rfind ('*'),
+           nSteps = steps.size ();
 
+    if (!t)
+      return false;
     if (t.IsReference ())
       {
         clog << "WARNING: unable to access members which are references" << endl;
-        throw 0;
+        return false;
       }
     if (t.IsPointer ())
       {
         Reflex::Type derefType = Reflex::Type::ByName (typeName.substr (0, asterisk) + typeName.substr (asterisk + 1));
-        void *obj = o.Address ();
-        Reflex::Object derefObj (derefType, (void *) *((void **) obj));
-        return getMember (derefType, derefObj, member, memberType);
+        steps.push_back ({MemberStep::Dereference, t, Reflex::Type (), Reflex::Member (), Reflex::Object ()});
+        return resolveMember (derefType, member, steps, memberType);
       }
     if (dot != string::npos)
       {
-        try
-          {
-            const Reflex::Object * const subObj = getMember (t, o, member.substr (0, dot), memberType);
-            Reflex::Type subType = Reflex::Type::ByName (memberType);
-            string subMember = member.substr (dot + 1);
-            const Reflex::Object * const retObj = getMember (subType, *subObj, subMember, memberType);
-            delete subObj;
-            return retObj;
-          }
-        catch (...)
-          {
-            const Reflex::Object * const subObj = getMember (t, o, member.substr (0, dot), memberType);
-            Reflex::Type subType = Reflex::Type::ByName (memberType);
-            string subMember = (member.substr (0, dot) == "operator->" ? "" : "operator->.") + member.substr (dot + 1);
-            const Reflex::Object * const retObj = getMember (subType, *subObj, subMember, memberType);
-            delete subObj;
-            return retObj;
-          }
+        if (!resolveMember (t, member.substr (0, dot), steps, memberType))
+          return false;
+
+        Reflex::Type subType = Reflex::Type::ByName (memberType);
+        size_t nSubSteps = steps.size ();
+        if (resolveMember (subType, member.substr (dot + 1), steps, memberType))
+          return true;
+
+        truncateMemberSteps (steps, nSubSteps);
+        string subMember = (member.substr (0, dot) == "operator->" ? "" : "operator->.") + member.substr (dot + 1);
+        if (resolveMember (subType, subMember, steps, memberType))
+          return true;
+
+        truncateMemberSteps (steps, nSteps);
+        return false;
       }
 
-    Reflex::Type dataMemberType, functionMemberType;
-    string dataMemberTypeName, functionMemberTypeName;
+    Reflex::Member dataMember = t.DataMemberByName (member),
+                   functionMember = t.FunctionMemberByName (member);
+    Reflex::Type dataMemberType = dataMember.TypeOf (),
+                 functionMemberType = functionMember.TypeOf ().ReturnType ();
+    string dataMemberTypeName = dataMemberType.Name (Reflex::FINAL | Reflex::SCOPED),
+           functionMemberTypeName = functionMemberType.Name (Reflex::FINAL | Reflex::SCOPED);
 
-    dataMemberType = t.DataMemberByName (member).TypeOf ();
-    functionMemberType = t.FunctionMemberByName (member).TypeOf ().ReturnType ();
-    dataMemberTypeName = dataMemberType.Name (Reflex::FINAL | Reflex::SCOPED);
-    functionMemberTypeName = functionMemberType.Name (Reflex::FINAL | Reflex::SCOPED);
     if (dataMemberType.IsReference () || functionMemberType.IsReference ())
       {
         clog << "WARNING: unable to access members which are references" << endl;
-        throw 0;
+        return false;
       }
-    try
+    if (dataMemberTypeName != "")
       {
-        if (dataMemberTypeName != "")
-          {
-            memberType = dataMemberTypeName;
-            Reflex::Object *retObj = new Reflex::Object (o.Get (member));
-            return retObj;
-          }
-        else if (functionMemberTypeName != "")
-          {
-            memberType = functionMemberTypeName;
-            return invoke (memberType, o, member);
-          }
-        else
-          throw 0;
+        memberType = dataMemberTypeName;
+        steps.push_back ({MemberStep::DataMember, t, Reflex::Type (), dataMember, Reflex::Object ()});
+        return true;
       }
-    catch (...)
+    if (functionMemberTypeName != "")
       {
-        for (auto bi = t.Base_Begin (); bi != t.Base_End (); bi++)
-          {
-            try
-              {
-                return getMember (bi->ToType (), o.CastObject (bi->ToType ()), member, memberType);
-              }
-            catch (...)
-              {
-                continue;
-              }
-          }
-        throw;
+        memberType = functionMemberTypeName;
+        steps.push_back ({MemberStep::FunctionMember, t, Reflex::Type (), functionMember, Reflex::Type::ByName (memberType).Construct ()});
+        return true;
       }
 
-    throw 0;
-  }
+    for (auto bi = t.Base_Begin (); bi != t.Base_End (); bi++)
+      {
+        steps.push_back ({MemberStep::BaseClass, t, bi->ToType (), Reflex::Member (), Reflex::Object ()});
+        if (resolveMember (bi->ToType (), member, steps, memberType))
+          return true;
+        truncateMemberSteps (steps, nSteps);
+      }
 
-/**
- * Invokes a function member of an object.
- *
- * @param  returnType type which the function returns
- * @param  o Reflex::Object corresponding to the object whose function member
- *         is to be called
- * @param  member string giving the name of the function member
- * @return Reflex::Object corresponding to what the function returned
- */
-  const Reflex::Object * const
-  anatools::invoke (const string &returnType, const Reflex::Object &o, const string &member)
-  {
-    Reflex::Type t = Reflex::Type::ByName (returnType);
-    Reflex::Object *value = new Reflex::Object (t.Construct ());
-    o.Invoke (member, value);
-    return value;
+    return false;
   }
 #endif
 
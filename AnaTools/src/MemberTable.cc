@@ -0,0 +1,220 @@
+#include <iostream>
+#include <map>
+#include <type_traits>
+
+#include "OSUT3Analysis/AnaTools/interface/AnalysisTypes.h"
+#include "OSUT3Analysis/AnaTools/interface/MemberTable.h"
+
+#if DATA_FORMAT == MINI_AOD_CUSTOM
+  #include "DataFormats/Candidate/interface/Candidate.h"
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// Each entry maps a (type, member) pair, spelled the way it appears in cut
+// strings, to a captureless lambda which evaluates the member directly, and to
+// the C++ text of the same member access for generated code.
+////////////////////////////////////////////////////////////////////////////////
+#define DIRECT_MEMBER(type, member, expression) \
+  {{#type, member}, {[] (const void * const obj) -> double { return ((const type *) obj)->expression; }, #expression}}
+
+// Kinematic members common to everything deriving from reco::Candidate.
+#define CANDIDATE_MEMBERS(type) \
+  DIRECT_MEMBER (type, "pt", pt ()), \
+  DIRECT_MEMBER (type, "eta", eta ()), \
+  DIRECT_MEMBER (type, "phi", phi ()), \
+  DIRECT_MEMBER (type, "px", px ()), \
+  DIRECT_MEMBER (type, "py", py ()), \
+  DIRECT_MEMBER (type, "pz", pz ()), \
+  DIRECT_MEMBER (type, "energy", energy ()), \
+  DIRECT_MEMBER (type, "et", et ()), \
+  DIRECT_MEMBER (type, "mass", mass ()), \
+  DIRECT_MEMBER (type, "charge", charge ()), \
+  DIRECT_MEMBER (type, "vx", vx ()), \
+  DIRECT_MEMBER (type, "vy", vy ()), \
+  DIRECT_MEMBER (type, "vz", vz ())
+
+#define CANDIDATE_FORMAT (DATA_FORMAT == MINI_AOD || DATA_FORMAT == AOD)
+
+// The collections of a custom format are whatever its header defines, so the
+// kinematic members are only added for those which derive from reco::Candidate.
+#define CUSTOM_CANDIDATE_MEMBERS(type) \
+  addCandidateMembers<type> (members, #type, is_base_of<reco::Candidate, type> ())
+////////////////////////////////////////////////////////////////////////////////
+
+namespace
+{
+  typedef map<pair<string, string>, pair<anatools::DirectAccessor, string> > DirectMembers;
+
+#if DATA_FORMAT == MINI_AOD_CUSTOM
+  template<class T> void
+  addCandidateMembers (DirectMembers &members, const string &type, true_type)
+  {
+    const DirectMembers candidateMembers = {CANDIDATE_MEMBERS (T)};
+    for (const auto &member : candidateMembers)
+      members.insert (make_pair (make_pair (type, member.first.second), member.second));
+  }
+
+  template<class T> void
+  addCandidateMembers (DirectMembers &members, const string &type, false_type)
+  {
+    clog << "INFO: " << type << " does not derive from reco::Candidate, so its members will be accessed through the dictionaries." << endl;
+  }
+#endif
+
+  const DirectMembers &
+  directMembers ()
+  {
+    static const DirectMembers directMembers = [] ()
+    {
+      DirectMembers members = {
+#if IS_VALID(beamspots) && CANDIDATE_FORMAT
+      DIRECT_MEMBER (osu::Beamspot, "x0", x0 ()),
+      DIRECT_MEMBER (osu::Beamspot, "y0", y0 ()),
+      DIRECT_MEMBER (osu::Beamspot, "z0", z0 ()),
+      DIRECT_MEMBER (osu::Beamspot, "x0Error", x0Error ()),
+      DIRECT_MEMBER (osu::Beamspot, "y0Error", y0Error ()),
+      DIRECT_MEMBER (osu::Beamspot, "z0Error", z0Error ()),
+#endif
+#if IS_VALID(electrons) && CANDIDATE_FORMAT
+      CANDIDATE_MEMBERS (osu::Electron),
+      DIRECT_MEMBER (osu::Electron, "pfIso_.sumChargedHadronPt", pfIsolationVariables ().sumChargedHadronPt),
+      DIRECT_MEMBER (osu::Electron, "pfIso_.sumNeutralHadronEt", pfIsolationVariables ().sumNeutralHadronEt),
+      DIRECT_MEMBER (osu::Electron, "pfIso_.sumPhotonEt", pfIsolationVariables ().sumPhotonEt),
+      DIRECT_MEMBER (osu::Electron, "pfIso_.sumPUPt", pfIsolationVariables ().sumPUPt),
+      DIRECT_MEMBER (osu::Electron, "hadronicOverEm", hadronicOverEm ()),
+      DIRECT_MEMBER (osu::Electron, "full5x5_sigmaIetaIeta", full5x5_sigmaIetaIeta ()),
+      DIRECT_MEMBER (osu::Electron, "deltaEtaSuperClusterTrackAtVtx", deltaEtaSuperClusterTrackAtVtx ()),
+      DIRECT_MEMBER (osu::Electron, "deltaPhiSuperClusterTrackAtVtx", deltaPhiSuperClusterTrackAtVtx ()),
+      DIRECT_MEMBER (osu::Electron, "ecalEnergy", ecalEnergy ()),
+      DIRECT_MEMBER (osu::Electron, "eSuperClusterOverP", eSuperClusterOverP ()),
+#endif
+#if IS_VALID(electrons) && DATA_FORMAT == MINI_AOD
+      DIRECT_MEMBER (osu::Electron, "passConversionVeto", passConversionVeto ()),
+      DIRECT_MEMBER (osu::Electron, "missingInnerHits", missingInnerHits ()),
+      DIRECT_MEMBER (osu::Electron, "AEff", AEff ()),
+      DIRECT_MEMBER (osu::Electron, "rho", rho ()),
+#endif
+#if IS_VALID(genjets) && CANDIDATE_FORMAT
+      CANDIDATE_MEMBERS (osu::Genjet),
+#endif
+#if IS_VALID(jets) && CANDIDATE_FORMAT
+      CANDIDATE_MEMBERS (osu::Jet),
+#endif
+#if IS_VALID(jets)
+      DIRECT_MEMBER (osu::Jet, "pfCombinedSecondaryVertexV2BJetTags", pfCombinedSecondaryVertexV2BJetTags ()),
+      DIRECT_MEMBER (osu::Jet, "pfCombinedInclusiveSecondaryVertexV2BJetTags", pfCombinedInclusiveSecondaryVertexV2BJetTags ()),
+#endif
+#if IS_VALID(bjets) && CANDIDATE_FORMAT
+      CANDIDATE_MEMBERS (osu::Bjet),
+#endif
+#if IS_VALID(bjets)
+      DIRECT_MEMBER (osu::Bjet, "pfCombinedSecondaryVertexV2BJetTags", pfCombinedSecondaryVertexV2BJetTags ()),
+      DIRECT_MEMBER (osu::Bjet, "pfCombinedInclusiveSecondaryVertexV2BJetTags", pfCombinedInclusiveSecondaryVertexV2BJetTags ()),
+#endif
+#if IS_VALID(basicjets) && CANDIDATE_FORMAT
+      CANDIDATE_MEMBERS (osu::Basicjet),
+#endif
+#if IS_VALID(mcparticles) && CANDIDATE_FORMAT
+      CANDIDATE_MEMBERS (osu::Mcparticle),
+      DIRECT_MEMBER (osu::Mcparticle, "pdgId", pdgId ()),
+#endif
+#if IS_VALID(mets) && CANDIDATE_FORMAT
+      CANDIDATE_MEMBERS (osu::Met),
+#endif
+#if IS_VALID(muons) && CANDIDATE_FORMAT
+      CANDIDATE_MEMBERS (osu::Muon),
+      DIRECT_MEMBER (osu::Muon, "pfIsolationR04_.sumChargedHadronPt", pfIsolationR04 ().sumChargedHadronPt),
+      DIRECT_MEMBER (osu::Muon, "pfIsolationR04_.sumNeutralHadronEt", pfIsolationR04 ().sumNeutralHadronEt),
+      DIRECT_MEMBER (osu::Muon, "pfIsolationR04_.sumPhotonEt", pfIsolationR04 ().sumPhotonEt),
+      DIRECT_MEMBER (osu::Muon, "pfIsolationR04_.sumPUPt", pfIsolationR04 ().sumPUPt),
+      DIRECT_MEMBER (osu::Muon, "isGlobalMuon", isGlobalMuon ()),
+      DIRECT_MEMBER (osu::Muon, "isTrackerMuon", isTrackerMuon ()),
+      DIRECT_MEMBER (osu::Muon, "isPFMuon", isPFMuon ()),
+      DIRECT_MEMBER (osu::Muon, "numberOfMatchedStations", numberOfMatchedStations ()),
+#endif
+#if IS_VALID(muons) && DATA_FORMAT == MINI_AOD
+      DIRECT_MEMBER (osu::Muon, "isTightMuonWRTVtx", isTightMuonWRTVtx ()),
+#endif
+#if IS_VALID(photons) && CANDIDATE_FORMAT
+      CANDIDATE_MEMBERS (osu::Photon),
+#endif
+#if IS_VALID(primaryvertexs) && CANDIDATE_FORMAT
+      DIRECT_MEMBER (osu::Primaryvertex, "x", x ()),
+      DIRECT_MEMBER (osu::Primaryvertex, "y", y ()),
+      DIRECT_MEMBER (osu::Primaryvertex, "z", z ()),
+      DIRECT_MEMBER (osu::Primaryvertex, "ndof", ndof ()),
+      DIRECT_MEMBER (osu::Primaryvertex, "chi2", chi2 ()),
+#endif
+#if IS_VALID(taus) && CANDIDATE_FORMAT
+      CANDIDATE_MEMBERS (osu::Tau),
+#endif
+#if IS_VALID(tracks) && DATA_FORMAT == AOD
+      DIRECT_MEMBER (osu::Track, "pt", pt ()),
+      DIRECT_MEMBER (osu::Track, "eta", eta ()),
+      DIRECT_MEMBER (osu::Track, "phi", phi ()),
+      DIRECT_MEMBER (osu::Track, "px", px ()),
+      DIRECT_MEMBER (osu::Track, "py", py ()),
+      DIRECT_MEMBER (osu::Track, "pz", pz ()),
+      DIRECT_MEMBER (osu::Track, "charge", charge ()),
+      DIRECT_MEMBER (osu::Track, "vx", vx ()),
+      DIRECT_MEMBER (osu::Track, "vy", vy ()),
+      DIRECT_MEMBER (osu::Track, "vz", vz ()),
+#endif
+#if IS_VALID(trigobjs) && CANDIDATE_FORMAT
+      CANDIDATE_MEMBERS (osu::Trigobj),
+#endif
+    };
+#if DATA_FORMAT == MINI_AOD_CUSTOM
+  #if IS_VALID(electrons)
+      CUSTOM_CANDIDATE_MEMBERS (osu::Electron);
+  #endif
+  #if IS_VALID(genjets)
+      CUSTOM_CANDIDATE_MEMBERS (osu::Genjet);
+  #endif
+  #if IS_VALID(jets)
+      CUSTOM_CANDIDATE_MEMBERS (osu::Jet);
+  #endif
+  #if IS_VALID(bjets)
+      CUSTOM_CANDIDATE_MEMBERS (osu::Bjet);
+  #endif
+  #if IS_VALID(basicjets)
+      CUSTOM_CANDIDATE_MEMBERS (osu::Basicjet);
+  #endif
+  #if IS_VALID(mcparticles)
+      CUSTOM_CANDIDATE_MEMBERS (osu::Mcparticle);
+  #endif
+  #if IS_VALID(mets)
+      CUSTOM_CANDIDATE_MEMBERS (osu::Met);
+  #endif
+  #if IS_VALID(muons)
+      CUSTOM_CANDIDATE_MEMBERS (osu::Muon);
+  #endif
+  #if IS_VALID(photons)
+      CUSTOM_CANDIDATE_MEMBERS (osu::Photon);
+  #endif
+  #if IS_VALID(taus)
+      CUSTOM_CANDIDATE_MEMBERS (osu::Tau);
+  #endif
+  #if IS_VALID(trigobjs)
+      CUSTOM_CANDIDATE_MEMBERS (osu::Trigobj);
+  #endif
+#endif
+      return members;
+    } ();
+    return directMembers;
+  }
+}
+
+anatools::DirectAccessor
+anatools::getDirectAccessor (const string &type, const string &member)
+{
+  auto directMember = directMembers ().find (make_pair (type, member));
+  return (directMember != directMembers ().end () ? directMember->second.first : NULL);
+}
+
+string
+anatools::getDirectExpression (const string &type, const string &member)
+{
+  auto directMember = directMembers ().find (make_pair (type, member));
+  return (directMember != directMembers ().end () ? directMember->second.second : "");
+}
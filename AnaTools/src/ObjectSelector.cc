@@ -54,17 +54,9 @@
         unsigned iObject = 0;
         bool passes = true;
 
-        if (cutDecisions.isValid ())
-          {
-            for (int iCut = cutDecisions->cumulativeObjectFlags.size () - 1; iCut >= 0; iCut--)
-              {
-                if (cutDecisions->cumulativeObjectFlags.at (iCut).at (collectionToFilter_).at (iObject).second)
-                  {
-                    passes = cutDecisions->cumulativeObjectFlags.at (iCut).at (collectionToFilter_).at (iObject).first;
-                    break;
-                  }
-              }
-          }
+        const vector<bool> *passesAllCuts = (cutDecisions.isValid () ? cutDecisions->getPassesAllCuts (collectionToFilter_) : NULL);
+        if (passesAllCuts && iObject < passesAllCuts->size ())
+          passes = passesAllCuts->at (iObject);
         if (passes)
           {
             *pl_ = *object;
@@ -1,56 +1,596 @@
 #include <iostream>
 #include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <dlfcn.h>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
 
 #include "DataFormats/Math/interface/deltaR.h"
 
 #include "OSUT3Analysis/AnaTools/interface/CommonUtils.h"
+#include "OSUT3Analysis/AnaTools/interface/MemberTable.h"
 #include "OSUT3Analysis/AnaTools/interface/ValueLookupTree.h"
 
+namespace
+{
+  //////////////////////////////////////////////////////////////////////////////
+  // Subexpressions which have been registered by any tree in the process. The
+  // id of a subexpression is its index in references, which counts how many
+  // times it appears among all the trees. The generation is incremented every
+  // time the counts change, so that trees know when to link again.
+  //////////////////////////////////////////////////////////////////////////////
+  struct SubexpressionRegistry
+  {
+    mutex                          lock;
+    unordered_map<string, unsigned>  ids;
+    vector<unsigned>               references;
+    atomic<unsigned>               generation;
+  };
+
+  SubexpressionRegistry &
+  registry ()
+  {
+    static SubexpressionRegistry registry;
+    return registry;
+  }
+  //////////////////////////////////////////////////////////////////////////////
+
+  //////////////////////////////////////////////////////////////////////////////
+  // Key of the value of a shared subexpression, made of the id of the
+  // subexpression and the addresses of the objects it depends on.
+  //////////////////////////////////////////////////////////////////////////////
+  struct ValueKey
+  {
+    unsigned    subexpression;
+    const void  *objects[2];
+
+    bool operator== (const ValueKey &x) const
+    {
+      return (subexpression == x.subexpression && objects[0] == x.objects[0] && objects[1] == x.objects[1]);
+    }
+  };
+
+  struct ValueKeyHash
+  {
+    size_t operator() (const ValueKey &x) const
+    {
+      size_t h = hash<unsigned> () (x.subexpression);
+      h ^= hash<const void *> () (x.objects[0]) + 0x9e3779b9 + (h << 6) + (h >> 2);
+      h ^= hash<const void *> () (x.objects[1]) + 0x9e3779b9 + (h << 6) + (h >> 2);
+      return h;
+    }
+  };
+  //////////////////////////////////////////////////////////////////////////////
+}
+
+// Values of the shared subexpressions for the current event.
+struct ValueStore
+{
+  edm::EventID                                    eventID;
+  unordered_map<ValueKey, double, ValueKeyHash>   values;
+};
+
+// Four-vectors of the collections used by the kinematic operators in the
+// current event, keyed by the address of the first object of each, so that
+// every object is only visited once per event however many trees and
+// combinations use it.
+struct FourVectorStore
+{
+  edm::EventID                                 eventID;
+  unordered_map<const void *, FourVectors>     collections;
+};
+
+namespace
+{
+  //////////////////////////////////////////////////////////////////////////////
+  // There is a ValueStore and a FourVectorStore for every stream, shared by
+  // all of its modules whichever thread they run on, which are emptied
+  // whenever a tree is given the collections of a different event. The tables
+  // of stores are only used while holding storeLock, and a tree keeps the
+  // stores of its stream from then on, since the modules of a stream run one
+  // at a time.
+  //////////////////////////////////////////////////////////////////////////////
+  mutex                                     storeLock;
+  unordered_map<unsigned, ValueStore>       valueStores;
+  unordered_map<unsigned, FourVectorStore>  fourVectorStores;
+  //////////////////////////////////////////////////////////////////////////////
+
+  // The components of FourVectors, in the order used by FourVectorLookup.
+  const char * const FOUR_VECTOR_COMPONENTS[] = {"energy", "px", "py", "pz", "eta", "phi"};
+  vector<double> FourVectors::* const FOUR_VECTOR_MEMBERS[] = {&FourVectors::energy, &FourVectors::px, &FourVectors::py, &FourVectors::pz, &FourVectors::eta, &FourVectors::phi};
+
+  const FourVectors &
+  getFourVectors (FourVectorStore &fourVectorStore, const string &type, const vector<void *> &objects)
+  {
+    auto inserted = fourVectorStore.collections.insert (make_pair (objects.size () ? objects.front () : NULL, FourVectors ()));
+    FourVectors &fourVectors = inserted.first->second;
+    if (!inserted.second)
+      return fourVectors;
+
+    fourVectors.isRegular = true;
+    for (unsigned i = 0; i < 6; i++)
+      {
+        vector<double> &values = fourVectors.*FOUR_VECTOR_MEMBERS[i];
+        anatools::DirectAccessor accessor = anatools::getDirectAccessor (type, FOUR_VECTOR_COMPONENTS[i]);
+        values.resize (objects.size ());
+        for (unsigned k = 0; k < objects.size (); k++)
+          {
+            try
+              {
+                values[k] = (accessor ? accessor (objects[k]) : anatools::getMember (type, objects[k], FOUR_VECTOR_COMPONENTS[i]));
+              }
+            catch (...)
+              {
+                values[k] = INVALID_VALUE;
+              }
+            if (IS_INVALID(values[k]) || (&values == &fourVectors.phi && fabs (values[k]) > M_PI))
+              fourVectors.isRegular = false;
+          }
+      }
+    return fourVectors;
+  }
+  //////////////////////////////////////////////////////////////////////////////
+
+  // Subexpressions shorter than this are cheaper to recompute than to look up.
+  const unsigned MIN_SHARED_INSTRUCTIONS = 5;
+
+  const unsigned NO_SLOT = numeric_limits<unsigned>::max ();
+
+  template<class T> void
+  getAddresses (const vector<T> &collection, vector<void *> &objects)
+  {
+    for (const auto &object : collection)
+      objects.push_back ((void *) &object);
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+  // Single-pass tokenizer and precedence-climbing parser. The trees it builds
+  // have the same shape that the pruning methods of ValueLookupTree expect:
+  // parentheses are kept as "()" nodes, the arguments of functions as ","
+  // nodes, and member accesses as "." nodes, nested to the right. The binary
+  // operators are listed from the lowest precedence to the highest, and those
+  // at the same level associate to the left.
+  //////////////////////////////////////////////////////////////////////////////
+  class Parser
+  {
+    public:
+      Parser (const string &expression) :
+        expression_ (expression)
+      {
+      }
+
+      Node *
+      parse ()
+      {
+        Node *tree = NULL;
+        if (tokenize () && (tree = parseBinary (0)) && token_->second != "")
+          {
+            clog << "ERROR: unexpected \"" << token_->second << "\" in \"" << expression_ << "\"" << endl;
+            destroy (tree);
+            tree = NULL;
+          }
+        return tree;
+      }
+
+      static void
+      destroy (Node * const tree)
+      {
+        for (const auto &branch : tree->branches)
+          destroy (branch);
+        delete tree;
+      }
+
+    private:
+      enum Kind { Number, Identifier, Operator, End };
+
+      bool
+      tokenize ()
+      {
+        static const vector<string> operators = {"||", "&&", "==", "!=", "<=", ">=", "|", "&", "=", "<", ">", "+", "-", "*", "/", "%", "!", ",", ".", "(", ")"};
+        int parentheses = 0;
+        const char *s = expression_.c_str ();
+        for (unsigned i = 0; i < expression_.length (); )
+          {
+            if (isspace (s[i]))
+              i++;
+            else if (isdigit (s[i]) || (s[i] == '.' && isdigit (s[i + 1])))
+              {
+                char *end;
+                strtod (s + i, &end);
+                tokens_.push_back (make_pair (Number, expression_.substr (i, end - (s + i))));
+                i = end - s;
+              }
+            else if (isalpha (s[i]) || s[i] == '_')
+              {
+                unsigned begin = i;
+                while (isalnum (s[i]) || s[i] == '_')
+                  i++;
+                tokens_.push_back (make_pair (Identifier, expression_.substr (begin, i - begin)));
+              }
+            else
+              {
+                auto op = find_if (operators.begin (), operators.end (), [&](const string &x) { return !expression_.compare (i, x.length (), x); });
+                if (op == operators.end ())
+                  {
+                    clog << "ERROR: unexpected \"" << s[i] << "\" in \"" << expression_ << "\"" << endl;
+                    return false;
+                  }
+                (*op == "(") && parentheses++;
+                (*op == ")") && parentheses--;
+                tokens_.push_back (make_pair (Operator, *op));
+                i += op->length ();
+              }
+          }
+        if (parentheses)
+          {
+            clog << "ERROR: missing parentheses in \"" << expression_ << "\"" << endl;
+            return false;
+          }
+        tokens_.push_back (make_pair (End, ""));
+        token_ = tokens_.begin ();
+        return true;
+      }
+
+      Node *
+      parseBinary (const unsigned level)
+      {
+        static const vector<vector<string> > levels = {
+          {","}, {"||", "|"}, {"&&", "&"}, {"==", "!=", "="}, {"<", "<=", ">", ">="}, {"+", "-"}, {"*", "/", "%"}
+        };
+        if (level == levels.size ())
+          return parseUnary ();
+
+        Node *tree = parseBinary (level + 1);
+        while (tree && token_->first == Operator && VEC_CONTAINS (levels.at (level), token_->second))
+          {
+            string op = (token_++)->second;
+            Node *right = parseBinary (level + 1);
+            if (!right)
+              {
+                destroy (tree);
+                return NULL;
+              }
+            tree = node (op, {tree, right});
+          }
+        return tree;
+      }
+
+      Node *
+      parseUnary ()
+      {
+        static const vector<string> functions = {
+          "cos", "sin", "tan", "acos", "asin", "atan", "atan2", "cosh", "sinh", "tanh", "acosh", "asinh", "atanh",
+          "exp", "ldexp", "log", "log10", "exp2", "expm1", "ilogb", "log1p", "log2", "logb", "pow", "sqrt", "cbrt", "hypot",
+          "erf", "erfc", "tgamma", "lgamma", "ceil", "floor", "fmod", "trunc", "round", "rint", "nearbyint", "remainder", "abs", "fabs",
+          "copysign", "nextafter", "fdim", "fmax", "fmin", "max", "min",
+          "deltaPhi", "deltaR", "invMass", "pT", "number", "trigobjDeltaR"
+        };
+        bool isPrefix = (token_->first == Operator && (token_->second == "!" || token_->second == "+" || token_->second == "-")),
+             isFunction = (token_->first == Identifier && VEC_CONTAINS (functions, token_->second));
+        if (!isPrefix && !isFunction)
+          return parseMember ();
+
+        ////////////////////////////////////////////////////////////////////////
+        // A negative number is kept as a single leaf, and a function without
+        // arguments, e.g., "invMass > 20", gets an empty argument, which means
+        // all of the input collections.
+        ////////////////////////////////////////////////////////////////////////
+        string op = (token_++)->second;
+        if (op == "-" && token_->first == Number)
+          return node (op + (token_++)->second, {});
+        if (isFunction && token_->second != "(")
+          return node (op, {node ("", {})});
+        ////////////////////////////////////////////////////////////////////////
+
+        Node *operand = parseUnary ();
+        return (operand ? node (op, {operand}) : NULL);
+      }
+
+      Node *
+      parseMember ()
+      {
+        Node *tree = parsePrimary ();
+        if (!tree || token_->second != ".")
+          return tree;
+        token_++;
+        Node *right = parseMember ();
+        if (!right)
+          {
+            destroy (tree);
+            return NULL;
+          }
+        return node (".", {tree, right});
+      }
+
+      Node *
+      parsePrimary ()
+      {
+        const pair<Kind, string> &token = *token_;
+        if (token.first == Number || (token.first == Identifier && (token_ + 1)->second != "("))
+          {
+            token_++;
+            return node (token.second, {});
+          }
+        if (token.first == Operator && token.second == "(")
+          {
+            token_++;
+            Node *tree = parseBinary (0);
+            if (tree && token_->second == ")")
+              {
+                token_++;
+                return node ("()", {tree});
+              }
+            if (tree)
+              {
+                clog << "ERROR: missing parentheses in \"" << expression_ << "\"" << endl;
+                destroy (tree);
+              }
+            return NULL;
+          }
+        if (token.first == Identifier)
+          clog << "ERROR: unknown function \"" << token.second << "\" in \"" << expression_ << "\"" << endl;
+        else if (token.first == End)
+          clog << "ERROR: unexpected end of \"" << expression_ << "\"" << endl;
+        else
+          clog << "ERROR: unexpected \"" << token.second << "\" in \"" << expression_ << "\"" << endl;
+        return NULL;
+      }
+
+      Node *
+      node (const string &value, const vector<Node *> &branches) const
+      {
+        Node *tree = new Node;
+        tree->parent = NULL;
+        tree->value = value;
+        tree->branches = branches;
+        for (const auto &branch : branches)
+          branch->parent = tree;
+        return tree;
+      }
+
+      const string                                 &expression_;
+      vector<pair<Kind, string> >                  tokens_;
+      vector<pair<Kind, string> >::const_iterator  token_;
+  };
+  //////////////////////////////////////////////////////////////////////////////
+
+  //////////////////////////////////////////////////////////////////////////////
+  // Adds the collections read by an unpruned tree which need not be among its
+  // input collections: the left side of a member access, e.g., the
+  // uservariables in uservariable.x, and the first argument of number() and
+  // of trigobjDeltaR(), which also reads the trigger objects and the trigger
+  // names.
+  //////////////////////////////////////////////////////////////////////////////
+  void
+  addRequiredCollections (const Node * const tree, vector<string> &collections)
+  {
+    const Node *collection = NULL;
+    if (tree->value == ".")
+      collection = tree->branches.at (0);
+    else if (tree->value == "number" || tree->value == "trigobjDeltaR")
+      {
+        collection = tree->branches.at (0);
+        while (collection->value == "()" || collection->value == ",")
+          collection = collection->branches.at (0);
+        if (tree->value == "trigobjDeltaR")
+          {
+            collections.push_back ("trigobjs");
+            collections.push_back ("triggers");
+          }
+      }
+    if (collection && !collection->branches.size () && anatools::getCollectionId (collection->value + "s") < anatools::getCollectionRegistry ().size ())
+      collections.push_back (collection->value + "s");
+
+    for (const auto &branch : tree->branches)
+      addRequiredCollections (branch, collections);
+  }
+  //////////////////////////////////////////////////////////////////////////////
+
+  //////////////////////////////////////////////////////////////////////////////
+  // Pruned trees and compiled programs, keyed by the expression and the sorted
+  // input collections, shared by every tree in the process.
+  //////////////////////////////////////////////////////////////////////////////
+  struct CompiledExpression
+  {
+    Node                               *root;
+    vector<Instruction>                program;
+    vector<pair<unsigned, unsigned> >  subexpressions;
+    unsigned                           stackSize;
+  };
+
+  struct ExpressionCache
+  {
+    mutex                                                                   lock;
+    map<pair<string, vector<string> >, CompiledExpression>                 compiled;
+    map<pair<string, vector<string> >, ValueLookupTree::Precompiled>       precompiled;  // filled by registerPrecompiled ()
+    map<string, void *>                                                     libraries;    // filled by loadPrecompiled (), NULL if not found
+    map<string, unsigned>                                                   codeRequests; // modules yet to release each file of generated code
+  };
+
+  ExpressionCache &
+  expressionCache ()
+  {
+    static ExpressionCache expressionCache;
+    return expressionCache;
+  }
+  //////////////////////////////////////////////////////////////////////////////
+
+  ValueKey
+  getValueKey (const Instruction &instruction, const vector<void *> &objs)
+  {
+    return {instruction.subexpression, {objs[instruction.keySlots[0]], instruction.keySlots[1] != NO_SLOT ? objs[instruction.keySlots[1]] : NULL}};
+  }
+
+  //////////////////////////////////////////////////////////////////////////////
+  // The loops below, and the methods of ValueLookupTree running them, only
+  // vectorize if floating-point operations may be assumed not to trap and the
+  // math functions need not set errno. Nothing here enables traps or reads
+  // errno, so these options are turned on for them alone rather than for the
+  // whole library. Note that GCC decides whether sqrt () sets errno for the
+  // whole file, so for that one the kernels rely on -fno-math-errno being among
+  // the default compiler flags of CMSSW.
+  //////////////////////////////////////////////////////////////////////////////
+#pragma GCC push_options
+#pragma GCC optimize ("no-math-errno", "no-trapping-math")
+
+  //////////////////////////////////////////////////////////////////////////////
+  // Kernels filling the values of a kinematic operator of two objects for all
+  // the pairs from two collections, in the layout of values_, i.e., with the
+  // object from x picking the row and the one from y the column. The first
+  // operand is the object from x, unless swapped is true. If unique is true,
+  // only the pairs above the diagonal are filled, as for two copies of the
+  // same collection. The inner loops have no branches, so the compiler
+  // vectorizes them. Since the libraries are built for core2, the kernels are
+  // also compiled for AVX2, which is used if the processor supports it.
+  //////////////////////////////////////////////////////////////////////////////
+  inline double
+  reducePhi (const double x)
+  {
+    const double y = (x > M_PI ? x - 2.0 * M_PI : x);
+    return (y < -M_PI ? y + 2.0 * M_PI : y);
+  }
+
+  template<Opcode op> inline void
+  fillPairs (const FourVectors &x, const FourVectors &y, const bool swapped, const bool unique, double * const values)
+  {
+    const unsigned n = x.eta.size (), m = y.eta.size ();
+    const double sign = (swapped ? -1.0 : 1.0);
+    const double *energy = y.energy.data (), *px = y.px.data (), *py = y.py.data (), *pz = y.pz.data (),
+                 *eta = y.eta.data (), *phi = y.phi.data ();
+    for (unsigned i = 0; i < n; i++)
+      {
+        double * const row = values + i * m;
+        const double energy0 = x.energy[i], px0 = x.px[i], py0 = x.py[i], pz0 = x.pz[i], eta0 = x.eta[i], phi0 = x.phi[i];
+        for (unsigned j = (unique ? i + 1 : 0); j < m; j++)
+          {
+            if (op == Opcode::DeltaPhi)
+              row[j] = reducePhi (sign * (phi0 - phi[j]));
+            else if (op == Opcode::DeltaR)
+              {
+                const double dEta = eta0 - eta[j], dPhi = reducePhi (phi0 - phi[j]);
+                row[j] = sqrt (dEta * dEta + dPhi * dPhi);
+              }
+            else if (op == Opcode::InvMass)
+              {
+                const double energySum = energy0 + energy[j], pxSum = px0 + px[j], pySum = py0 + py[j], pzSum = pz0 + pz[j];
+                row[j] = sqrt (energySum * energySum - pxSum * pxSum - pySum * pySum - pzSum * pzSum);
+              }
+            else
+              row[j] = hypot (px0 + px[j], py0 + py[j]);
+          }
+      }
+  }
+
+  inline void
+  fillPairs (const Opcode op, const FourVectors &x, const FourVectors &y, const bool swapped, const bool unique, double * const values)
+  {
+    switch (op)
+      {
+        case Opcode::DeltaPhi:  fillPairs<Opcode::DeltaPhi> (x, y, swapped, unique, values);  break;
+        case Opcode::DeltaR:    fillPairs<Opcode::DeltaR> (x, y, swapped, unique, values);    break;
+        case Opcode::InvMass:   fillPairs<Opcode::InvMass> (x, y, swapped, unique, values);   break;
+        default:                fillPairs<Opcode::PT> (x, y, swapped, unique, values);
+      }
+  }
+
+#if defined(__GNUC__) && defined(__x86_64__)
+  __attribute__ ((target ("avx2"))) void
+  fillPairsAVX2 (const Opcode op, const FourVectors &x, const FourVectors &y, const bool swapped, const bool unique, double * const values)
+  {
+    fillPairs (op, x, y, swapped, unique, values);
+  }
+#endif
+  //////////////////////////////////////////////////////////////////////////////
+
+  //////////////////////////////////////////////////////////////////////////////
+  // Loops applying an operator to whole columns of values at once, used by
+  // ValueLookupTree::executeBatch. The result overwrites the first column. The
+  // bodies have no branches, so that the compiler can vectorize them.
+  //////////////////////////////////////////////////////////////////////////////
+  template<class Function> void
+  applyColumn (double * const a, const unsigned n, Function f)
+  {
+    for (unsigned k = 0; k < n; k++)
+      a[k] = IS_INVALID(a[k]) ? INVALID_VALUE : f (a[k]);
+  }
+
+  template<class Function> void
+  applyColumns (double * const a, const double * const b, const unsigned n, Function f)
+  {
+    for (unsigned k = 0; k < n; k++)
+      a[k] = (IS_INVALID(a[k]) | IS_INVALID(b[k])) ? INVALID_VALUE : f (a[k], b[k]);
+  }
+  //////////////////////////////////////////////////////////////////////////////
+
+#pragma GCC pop_options
+}
+
 ValueLookupTree::ValueLookupTree () :
   root_ (NULL),
-  evaluationError_ (false)
+  evaluationError_ (false),
+  linkedGeneration_ (0),
+  batchable_ (false),
+  pairwise_ (false),
+  valueStore_ (NULL),
+  fourVectorStore_ (NULL),
+  precompiled_ (NULL),
+  trigobjFourVectors_ (NULL)
 {
 }
 
 ValueLookupTree::ValueLookupTree (const Cut &cut) :
-  root_ (insert_ (cut.cutString, NULL)),
+  root_ (NULL),
   inputCollections_ (cut.inputCollections),
-  evaluationError_ (false)
+  evaluationError_ (false),
+  linkedGeneration_ (0),
+  batchable_ (false),
+  pairwise_ (false),
+  valueStore_ (NULL),
+  fourVectorStore_ (NULL),
+  precompiled_ (NULL),
+  trigobjFourVectors_ (NULL)
 {
-  pruneCommas (root_);
-  pruneParentheses (root_);
-  pruneDots (root_);
-
   sort (inputCollections_.begin (), inputCollections_.end ());
+  insert (cut.cutString);
 }
 
 ValueLookupTree::ValueLookupTree (const ValueToPrint &value) :
-  root_ (insert_ (value.valueToPrint, NULL)),
+  root_ (NULL),
   inputCollections_ (value.inputCollections),
-  evaluationError_ (false)
+  evaluationError_ (false),
+  linkedGeneration_ (0),
+  batchable_ (false),
+  pairwise_ (false),
+  valueStore_ (NULL),
+  fourVectorStore_ (NULL),
+  precompiled_ (NULL),
+  trigobjFourVectors_ (NULL)
 {
-  pruneCommas (root_);
-  pruneParentheses (root_);
-  pruneDots (root_);
-
   sort (inputCollections_.begin (), inputCollections_.end ());
+  insert (value.valueToPrint);
 }
 
 ValueLookupTree::ValueLookupTree (const string &expression, const vector<string> &inputCollections) :
-  root_ (insert_ (expression, NULL)),
+  root_ (NULL),
   inputCollections_ (inputCollections),
-  evaluationError_ (false)
+  evaluationError_ (false),
+  linkedGeneration_ (0),
+  batchable_ (false),
+  pairwise_ (false),
+  valueStore_ (NULL),
+  fourVectorStore_ (NULL),
+  precompiled_ (NULL),
+  trigobjFourVectors_ (NULL)
 {
-  pruneCommas (root_);
-  pruneParentheses (root_);
-  pruneDots (root_);
-
   sort (inputCollections_.begin (), inputCollections_.end ());
+  insert (expression);
 }
 
 ValueLookupTree::~ValueLookupTree ()
 {
-  destroy (root_);
+  release ();
 }
 
 const Collections * const
@@ -66,13 +606,38 @@ ValueLookupTree::setCollections (Collections * const handles)
   //////////////////////////////////////////////////////////////////////////////
   handles_ = handles;
   values_.clear ();
+  globalIndices_.clear ();
+
+  //////////////////////////////////////////////////////////////////////////////
+  // Shared values only hold for a single event, and whether a subexpression is
+  // worth sharing depends on all the trees which have been compiled so far.
+  //////////////////////////////////////////////////////////////////////////////
+  {
+    lock_guard<mutex> guard (storeLock);
+    valueStore_ = &valueStores[handles_->stream];
+    fourVectorStore_ = &fourVectorStores[handles_->stream];
+  }
+  if (valueStore_->eventID != handles_->eventID)
+    {
+      valueStore_->values.clear ();
+      valueStore_->eventID = handles_->eventID;
+    }
+  if (fourVectorStore_->eventID != handles_->eventID)
+    {
+      fourVectorStore_->collections.clear ();
+      fourVectorStore_->eventID = handles_->eventID;
+    }
+  if (linkedGeneration_ != registry ().generation)
+    link ();
+  //////////////////////////////////////////////////////////////////////////////
+
   nCombinations_.clear ();
   collectionSizes_.clear ();
   nCombinations_.assign (inputCollections_.size (), 1);
-  for (auto collection = inputCollections_.begin (); collection != inputCollections_.end (); collection++)
+  for (unsigned j = 0; j < collectionIds_.size (); j++)
     {
-      unsigned currentSize = getCollectionSize (*collection);
-      for (unsigned i = 0; i < (collection - inputCollections_.begin () + 1); i++)
+      unsigned currentSize = getCollectionSize (collectionIds_.at (j));
+      for (unsigned i = 0; i < j + 1; i++)
         nCombinations_[i] *= currentSize;
       collectionSizes_.push_back (currentSize);
     }
@@ -94,12 +659,109 @@ ValueLookupTree::evaluationError () const
 }
 
 void
-ValueLookupTree::insert (const string &cut)
+ValueLookupTree::insert (const string &expression)
 {
-  root_ = insert_ (cut, NULL);
+  //////////////////////////////////////////////////////////////////////////////
+  // Parsing and compiling only depend on the expression and on the input
+  // collections, so the results are kept in a cache shared by every tree in
+  // the process, and an expression which is used by several modules or
+  // channels is only parsed and compiled once. The pruned trees in the cache
+  // are never modified or destroyed, so root_ simply points into it.
+  //////////////////////////////////////////////////////////////////////////////
+  ExpressionCache &expressions = expressionCache ();
+  {
+    lock_guard<mutex> guard (expressions.lock);
+    auto key = make_pair (expression, inputCollections_);
+    auto compiled = expressions.compiled.find (key);
+    if (compiled == expressions.compiled.end ())
+      {
+        root_ = Parser (expression).parse ();
+        if (root_)
+          {
+            pruneCommas (root_);
+            pruneParentheses (root_);
+            pruneDots (root_);
+          }
+        compile ();
+        compiled = expressions.compiled.insert (make_pair (key, CompiledExpression ({root_, program_, subexpressions_, (unsigned) stack_.size ()}))).first;
+      }
+    root_ = compiled->second.root;
+    program_ = compiled->second.program;
+    subexpressions_ = compiled->second.subexpressions;
+    stack_.assign (compiled->second.stackSize, 0.0);
+
+    auto precompiled = expressions.precompiled.find (key);
+    precompiled_ = (precompiled != expressions.precompiled.end () ? precompiled->second : NULL);
+  }
+  //////////////////////////////////////////////////////////////////////////////
+
+  //////////////////////////////////////////////////////////////////////////////
+  // Records, for each input collection, the index of the previous copy of the
+  // same collection, or the index of the collection itself if it is the first
+  // copy. Since inputCollections_ is sorted, copies are always adjacent.
+  //////////////////////////////////////////////////////////////////////////////
+  previousCopy_.clear ();
+  collectionIds_.clear ();
+  for (unsigned j = 0; j < inputCollections_.size (); j++)
+    {
+      previousCopy_.push_back (j && inputCollections_.at (j) == inputCollections_.at (j - 1) ? j - 1 : j);
+      collectionIds_.push_back (anatools::getCollectionId (inputCollections_.at (j)));
+    }
+  objects_.assign (inputCollections_.size (), vector<void *> ());
+  combination_.assign (inputCollections_.size (), NULL);
+  //////////////////////////////////////////////////////////////////////////////
+
+  release ();
+  share ();
+  link ();
+
+  //////////////////////////////////////////////////////////////////////////////
+  // A program over a single input collection whose lookups all have direct
+  // accessors is run over the whole collection at once by executeBatch ().
+  //////////////////////////////////////////////////////////////////////////////
+  batchable_ = (inputCollections_.size () == 1);
+  for (const auto &instruction : program_)
+    {
+      if (instruction.opcode == Opcode::Invalid
+       || instruction.opcode == Opcode::UservariableLookup
+       || instruction.opcode == Opcode::EventvariableLookup
+       || instruction.opcode == Opcode::TrigobjDeltaR
+       || (instruction.opcode == Opcode::Lookup && !instruction.accessor))
+        batchable_ = false;
+    }
+  //////////////////////////////////////////////////////////////////////////////
+
+  // Each filter used with trigobjDeltaR () gets the trigger objects which
+  // passed it for each event.
+  trigobjFilters_.clear ();
+  for (const auto &instruction : program_)
+    {
+      if (instruction.opcode == Opcode::TrigobjDeltaR && instruction.variableSlot >= trigobjFilters_.size ())
+        trigobjFilters_.resize (instruction.variableSlot + 1, NULL);
+    }
+
+  //////////////////////////////////////////////////////////////////////////////
+  // A program which is nothing but a kinematic operator of one object from
+  // each of two input collections is run for all the pairs at once by
+  // executePairwise (). Load and Store can be ignored, since the values are
+  // cheaper to compute this way than to share.
+  //////////////////////////////////////////////////////////////////////////////
+  vector<const Instruction *> instructions;
+  for (const auto &instruction : program_)
+    {
+      if (instruction.opcode != Opcode::Load && instruction.opcode != Opcode::Store)
+        instructions.push_back (&instruction);
+    }
+  const Instruction * const last = (instructions.size () ? instructions.back () : NULL);
+  pairwise_ = (inputCollections_.size () == 2
+            && last
+            && (last->opcode == Opcode::DeltaPhi || last->opcode == Opcode::DeltaR || last->opcode == Opcode::InvMass || last->opcode == Opcode::PT)
+            && last->nOperands + 1 == instructions.size ()
+            && instructions.front ()->slot != instructions.at (last->nOperands - 1)->slot);
+  //////////////////////////////////////////////////////////////////////////////
 }
 
-const vector<Leaf> &
+const vector<double> &
 ValueLookupTree::evaluate ()
 {
   //////////////////////////////////////////////////////////////////////////////
@@ -110,49 +772,135 @@ ValueLookupTree::evaluate ()
   if (!values_.size ())
     {
       evaluationError_ = false;
-      uservariablesToDelete_.clear ();
-      eventvariablesToDelete_.clear ();
-      for (unsigned i = 0; i < nCombinations_.at (0); i++)
+
+      ////////////////////////////////////////////////////////////////////////////
+      // The number() operator only depends on the event, so its value is
+      // stored in the program once rather than being looked up for each
+      // combination of objects.
+      ////////////////////////////////////////////////////////////////////////////
+      if (nCombinations_.at (0))
+        {
+          for (auto &instruction : program_)
+            if (instruction.opcode == Opcode::Number)
+              instruction.value = getCollectionSize (instruction.collectionId);
+        }
+      ////////////////////////////////////////////////////////////////////////////
+
+      ////////////////////////////////////////////////////////////////////////////
+      // The objects of each input collection are gathered once, and then each
+      // combination is just a set of local indices, one per input collection.
+      // Only the unique combinations are enumerated, i.e., those where the
+      // local indices increase from one copy of a collection to the next, so
+      // that for k copies of a collection of n objects there are C(n,k)
+      // combinations rather than n^k. The values still follow the layout of
+      // global indices in getLocalIndex (), with the combinations which are
+      // not unique left invalid.
+      ////////////////////////////////////////////////////////////////////////////
+      for (unsigned j = 0; j < inputCollections_.size (); j++)
+        getObjects (collectionIds_.at (j), objects_.at (j));
+      localIndices_.assign (inputCollections_.size (), 0);
+      values_.assign (nCombinations_.at (0), INVALID_VALUE);
+
+      ////////////////////////////////////////////////////////////////////////////
+      // The operands of the kinematic operators are read from the four-vectors
+      // of their collections, which are only gathered once per event.
+      ////////////////////////////////////////////////////////////////////////////
+      fourVectors_.assign (inputCollections_.size (), NULL);
+      for (const auto &instruction : program_)
         {
-          objIterators_.clear ();
-          shouldIterate_.clear ();
-          ObjMap objs;
-          unordered_set<string> keys;
-          for (auto collection = inputCollections_.begin (); collection != inputCollections_.end (); collection++)
+          if (instruction.opcode == Opcode::FourVectorLookup && !fourVectors_.at (instruction.slot) && (pairwise_ || !precompiled_))
+            fourVectors_.at (instruction.slot) = &getFourVectors (*fourVectorStore_, instruction.type, objects_.at (instruction.slot));
+        }
+      ////////////////////////////////////////////////////////////////////////////
+
+      ////////////////////////////////////////////////////////////////////////////
+      // The trigger-matching operator reads the four-vectors of the trigger
+      // objects and, for each of its filters, the indices of the objects which
+      // passed it, both of which are only found once per event.
+      ////////////////////////////////////////////////////////////////////////////
+      if (trigobjFilters_.size ())
+        {
+          unsigned id = anatools::getCollectionId ("trigobjs");
+          trigobjFourVectors_ = NULL;
+          trigobjFilters_.assign (trigobjFilters_.size (), NULL);
+          if (collectionIsFound (id))
             {
-              unsigned j = collection - inputCollections_.begin (),
-                       localIndex = getLocalIndex (i, j);
-              objs.insert ({*collection, {j, localIndex, getObject (*collection, localIndex)}});
-              keys.insert (*collection);
+              getObjects (id, trigobjs_);
+              trigobjFourVectors_ = &getFourVectors (*fourVectorStore_, getCollectionType ("trigobjs"), trigobjs_);
+              const unordered_map<string, vector<unsigned> > &filters = anatools::getTrigobjFilterIndex (*handles_);
+              for (const auto &instruction : program_)
+                {
+                  if (instruction.opcode != Opcode::TrigobjDeltaR)
+                    continue;
+                  auto filter = filters.find (instruction.variable);
+                  trigobjFilters_.at (instruction.variableSlot) = (filter != filters.end () ? &filter->second : NULL);
+                }
             }
-          if (isUniqueCase (objs, keys)) { 
-            values_.push_back (evaluate_ (root_, objs));
-	    if (verbose_) { 
-	      cout << "ValueLookupTree::evaluate is adding the Leaf: " << endl;
-	      cout << "  " << evaluate_ (root_, objs) << endl;
-	      cout << "  printNode = " << endl;
-	      cout << "  " << printNode(root_) << endl;
-	      cout << "  printValue = " << endl;
-	      cout << "  " << printValue(root_) << endl;
-	    }
-
-	  } else
-            values_.push_back (INVALID_VALUE);
         }
-#if IS_VALID(uservariables)
-      for (auto &uservariable : uservariablesToDelete_)
-        delete ((osu::Uservariable *) uservariable);
-#endif
-#if IS_VALID(eventvariables)
-      for (auto &eventvariable : eventvariablesToDelete_)
-        delete ((osu::Eventvariable *) eventvariable);
-#endif
+      ////////////////////////////////////////////////////////////////////////////
+
+      if (batchable_ && !precompiled_)
+        executeBatch (objects_.at (0));
+      else if (!pairwise_ || !executePairwise ()) for (bool found = resetCombination (0); found; found = nextCombination ())
+        {
+          unsigned globalIndex = 0;
+          for (unsigned j = 0; j < inputCollections_.size (); j++)
+            {
+              combination_[j] = objects_[j][localIndices_[j]];
+              globalIndex += localIndices_[j] * (j + 1 < inputCollections_.size () ? nCombinations_[j + 1] : 1);
+            }
+          values_[globalIndex] = (precompiled_ ? precompiled_ (combination_.data ()) : execute (combination_));
+          if (verbose_) { 
+            cout << "ValueLookupTree::evaluate is adding the value: " << endl;
+            cout << "  " << values_[globalIndex] << endl;
+            cout << "  printNode = " << endl;
+            cout << "  " << printNode(root_) << endl;
+            cout << "  printValue = " << endl;
+            cout << "  " << printValue(root_) << endl;
+          }
+        }
+      ////////////////////////////////////////////////////////////////////////////
     }
 
   return values_;
   //////////////////////////////////////////////////////////////////////////////
 }
 
+bool
+ValueLookupTree::resetCombination (const unsigned collectionIndex)
+{
+  //////////////////////////////////////////////////////////////////////////////
+  // Sets the local indices of the given collection and all the ones after it
+  // to the smallest values allowed for a unique combination: zero for the
+  // first copy of a collection, and one more than the previous copy
+  // otherwise. Returns false if a collection runs out of objects.
+  //////////////////////////////////////////////////////////////////////////////
+  for (unsigned j = collectionIndex; j < inputCollections_.size (); j++)
+    {
+      localIndices_[j] = (previousCopy_[j] < j ? localIndices_[previousCopy_[j]] + 1 : 0);
+      if (localIndices_[j] >= collectionSizes_[j])
+        return false;
+    }
+  return (inputCollections_.size () > 0);
+  //////////////////////////////////////////////////////////////////////////////
+}
+
+bool
+ValueLookupTree::nextCombination ()
+{
+  //////////////////////////////////////////////////////////////////////////////
+  // Advances the local indices to the next unique combination, in order of
+  // increasing global index. Returns false if there are no more.
+  //////////////////////////////////////////////////////////////////////////////
+  for (unsigned j = inputCollections_.size (); j-- > 0; )
+    {
+      if (++localIndices_[j] < collectionSizes_[j] && resetCombination (j + 1))
+        return true;
+    }
+  return false;
+  //////////////////////////////////////////////////////////////////////////////
+}
+
 unsigned
 ValueLookupTree::getLocalIndex (unsigned globalIndex, unsigned collectionIndex) const
 {
@@ -168,7 +916,8 @@ ValueLookupTree::getLocalIndex (unsigned globalIndex, unsigned collectionIndex)
   // Global index:                 0  1  2  3  4  5  6  7  8
   // Local index for collection 0: 0  0  0  1  1  1  2  2  2
   // Local index for collection 1: 0  1  2  0  1  2  0  1  2 
-  // The function isUniqueCase() will return true only for global indices: 1, 2, 5. 
+  // Only the global indices 1, 2, 5 correspond to unique combinations, which
+  // are the only ones enumerated by resetCombination() and nextCombination().
   //////////////////////////////////////////////////////////////////////////////
   if (collectionIndex + 1 != inputCollections_.size ())
     return ((globalIndex / nCombinations_.at (collectionIndex + 1)) % collectionSizes_.at (collectionIndex));
@@ -177,20 +926,27 @@ ValueLookupTree::getLocalIndex (unsigned globalIndex, unsigned collectionIndex)
   //////////////////////////////////////////////////////////////////////////////
 }
 
-set<unsigned>
-ValueLookupTree::getGlobalIndices (unsigned localIndex, const string &singleObjectCollection, string inputLabel) const
+const vector<vector<unsigned> > &
+ValueLookupTree::getGlobalIndices (const string &singleObjectCollection, const string &inputLabel)
 {
   //////////////////////////////////////////////////////////////////////////////
-  // Returns the global indices within the composite collection named by the
-  // third argument, given a local index within the primitive collection named
+  // Returns, for each local index within the primitive collection named by the
+  // first argument, the global indices within the composite collection named
   // by the second argument.
   // Using the example from above (in the comments to getLocalIndices()), 
-  // the call to getGlobalIndices(0, "muon", "muon-muon") would return the set {0,1,2,3,6}.  
+  // getGlobalIndices("muon", "muon-muon").at(0) would be {0,1,2,3,6}.  
+  // The map is built with a single pass over the composite collection the
+  // first time it is requested in an event, and is then reused until the next
+  // call to setCollections().
   //////////////////////////////////////////////////////////////////////////////
+  auto key = make_pair (singleObjectCollection, inputLabel);
+  auto cached = globalIndices_.find (key);
+  if (cached != globalIndices_.end ())
+    return cached->second;
+
+  vector<vector<unsigned> > &globalIndices = globalIndices_[key];
   vector<string> singleObjects = anatools::getSingleObjects (inputLabel);
-  set<unsigned> globalIndices;
-  vector<unsigned> nCombinations (singleObjects.size (), 1), collectionSizes;
-  unordered_set<unsigned> singleObjectIndices;
+  vector<unsigned> nCombinations (singleObjects.size () + 1, 1), collectionSizes, positions;
   for (auto collection = singleObjects.begin (); collection != singleObjects.end (); collection++)
     {
       unsigned currentSize = getCollectionSize (*collection);
@@ -198,22 +954,16 @@ ValueLookupTree::getGlobalIndices (unsigned localIndex, const string &singleObje
         nCombinations[i] *= currentSize;
       collectionSizes.push_back (currentSize);
       if (*collection == singleObjectCollection)
-        singleObjectIndices.insert (collection - singleObjects.begin ());
+        positions.push_back (collection - singleObjects.begin ());
     }
-  for (const auto &singleObjectIndex : singleObjectIndices)
+  globalIndices.resize (getCollectionSize (singleObjectCollection));
+  for (unsigned i = 0; positions.size () && i < nCombinations.at (0); i++)
     {
-      for (unsigned i = 0; i < nCombinations.at (0); i++)
+      for (const auto &position : positions)
         {
-          if (singleObjectIndex + 1 < singleObjects.size ())
-            {
-              if ((i / nCombinations.at (singleObjectIndex + 1)) % collectionSizes.at (singleObjectIndex) == localIndex)
-                globalIndices.insert (i);
-            }
-          else
-            {
-              if (i % collectionSizes.at (singleObjectIndex) == localIndex)
-                globalIndices.insert (i);
-            }
+          vector<unsigned> &indices = globalIndices.at ((i / nCombinations.at (position + 1)) % collectionSizes.at (position));
+          if (!indices.size () || indices.back () != i)
+            indices.push_back (i);
         }
     }
   //////////////////////////////////////////////////////////////////////////////
@@ -224,9 +974,16 @@ ValueLookupTree::getGlobalIndices (unsigned localIndex, const string &singleObje
 unsigned
 ValueLookupTree::getCollectionSize (const string &name) const
 {
+  return getCollectionSize (anatools::getCollectionId (name));
+}
+
+unsigned
+ValueLookupTree::getCollectionSize (const unsigned id) const
+{
+  const vector<anatools::CollectionEntry> &collections = anatools::getCollectionRegistry ();
 
-  if (!collectionIsFound(name)) {
-    clog << "ERROR [ValueLookupTree::getCollectionSize]:  Could not find collection named " << name
+  if (!collectionIsFound(id)) {
+    clog << "ERROR [ValueLookupTree::getCollectionSize]:  Could not find collection named " << (id < collections.size () ? collections.at (id).name : "(unknown)")
          << " for expression: " << printNode(root_) << endl
          << "List of input collections: " << endl;
     for (uint i=0; i<inputCollections_.size(); i++) clog << "  " << inputCollections_.at(i) << endl;
@@ -234,101 +991,37 @@ ValueLookupTree::getCollectionSize (const string &name) const
     exit(8);
   }
 
-  if (EQ_VALID(name,beamspots))
-    return 1;
-  else if (EQ_VALID(name,bxlumis))
-    return handles_->bxlumis->size ();
-  else if (EQ_VALID(name,electrons))
-    return handles_->electrons->size ();
-  else if (EQ_VALID(name,events))
-    return handles_->events->size ();
-  else if (EQ_VALID(name,genjets))
-    return handles_->genjets->size ();
-  else if (EQ_VALID(name,generatorweights))
-    return 1;
-  else if (EQ_VALID(name,basicjets))
-    return handles_->basicjets->size ();
-  else if (EQ_VALID(name,jets))
-    return handles_->jets->size ();
-  else if (EQ_VALID(name,bjets))
-    return handles_->bjets->size ();
-  else if (EQ_VALID(name,mcparticles))
-    return handles_->mcparticles->size ();
-  else if (EQ_VALID(name,mets))
-    return handles_->mets->size ();
-  else if (EQ_VALID(name,muons))
-    return handles_->muons->size ();
-  else if (EQ_VALID(name,photons))
-    return handles_->photons->size ();
-  else if (EQ_VALID(name,primaryvertexs))
-    return handles_->primaryvertexs->size ();
-  else if (EQ_VALID(name,superclusters))
-    return handles_->superclusters->size ();
-  else if (EQ_VALID(name,taus))
-    return handles_->taus->size ();
-  else if (EQ_VALID(name,tracks))
-    return handles_->tracks->size ();
-  else if (EQ_VALID(name,pileupinfos))
-    return handles_->pileupinfos->size ();
-  else if (EQ_VALID(name,trigobjs))
-    return handles_->trigobjs->size ();
-  else if (EQ_VALID(name,uservariables)){
-    // !!!
-    //    return handles_->uservariables[printValue(root_)].size ();
-    //    return handles_->uservariables["electronPt"].size ();
-    //cout << handles_->uservariables.at(printValue(root_)).size () << endl;
-    //    auto isFound = handles_->uservariables.size();
-    //    cout << printValue(root_) << endl;
-    //    cout << "\t" << isFound << endl;
-    return 1;  // FIXME
-  }
-  else if (EQ_VALID(name,eventvariables)){
-    return 1;  // FIXME
-  }
-  return 0;
+  return collections.at (id).getSize (*handles_);
 }
 
 
 bool
-  ValueLookupTree::collectionIsFound (const string &name) const
+ValueLookupTree::collectionIsFound (const string &name) const
 {
-  bool isFound = false;
-  if        (EQ_VALID(name,beamspots))         isFound = handles_->beamspots.isValid();
-  else  if  (EQ_VALID(name,bxlumis))           isFound  =  handles_->bxlumis.isValid();
-  else  if  (EQ_VALID(name,electrons))         isFound  =  handles_->electrons.isValid();
-  else  if  (EQ_VALID(name,events))            isFound  =  handles_->events.isValid();
-  else  if  (EQ_VALID(name,genjets))           isFound  =  handles_->genjets.isValid();
-  else  if  (EQ_VALID(name,generatorweights))  isFound  =  handles_->generatorweights.isValid();
-  else  if  (EQ_VALID(name,basicjets))         isFound  =  handles_->basicjets.isValid();
-  else  if  (EQ_VALID(name,jets))              isFound  =  handles_->jets.isValid();
-  else  if  (EQ_VALID(name,bjets))             isFound  =  handles_->bjets.isValid();
-  else  if  (EQ_VALID(name,mcparticles))       isFound  =  handles_->mcparticles.isValid();
-  else  if  (EQ_VALID(name,mets))              isFound  =  handles_->mets.isValid();
-  else  if  (EQ_VALID(name,muons))             isFound  =  handles_->muons.isValid();
-  else  if  (EQ_VALID(name,photons))           isFound  =  handles_->photons.isValid();
-  else  if  (EQ_VALID(name,primaryvertexs))    isFound  =  handles_->primaryvertexs.isValid();
-  else  if  (EQ_VALID(name,superclusters))     isFound  =  handles_->superclusters.isValid();
-  else  if  (EQ_VALID(name,taus))              isFound  =  handles_->taus.isValid();
-  else  if  (EQ_VALID(name,tracks))            isFound  =  handles_->tracks.isValid();
-  else  if  (EQ_VALID(name,pileupinfos))            isFound  =  handles_->pileupinfos.isValid();
-  else  if  (EQ_VALID(name,trigobjs))          isFound  =  handles_->trigobjs.isValid();
-  else if (EQ_VALID(name,uservariables))       isFound = true; // This vector is always present, even if its size is 0.
-  else if (EQ_VALID(name,eventvariables))      isFound = true; // This vector is always present, even if its size is 0.
-  return isFound;
-
+  return collectionIsFound (anatools::getCollectionId (name));
 }
 
+bool
+ValueLookupTree::collectionIsFound (const unsigned id) const
+{
+  const vector<anatools::CollectionEntry> &collections = anatools::getCollectionRegistry ();
+  return (id < collections.size () && collections.at (id).isFound (*handles_));
+}
 
-void
-ValueLookupTree::destroy (Node * const x) const
+vector<string>
+ValueLookupTree::getRequiredCollections (const string &expression, vector<string> inputCollections)
 {
-      if(x)
-        {
-          for (const auto &branch : x->branches)
-            destroy (branch);
-          delete x;
-        }
-} 
+  Node *tree = Parser (expression).parse ();
+  if (tree)
+    {
+      addRequiredCollections (tree, inputCollections);
+      Parser::destroy (tree);
+    }
+  sort (inputCollections.begin (), inputCollections.end ());
+  inputCollections.erase (unique (inputCollections.begin (), inputCollections.end ()), inputCollections.end ());
+  return inputCollections;
+}
+
 
 void
 ValueLookupTree::pruneCommas (Node * const tree) const
@@ -452,57 +1145,6 @@ ValueLookupTree::pruneDots_ (Node * const tree) const
   //////////////////////////////////////////////////////////////////////////////
 }
 
-Node *
-ValueLookupTree::insert_ (const string &cut, Node * const parent) const
-{
-  //////////////////////////////////////////////////////////////////////////////
-  // If the given string is missing parentheses, simply print an error and
-  // return NULL. The user can then use the isValid() method to see if
-  // inserting the expression into the tree was successful.
-  //////////////////////////////////////////////////////////////////////////////
-  if (splitParentheses (cut))
-    {
-      clog << "ERROR: missing parentheses in \"" << cut << "\"" << endl;
-      return NULL;
-    }
-  //////////////////////////////////////////////////////////////////////////////
-
-  //////////////////////////////////////////////////////////////////////////////
-  // Try inserting nodes for each possible operator, in reverse order of
-  // operations. If none of the operators can be inserted, then it means we
-  // have hit a leaf.
-  //////////////////////////////////////////////////////////////////////////////
-  Node *tree = new Node;
-  tree->parent = parent;
-  if (!(insertBinaryInfixOperator  (cut,  tree,  {","})                           ||
-        insertBinaryInfixOperator  (cut,  tree,  {"||", "|"})                     ||
-        insertBinaryInfixOperator  (cut,  tree,  {"&&", "&"})                     ||
-        insertBinaryInfixOperator  (cut,  tree,  {"==", "!=", "="}, {"<=", ">="}) ||
-        insertBinaryInfixOperator  (cut,  tree,  {"<", "<=", ">", ">="})          ||
-        insertBinaryInfixOperator  (cut,  tree,  {"+", "-"})                      ||
-        insertBinaryInfixOperator  (cut,  tree,  {"*", "/", "%"})                 ||
-        insertUnaryPrefixOperator  (cut,  tree,  {"!", "+", "-"})                           ||
-        insertUnaryPrefixOperator  (cut,  tree,  {"cos", "sin", "tan", "acos", "asin", "atan", "atan2",
-                                                  "cosh", "sinh", "tanh", "acosh", "asinh", "atanh",
-                                                  "exp", "ldexp", "log", "log10", "exp2", "expm1", "ilogb", "log1p", "log2", "logb",
-                                                  "pow", "sqrt", "cbrt", "hypot",
-                                                  "erf", "erfc", "tgamma", "lgamma",
-                                                  "ceil", "floor", "fmod", "trunc", "round", "rint", "nearbyint", "remainder", "abs", "fabs",
-                                                  "copysign", "nextafter",
-                                                  "fdim", "fmax", "fmin", "max", "min"}) ||
-        insertUnaryPrefixOperator  (cut,  tree,  {"deltaPhi", "deltaR", "invMass", "pT", "number"}) ||
-        insertDots                 (cut,  tree) ||
-        //insertBinaryInfixOperator  (cut,  tree,  {"."})                           ||
-        insertParentheses          (cut,  tree)))
-    {
-      tree->value = cut;
-      anatools::trim (tree->value);
-    }
-  //////////////////////////////////////////////////////////////////////////////
-
-  return tree;
-}
-
 string
 ValueLookupTree::printNode (Node* tree) const
 {
@@ -534,766 +1176,1250 @@ ValueLookupTree::printValue (Node* tree) const
 
 }
 
-Leaf
-ValueLookupTree::evaluate_ (const Node * const tree, const ObjMap &objs)
+void
+ValueLookupTree::compile ()
 {
   //////////////////////////////////////////////////////////////////////////////
-  // Do nothing if the tree is null.
+  // Translates the pruned tree into program_, a list of instructions in the
+  // order in which they should be executed, and sizes the evaluation stack
+  // for the deepest point of the program.
   //////////////////////////////////////////////////////////////////////////////
-  if (!tree)
-    return INVALID_VALUE;
+  map<string, unsigned> references;
+
+  program_.clear ();
+  stack_.clear ();
+  subexpressions_.clear ();
+  depth_ = 0;
+  compile_ (root_, references);
   //////////////////////////////////////////////////////////////////////////////
+}
 
+void
+ValueLookupTree::compile_ (const Node * const tree, map<string, unsigned> &references)
+{
   //////////////////////////////////////////////////////////////////////////////
-  // The node is not a leaf and its value is an operator. First, evaluate its
-  // daughters, then return the result of the operator acting on the daughters.
+  // Compiles a single node and records which instructions it produced. Since
+  // the operands of a node are compiled before the node itself, the ranges of
+  // subexpressions always come before the ranges that contain them.
   //////////////////////////////////////////////////////////////////////////////
-  if (tree->branches.size ())
-    {
-      vector<Leaf> operands;
-      for (const auto &branch : tree->branches)
-        operands.push_back (evaluate_ (branch, objs));
-      if (verbose_) cout << "    Debug evalute 0 (no branches) for tree->value = " << tree->value << endl;
-      return evaluateOperator (tree->value, operands, objs);
-    }
+  unsigned begin = program_.size ();
+  compileNode (tree, references);
+  subexpressions_.push_back (make_pair (begin, program_.size ()));
+  //////////////////////////////////////////////////////////////////////////////
+}
+
+void
+ValueLookupTree::compileNode (const Node * const tree, map<string, unsigned> &references)
+{
+  //////////////////////////////////////////////////////////////////////////////
+  // A null tree always evaluates to an invalid value.
+  //////////////////////////////////////////////////////////////////////////////
+  if (!tree)
+    return emit (Opcode::Constant, 0, INVALID_VALUE);
   //////////////////////////////////////////////////////////////////////////////
 
   //////////////////////////////////////////////////////////////////////////////
-  // The node is a leaf and its value is either a valueLookup variable or a
-  // number. Return the result of the valueLookup function or simply return the
-  // number.
+  // The node is a leaf and its value is either a number or a variable
+  // belonging to the only input collection.
   //////////////////////////////////////////////////////////////////////////////
-  else
+  if (!tree->branches.size ())
     {
       double value;
-      if (isnumber (tree->value, value)) {
-	if (verbose_) cout << "    Debug evalute 1 (isnumber) for tree->value = " << tree->value
-			   << ", value = " << value << endl;      
-        return value;
-      }
-      else if (isCollection (tree->value + "s") || (tree->parent && tree->parent->value == ".")) {
-	if (verbose_) cout << "    Debug evalute 2 for tree->value = " << tree->value 
-	     << ", value = " << value << endl;
-        return tree->value;
-      }
+      if (isnumber (tree->value, value))
+        emit (Opcode::Constant, 0, value);
+      else if (isCollection (tree->value + "s"))
+        {
+          clog << "WARNING: collection \"" << tree->value << "\" cannot be used as a value" << endl;
+          emit (Opcode::Invalid);
+        }
+      else if (inputCollections_.size () == 1)
+        emitLookup (inputCollections_.at (0), tree->value, getSlot (inputCollections_.at (0), references));
       else
         {
-          if (inputCollections_.size () == 1) {
-	    if (verbose_) cout << "    Debug evalute 3" 
-			       << ", calling valueLookup for value: " << tree->value  
-			       << ", collection: " << inputCollections_.at (0)  
-			       << endl;
-            return valueLookup (inputCollections_.at (0), objs, tree->value);
-	  }
           clog << "ERROR: cannot infer ownership of \"" << tree->value << "\"" << endl;
-          evaluationError_ = true;
-          return INVALID_VALUE;
+          emit (Opcode::Invalid);
         }
+      return;
     }
   //////////////////////////////////////////////////////////////////////////////
-}
 
-Leaf
-ValueLookupTree::evaluateOperator (const string &op, const vector<Leaf> &operands, const ObjMap &objs)
-{
-  // Tries to return the result of operating on the operands. Prints out a
-  // warning, sets evaluationError_ to true, and returns the minimum unsigned
-  // integer if there is a problem.
+  const string &op = tree->value;
 
-  try
+  //////////////////////////////////////////////////////////////////////////////
+  // A dot which survived pruning has a collection on the left and a variable
+  // on the right, e.g., muon.pt.
+  //////////////////////////////////////////////////////////////////////////////
+  if (op == ".")
     {
-      // if any of the operands are invalid numeric values, do nothing and
-      // return an invalid numeric value
-      for (const auto &operand : operands)
+      const string collection = tree->branches.at (0)->value + "s",
+                   &variable = tree->branches.at (1)->value;
+      unsigned slot = getSlot (collection, references);
+      if (slot < inputCollections_.size ())
+        emitLookup (collection, variable, slot);
+      else
         {
-          const double *operandValue = NULL;
-          if ((operandValue = boost::get<double> (&operand)))
-            {
-              if (IS_INVALID(*operandValue))
-                return INVALID_VALUE;
-            }
+          clog << "ERROR: \"" << collection << "\" is not an input collection of \"" << variable << "\"" << endl;
+          emit (Opcode::Invalid);
         }
+      return;
+    }
+  //////////////////////////////////////////////////////////////////////////////
 
-      if (op == "||" || op == "|")
-        return (boost::get<double> (operands.at (0)) || boost::get<double> (operands.at (1)));
-      else if (op == "&&" || op == "&")
-        return (boost::get<double> (operands.at (0)) && boost::get<double> (operands.at (1)));
-      else if (op == "==" || op == "=")
-        return (boost::get<double> (operands.at (0)) == boost::get<double> (operands.at (1)));
-      else if (op == "!=")
-        return (boost::get<double> (operands.at (0)) != boost::get<double> (operands.at (1)));
-      else if (op == "<")
-        return (boost::get<double> (operands.at (0)) < boost::get<double> (operands.at (1)));
-      else if (op == "<=")
-        return (boost::get<double> (operands.at (0)) <= boost::get<double> (operands.at (1)));
-      else if (op == ">")
-        return (boost::get<double> (operands.at (0)) > boost::get<double> (operands.at (1)));
-      else if (op == ">=")
-        return (boost::get<double> (operands.at (0)) >= boost::get<double> (operands.at (1)));
-      else if (op == "+")
+  //////////////////////////////////////////////////////////////////////////////
+  // The number operator takes a collection and its value only depends on the
+  // event, so it is filled in by evaluate().
+  //////////////////////////////////////////////////////////////////////////////
+  if (op == "number")
+    {
+      if (tree->branches.size () == 1 && !tree->branches.at (0)->branches.size () && isCollection (tree->branches.at (0)->value + "s"))
         {
-          if (operands.size () == 1)
-            return +boost::get<double> (operands.at (0));
-          else
-            return (boost::get<double> (operands.at (0)) + boost::get<double> (operands.at (1)));
+          emit (Opcode::Number);
+          program_.back ().collection = tree->branches.at (0)->value + "s";
+          program_.back ().collectionId = anatools::getCollectionId (program_.back ().collection);
         }
-      else if (op == "-")
+      else
         {
-          if (operands.size () == 1)
-            return -boost::get<double> (operands.at (0));
-          else
-            return (boost::get<double> (operands.at (0)) - boost::get<double> (operands.at (1)));
+          clog << "ERROR: number() takes a single collection" << endl;
+          emit (Opcode::Invalid);
         }
-      else if (op == "*")
-        return (boost::get<double> (operands.at (0)) * boost::get<double> (operands.at (1)));
-      else if (op == "/")
-        return (boost::get<double> (operands.at (0)) / boost::get<double> (operands.at (1)));
-      else if (op == "%")
-        return ((int) boost::get<double> (operands.at (0)) % (int) boost::get<double> (operands.at (1)));
-      else if (op == "!")
-        return (!boost::get<double> (operands.at (0)));
-      else if (op == "atan2")
-        return (atan2 (boost::get<double> (operands.at (0)), boost::get<double> (operands.at (1))));
-      else if (op == "ldexp")
-        return (ldexp (boost::get<double> (operands.at (0)), boost::get<double> (operands.at (1))));
-      else if (op == "pow")
-        return (pow (boost::get<double> (operands.at (0)), boost::get<double> (operands.at (1))));
-      else if (op == "hypot")
-        return (hypot (boost::get<double> (operands.at (0)), boost::get<double> (operands.at (1))));
-      else if (op == "fmod")
-        return (fmod (boost::get<double> (operands.at (0)), boost::get<double> (operands.at (1))));
-      else if (op == "remainder")
-        return (remainder (boost::get<double> (operands.at (0)), boost::get<double> (operands.at (1))));
-      else if (op == "copysign")
-        return (copysign (boost::get<double> (operands.at (0)), boost::get<double> (operands.at (1))));
-      else if (op == "nextafter")
-        return (nextafter (boost::get<double> (operands.at (0)), boost::get<double> (operands.at (1))));
-      else if (op == "fdim")
-        return (fdim (boost::get<double> (operands.at (0)), boost::get<double> (operands.at (1))));
-      else if (op == "fmax" || op == "max")
-        return (fmax (boost::get<double> (operands.at (0)), boost::get<double> (operands.at (1))));
-      else if (op == "fmin" || op == "min")
-        return (fmin (boost::get<double> (operands.at (0)), boost::get<double> (operands.at (1))));
-      else if (op == "cos")
-        return (cos (boost::get<double> (operands.at (0))));
-      else if (op == "sin")
-        return (sin (boost::get<double> (operands.at (0))));
-      else if (op == "tan")
-        return (tan (boost::get<double> (operands.at (0))));
-      else if (op == "acos")
-        return (acos (boost::get<double> (operands.at (0))));
-      else if (op == "asin")
-        return (asin (boost::get<double> (operands.at (0))));
-      else if (op == "atan")
-        return (atan (boost::get<double> (operands.at (0))));
-      else if (op == "cosh")
-        return (cosh (boost::get<double> (operands.at (0))));
-      else if (op == "sinh")
-        return (sinh (boost::get<double> (operands.at (0))));
-      else if (op == "tanh")
-        return (tanh (boost::get<double> (operands.at (0))));
-      else if (op == "acosh")
-        return (acosh (boost::get<double> (operands.at (0))));
-      else if (op == "asinh")
-        return (asinh (boost::get<double> (operands.at (0))));
-      else if (op == "atanh")
-        return (atanh (boost::get<double> (operands.at (0))));
-      else if (op == "exp")
-        return (exp (boost::get<double> (operands.at (0))));
-      else if (op == "log")
-        return (log (boost::get<double> (operands.at (0))));
-      else if (op == "log10")
-        return (log10 (boost::get<double> (operands.at (0))));
-      else if (op == "exp2")
-        return (exp2 (boost::get<double> (operands.at (0))));
-      else if (op == "expm1")
-        return (expm1 (boost::get<double> (operands.at (0))));
-      else if (op == "ilogb")
-        return (ilogb (boost::get<double> (operands.at (0))));
-      else if (op == "log1p")
-        return (log1p (boost::get<double> (operands.at (0))));
-      else if (op == "log2")
-        return (log2 (boost::get<double> (operands.at (0))));
-      else if (op == "logb")
-        return (logb (boost::get<double> (operands.at (0))));
-      else if (op == "sqrt")
-        return (sqrt (boost::get<double> (operands.at (0))));
-      else if (op == "cbrt")
-        return (cbrt (boost::get<double> (operands.at (0))));
-      else if (op == "erf")
-        return (erf (boost::get<double> (operands.at (0))));
-      else if (op == "erfc")
-        return (erfc (boost::get<double> (operands.at (0))));
-      else if (op == "tgamma")
-        return (tgamma (boost::get<double> (operands.at (0))));
-      else if (op == "lgamma")
-        return (lgamma (boost::get<double> (operands.at (0))));
-      else if (op == "ceil")
-        return (ceil (boost::get<double> (operands.at (0))));
-      else if (op == "floor")
-        return (floor (boost::get<double> (operands.at (0))));
-      else if (op == "trunc")
-        return (trunc (boost::get<double> (operands.at (0))));
-      else if (op == "round")
-        return (round (boost::get<double> (operands.at (0))));
-      else if (op == "rint")
-        return (rint (boost::get<double> (operands.at (0))));
-      else if (op == "nearbyint")
-        return (nearbyint (boost::get<double> (operands.at (0))));
-      else if (op == "abs" || op == "fabs")
-        return (fabs (boost::get<double> (operands.at (0))));
-      else if (op == "deltaPhi")
-        return deltaPhi (valueLookup (boost::get<string> (operands.at (0)) + "s", objs, "phi"),
-                         valueLookup (boost::get<string> (operands.at (1)) + "s", objs, "phi"));
-      else if (op == "deltaR")
-        {
-          double eta0, phi0, eta1, phi1;
-
-          eta0 = valueLookup (boost::get<string> (operands.at (0)) + "s", objs, "eta");
-          phi0 = valueLookup (boost::get<string> (operands.at (0)) + "s", objs, "phi", false);
-          eta1 = valueLookup (boost::get<string> (operands.at (1)) + "s", objs, "eta");
-          phi1 = valueLookup (boost::get<string> (operands.at (1)) + "s", objs, "phi", false);
+      return;
+    }
+  //////////////////////////////////////////////////////////////////////////////
 
-          return deltaR (eta0, phi0, eta1, phi1);
-        }
+  //////////////////////////////////////////////////////////////////////////////
+  // The kinematic operators take collections as operands. Each reference to a
+  // collection is bound to its own copy among the input collections, and the
+  // variables each operator needs are looked up from that copy.
+  //////////////////////////////////////////////////////////////////////////////
+  if (op == "deltaPhi" || op == "deltaR" || op == "invMass" || op == "pT")
+    {
+      vector<string> variables;
+      Opcode opcode;
+      bool pairwise = (op == "deltaPhi" || op == "deltaR");
+      if (op == "deltaPhi")
+        variables = {"phi"}, opcode = Opcode::DeltaPhi;
+      else if (op == "deltaR")
+        variables = {"eta", "phi"}, opcode = Opcode::DeltaR;
       else if (op == "invMass")
-        {
-          double energy = 0.0, px = 0.0, py = 0.0, pz = 0.0;
+        variables = {"energy", "px", "py", "pz"}, opcode = Opcode::InvMass;
+      else
+        variables = {"px", "py"}, opcode = Opcode::PT;
 
-          for (const auto &operand : operands)
+      vector<pair<string, unsigned> > slots;
+      for (const auto &branch : tree->branches)
+        {
+          string collection = branch->value + "s";
+          unsigned slot = branch->branches.size () ? inputCollections_.size () : getSlot (collection, references);
+          if (slot >= inputCollections_.size ())
             {
-              energy += valueLookup (boost::get<string> (operand) + "s", objs, "energy");
-              px += valueLookup (boost::get<string> (operand) + "s", objs, "px", false);
-              py += valueLookup (boost::get<string> (operand) + "s", objs, "py", false);
-              pz += valueLookup (boost::get<string> (operand) + "s", objs, "pz", false);
+              clog << "ERROR: \"" << branch->value << "\" is not an input collection of " << op << "()" << endl;
+              return emit (Opcode::Invalid);
             }
-
-          return sqrt (energy * energy - px * px - py * py - pz * pz);
+          slots.push_back (make_pair (collection, slot));
         }
-      else if (op == "pT")
+      if (pairwise && slots.size () != 2)
         {
-          double px = 0.0, py = 0.0;
-
-          for (const auto &operand : operands)
-            {
-              px += valueLookup (boost::get<string> (operand) + "s", objs, "px", false);
-              py += valueLookup (boost::get<string> (operand) + "s", objs, "py", false);
-            }
-	  return hypot(px,py);
+          clog << "ERROR: " << op << "() takes exactly two collections" << endl;
+          return emit (Opcode::Invalid);
         }
-      else if (op == "number")
-        return getCollectionSize (boost::get<string> (operands.at (0)) + "s");
-      else if (op == ".")
-        return valueLookup (boost::get<string> (operands.at (0)) + "s", objs, boost::get<string> (operands.at (1)));
+
+      for (const auto &slot : slots)
+        for (const auto &variable : variables)
+          {
+            emitLookup (slot.first, variable, slot.second);
+            if (program_.back ().opcode == Opcode::Lookup)
+              {
+                program_.back ().opcode = Opcode::FourVectorLookup;
+                program_.back ().variableSlot = find (begin (FOUR_VECTOR_COMPONENTS), end (FOUR_VECTOR_COMPONENTS), variable) - begin (FOUR_VECTOR_COMPONENTS);
+              }
+          }
+      emit (opcode, slots.size () * variables.size ());
+      return;
     }
-  catch (...)
+  //////////////////////////////////////////////////////////////////////////////
+
+  //////////////////////////////////////////////////////////////////////////////
+  // The trigger-matching operator takes a collection and the label of a
+  // filter, e.g., trigobjDeltaR(muon, hltL3fL1sMu16L1f0L2f10QL3Filtered20Q),
+  // and gives the distance from the object to the closest trigger object which
+  // passed the filter. Its operands are the eta and phi of the object, and the
+  // trigger objects are looked up in evaluate ().
+  //////////////////////////////////////////////////////////////////////////////
+  if (op == "trigobjDeltaR")
     {
-      clog << "WARNING: failed to evaluate \"" << op << " (";
-      for (auto operand = operands.begin (); operand != operands.end (); operand++)
+      if (tree->branches.size () != 2 || tree->branches.at (1)->branches.size () || !isCollection (tree->branches.at (0)->value + "s"))
+        {
+          clog << "ERROR: trigobjDeltaR() takes a collection and a filter label" << endl;
+          return emit (Opcode::Invalid);
+        }
+      string collection = tree->branches.at (0)->value + "s";
+      unsigned slot = tree->branches.at (0)->branches.size () ? inputCollections_.size () : getSlot (collection, references);
+      if (slot >= inputCollections_.size ())
+        {
+          clog << "ERROR: \"" << tree->branches.at (0)->value << "\" is not an input collection of " << op << "()" << endl;
+          return emit (Opcode::Invalid);
+        }
+
+      for (const auto &variable : {"eta", "phi"})
         {
-          if (operand != operands.begin ())
-            clog << ", ";
-          clog << *operand;
+          emitLookup (collection, variable, slot);
+          if (program_.back ().opcode == Opcode::Lookup)
+            {
+              program_.back ().opcode = Opcode::FourVectorLookup;
+              program_.back ().variableSlot = find (begin (FOUR_VECTOR_COMPONENTS), end (FOUR_VECTOR_COMPONENTS), string (variable)) - begin (FOUR_VECTOR_COMPONENTS);
+            }
         }
-      clog << ")\"" << endl;
-      evaluationError_ = true;
+      unsigned filter = count_if (program_.begin (), program_.end (), [](const Instruction &x) { return x.opcode == Opcode::TrigobjDeltaR; });
+      emit (Opcode::TrigobjDeltaR, 2);
+      program_.back ().variable = tree->branches.at (1)->value;
+      program_.back ().variableSlot = filter;
+      return;
     }
-  return INVALID_VALUE;
-}
+  //////////////////////////////////////////////////////////////////////////////
 
-void *
-ValueLookupTree::getObject (const string &name, const unsigned i)
-{
-  if (EQ_VALID(name,beamspots))
-    return ((void *) &(*handles_->beamspots));
-  else if (EQ_VALID(name,bxlumis))
-    return ((void *) &handles_->bxlumis->at (i));
-  else if (EQ_VALID(name,electrons))
-    return ((void *) &handles_->electrons->at (i));
-  else if (EQ_VALID(name,events))
-    return ((void *) &handles_->events->at (i));
-  else if (EQ_VALID(name,genjets))
-    return ((void *) &handles_->genjets->at (i));
-  else if (EQ_VALID(name,generatorweights))
-    return ((void *) &(*handles_->generatorweights));
-  else if (EQ_VALID(name,jets))
-    return ((void *) &handles_->jets->at (i));
-  else if (EQ_VALID(name,bjets))
-    return ((void *) &handles_->bjets->at (i));
-  else if (EQ_VALID(name,basicjets))
-    return ((void *) &handles_->basicjets->at (i));
-  else if (EQ_VALID(name,mcparticles))
-    return ((void *) &handles_->mcparticles->at (i));
-  else if (EQ_VALID(name,mets))
-    return ((void *) &handles_->mets->at (i));
-  else if (EQ_VALID(name,muons))
-    return ((void *) &handles_->muons->at (i));
-  else if (EQ_VALID(name,photons))
-    return ((void *) &handles_->photons->at (i));
-  else if (EQ_VALID(name,primaryvertexs))
-    return ((void *) &handles_->primaryvertexs->at (i));
-  else if (EQ_VALID(name,superclusters))
-    return ((void *) &handles_->superclusters->at (i));
-  else if (EQ_VALID(name,taus))
-    return ((void *) &handles_->taus->at (i));
-  else if (EQ_VALID(name,tracks))
-    return ((void *) &handles_->tracks->at (i));
-  else if (EQ_VALID(name,pileupinfos))
-    return ((void *) &handles_->pileupinfos->at (i));
-  else if (EQ_VALID(name,trigobjs))
-    return ((void *) &handles_->trigobjs->at (i));
-  else if (EQ_VALID(name,uservariables))
+  //////////////////////////////////////////////////////////////////////////////
+  // Everything else is a numeric operator. Its operands are compiled first, so
+  // that they are on the stack when the operator itself is executed.
+  //////////////////////////////////////////////////////////////////////////////
+  static const map<string, pair<Opcode, unsigned> > operators = {
+    {"||", {Opcode::Or, 2}}, {"|", {Opcode::Or, 2}}, {"&&", {Opcode::And, 2}}, {"&", {Opcode::And, 2}},
+    {"==", {Opcode::Equal, 2}}, {"=", {Opcode::Equal, 2}}, {"!=", {Opcode::NotEqual, 2}},
+    {"<", {Opcode::Less, 2}}, {"<=", {Opcode::LessEqual, 2}}, {">", {Opcode::Greater, 2}}, {">=", {Opcode::GreaterEqual, 2}},
+    {"+", {Opcode::Add, 2}}, {"-", {Opcode::Subtract, 2}}, {"*", {Opcode::Multiply, 2}}, {"/", {Opcode::Divide, 2}}, {"%", {Opcode::Modulo, 2}},
+    {"!", {Opcode::Not, 1}},
+    {"atan2", {Opcode::Atan2, 2}}, {"ldexp", {Opcode::Ldexp, 2}}, {"pow", {Opcode::Pow, 2}}, {"hypot", {Opcode::Hypot, 2}},
+    {"fmod", {Opcode::Fmod, 2}}, {"remainder", {Opcode::Remainder, 2}}, {"copysign", {Opcode::Copysign, 2}}, {"nextafter", {Opcode::Nextafter, 2}},
+    {"fdim", {Opcode::Fdim, 2}}, {"fmax", {Opcode::Fmax, 2}}, {"max", {Opcode::Fmax, 2}}, {"fmin", {Opcode::Fmin, 2}}, {"min", {Opcode::Fmin, 2}},
+    {"cos", {Opcode::Cos, 1}}, {"sin", {Opcode::Sin, 1}}, {"tan", {Opcode::Tan, 1}},
+    {"acos", {Opcode::Acos, 1}}, {"asin", {Opcode::Asin, 1}}, {"atan", {Opcode::Atan, 1}},
+    {"cosh", {Opcode::Cosh, 1}}, {"sinh", {Opcode::Sinh, 1}}, {"tanh", {Opcode::Tanh, 1}},
+    {"acosh", {Opcode::Acosh, 1}}, {"asinh", {Opcode::Asinh, 1}}, {"atanh", {Opcode::Atanh, 1}},
+    {"exp", {Opcode::Exp, 1}}, {"log", {Opcode::Log, 1}}, {"log10", {Opcode::Log10, 1}}, {"exp2", {Opcode::Exp2, 1}},
+    {"expm1", {Opcode::Expm1, 1}}, {"ilogb", {Opcode::Ilogb, 1}}, {"log1p", {Opcode::Log1p, 1}}, {"log2", {Opcode::Log2, 1}},
+    {"logb", {Opcode::Logb, 1}}, {"sqrt", {Opcode::Sqrt, 1}}, {"cbrt", {Opcode::Cbrt, 1}},
+    {"erf", {Opcode::Erf, 1}}, {"erfc", {Opcode::Erfc, 1}}, {"tgamma", {Opcode::Tgamma, 1}}, {"lgamma", {Opcode::Lgamma, 1}},
+    {"ceil", {Opcode::Ceil, 1}}, {"floor", {Opcode::Floor, 1}}, {"trunc", {Opcode::Trunc, 1}}, {"round", {Opcode::Round, 1}},
+    {"rint", {Opcode::Rint, 1}}, {"nearbyint", {Opcode::Nearbyint, 1}}, {"abs", {Opcode::Fabs, 1}}, {"fabs", {Opcode::Fabs, 1}}
+  };
+
+  pair<Opcode, unsigned> opcode;
+  if (op == "+" && tree->branches.size () == 1)
+    opcode = make_pair (Opcode::Positive, 1);
+  else if (op == "-" && tree->branches.size () == 1)
+    opcode = make_pair (Opcode::Negative, 1);
+  else if (operators.count (op))
+    opcode = operators.at (op);
+  else
     {
-      //!!!
-      osu::Uservariable *obj = new osu::Uservariable ();
-      for (const auto &handle : handles_->uservariables)
-        obj->insert (handle->begin (), handle->end ());
-      uservariablesToDelete_.push_back (obj);
-      return obj;
+      clog << "ERROR: unknown operator \"" << op << "\"" << endl;
+      return emit (Opcode::Invalid);
     }
-  else if (EQ_VALID(name,eventvariables))
+  if (opcode.second != tree->branches.size ())
     {
-      //!!!
-      osu::Eventvariable *obj = new osu::Eventvariable ();
-      for (const auto &handle : handles_->eventvariables)
-        obj->insert (handle->begin (), handle->end ());
-      eventvariablesToDelete_.push_back (obj);
-      return obj;
+      clog << "ERROR: \"" << op << "\" takes " << opcode.second << " operand(s) but was given " << tree->branches.size () << endl;
+      return emit (Opcode::Invalid);
     }
-  return NULL;
-}
 
-string
-ValueLookupTree::getCollectionType (const string &name) const
-{
-  if (EQ_VALID(name,beamspots))
-    return "osu::Beamspot";
-  else if (EQ_VALID(name,bxlumis))
-    return "osu::Bxlumi";
-  else if (EQ_VALID(name,electrons))
-    return "osu::Electron";
-  else if (EQ_VALID(name,events))
-    return "osu::Event";
-  else if (EQ_VALID(name,genjets))
-    return "osu::Genjet";
-  else if (EQ_VALID(name,generatorweights))
-    return "osu::Generatorweight";
-  else if (EQ_VALID(name,jets))
-    return "osu::Jet";
-  else if (EQ_VALID(name,bjets))
-    return "osu::Bjet";
-  else if (EQ_VALID(name,basicjets))
-    return "osu::Basicjet";
-  else if (EQ_VALID(name,mcparticles))
-    return "osu::Mcparticle";
-  else if (EQ_VALID(name,mets))
-    return "osu::Met";
-  else if (EQ_VALID(name,muons))
-    return "osu::Muon";
-  else if (EQ_VALID(name,photons))
-    return "osu::Photon";
-  else if (EQ_VALID(name,primaryvertexs))
-    return "osu::Primaryvertex";
-  else if (EQ_VALID(name,superclusters))
-    return "osu::Supercluster";
-  else if (EQ_VALID(name,taus))
-    return "osu::Tau";
-  else if (EQ_VALID(name,tracks))
-    return "osu::Track";
-  else if (EQ_VALID(name,pileupinfos))
-    return "osu::PileUpInfo";
-  else if (EQ_VALID(name,trigobjs))
-    return "osu::Trigobj";
-  else if (EQ_VALID(name,uservariables))
-    return "osu::Uservariable";
-  else if (EQ_VALID(name,eventvariables))
-    return "osu::Eventvariable";
-  return "";
+  unsigned begin = program_.size ();
+  vector<unsigned> jumps;
+  for (auto branch = tree->branches.begin (); branch != tree->branches.end (); branch++)
+    {
+      if (branch != tree->branches.begin () && opcode.first == Opcode::And)
+        jumps.push_back (emitJump (Opcode::JumpIfFalse));
+      if (branch != tree->branches.begin () && opcode.first == Opcode::Or)
+        jumps.push_back (emitJump (Opcode::JumpIfTrue));
+      compile_ (*branch, references);
+    }
+  emit (opcode.first, opcode.second);
+  for (const auto &jump : jumps)
+    program_.at (jump).target = program_.size ();
+  fold (begin);
+  //////////////////////////////////////////////////////////////////////////////
 }
 
-bool
-ValueLookupTree::isCollection (const string &name) const
+void
+ValueLookupTree::emit (const Opcode opcode, const unsigned nOperands, const double value)
 {
-  if (EQ_VALID(name,beamspots))
-    return true;
-  else if (EQ_VALID(name,bxlumis))
-    return true;
-  else if (EQ_VALID(name,electrons))
-    return true;
-  else if (EQ_VALID(name,events))
-    return true;
-  else if (EQ_VALID(name,genjets))
-    return true;
-  else if (EQ_VALID(name,generatorweights))
-    return true;
-  else if (EQ_VALID(name,jets))
-    return true;
-  else if (EQ_VALID(name,bjets))
-    return true;
-  else if (EQ_VALID(name,basicjets))
-    return true;
-  else if (EQ_VALID(name,mcparticles))
-    return true;
-  else if (EQ_VALID(name,mets))
-    return true;
-  else if (EQ_VALID(name,muons))
-    return true;
-  else if (EQ_VALID(name,photons))
-    return true;
-  else if (EQ_VALID(name,primaryvertexs))
-    return true;
-  else if (EQ_VALID(name,superclusters))
-    return true;
-  else if (EQ_VALID(name,taus))
-    return true;
-  else if (EQ_VALID(name,pileupinfos))
-    return true;
-  else if (EQ_VALID(name,tracks))
-    return true;
-  else if (EQ_VALID(name,trigobjs))
-    return true;
-  else if (EQ_VALID(name,uservariables))
-    return true;
-  else if (EQ_VALID(name,eventvariables))
-    return true;
-  return false;
+  program_.push_back (Instruction ());
+  program_.back ().opcode = opcode;
+  program_.back ().nOperands = nOperands;
+  program_.back ().value = value;
+
+  depth_ = depth_ - nOperands + 1;
+  if (depth_ > stack_.size ())
+    stack_.resize (depth_);
 }
 
-bool
-ValueLookupTree::isnumber (const string &s, double &x) const
+unsigned
+ValueLookupTree::emitJump (const Opcode opcode)
 {
-  char *p;
-  x = strtod (s.c_str (), &p);
-  return !(*p);
+  // Jumps leave the stack as it is, so the depth does not change.
+  program_.push_back (Instruction ());
+  program_.back ().opcode = opcode;
+  return (program_.size () - 1);
 }
 
-bool
-ValueLookupTree::splitParentheses (string s) const
+void
+ValueLookupTree::fold (const unsigned begin)
 {
-  // Returns true if the number of left parentheses does not equal the number
-  // of right parentheses.
-
-  int parentheses = 0;
-  for (unsigned i = 0; i < s.length (); i++)
+  //////////////////////////////////////////////////////////////////////////////
+  // If the operator which was just emitted at the end of program_ only has
+  // constant operands, replaces it and its operands, which start at the given
+  // index, with a single constant. The operands have already been folded
+  // themselves, so each of them is a single instruction if it is constant.
+  //////////////////////////////////////////////////////////////////////////////
+  const Instruction &op = program_.back ();
+  vector<double> operands;
+  for (unsigned i = begin; i + 1 < program_.size (); i++)
     {
-      char c = s.at (i);
-      if (c == '(')
-        parentheses++;
-      if (c == ')')
-        parentheses--;
+      if (program_.at (i).opcode == Opcode::Constant)
+        operands.push_back (program_.at (i).value);
+      else if (program_.at (i).opcode != Opcode::JumpIfFalse && program_.at (i).opcode != Opcode::JumpIfTrue)
+        return;
     }
-  return parentheses;
+  if (operands.size () != op.nOperands)
+    return;
+
+  double value;
+  if (op.opcode == Opcode::And && !IS_INVALID(operands.at (0)) && !operands.at (0))
+    value = false;
+  else if (op.opcode == Opcode::Or && !IS_INVALID(operands.at (0)) && operands.at (0))
+    value = true;
+  else
+    value = evaluateOperator (op.opcode, operands.data (), operands.size ());
+
+  program_.resize (begin);
+  while (subexpressions_.size () && subexpressions_.back ().first >= begin)
+    subexpressions_.pop_back ();
+  depth_--;
+  emit (Opcode::Constant, 0, value);
+  //////////////////////////////////////////////////////////////////////////////
 }
 
-pair<size_t, string>
-ValueLookupTree::findFirstOf (const string &s, const vector<string> &targets, const vector<string> &vetoTargets, const size_t pos) const
+void
+ValueLookupTree::emitLookup (const string &collection, const string &variable, const unsigned slot)
 {
-  vector<tuple<size_t, size_t, string> > indices;
-  tuple<size_t, size_t, string> firstHit;
-  pair<size_t, string> biggestHit;
+  if (collection == "uservariables")
+    emit (Opcode::UservariableLookup);
+  else if (collection == "eventvariables")
+    emit (Opcode::EventvariableLookup);
+  else
+    emit (Opcode::Lookup);
+  program_.back ().slot = slot;
+  program_.back ().collection = collection;
+  program_.back ().collectionId = anatools::getCollectionId (collection);
+  program_.back ().type = getCollectionType (collection);
+  program_.back ().variable = variable;
+  program_.back ().accessor = anatools::getDirectAccessor (program_.back ().type, variable);
+  if (collection == "uservariables")
+    program_.back ().variableSlot = anatools::getUservariableSlot (variable);
+  else if (collection == "eventvariables")
+    program_.back ().variableSlot = anatools::getEventvariableSlot (variable);
+}
 
+unsigned
+ValueLookupTree::getSlot (const string &collection, map<string, unsigned> &references) const
+{
   //////////////////////////////////////////////////////////////////////////////
-  // For each of the target strings, find the index of the first instance of
-  // it. Then sort the indices in ascending order.
-  //////////////////////////////////////////////////////////////////////////////
-  for (const auto &target : targets)
-    {
-      size_t index = s.find (target, pos);
-      if (!vetoMatch (s, target, index, vetoTargets))
-        indices.push_back (make_tuple (index, index, target));
-    }
-  sort (indices.begin (), indices.end (), anatools::firstOfTupleAscending);
+  // Returns the index within inputCollections_ of the object to use for the
+  // next reference to the given collection in the expression. The first
+  // reference gets the first copy of the collection, the second reference gets
+  // the second copy, and so on, wrapping around if there are more references
+  // than copies. For example, with inputCollections_ = {muons, muons},
+  // "invMass (muon, muon) > 60 && invMass (muon, muon) < 120" uses the copies
+  // 0, 1, 0, 1. Returns the number of input collections if the collection is
+  // not an input collection at all.
+  //////////////////////////////////////////////////////////////////////////////
+  auto range = equal_range (inputCollections_.begin (), inputCollections_.end (), collection);
+  unsigned copies = range.second - range.first;
+  if (!copies)
+    return inputCollections_.size ();
+  return ((range.first - inputCollections_.begin ()) + (references[collection]++ % copies));
   //////////////////////////////////////////////////////////////////////////////
+}
 
+void
+ValueLookupTree::share ()
+{
   //////////////////////////////////////////////////////////////////////////////
-  // If there are no matches, just return string::npos.
-  //////////////////////////////////////////////////////////////////////////////
-  if (!indices.size ())
-    return make_pair (string::npos, "");
+  // Picks out the subexpressions worth sharing: single lookups which have to
+  // go through the dictionaries, and subexpressions of at least
+  // MIN_SHARED_INSTRUCTIONS instructions. Either way, they must depend on at
+  // most two objects, and must not involve user or event variables, whose
+  // objects are rebuilt for every combination, nor number () or
+  // trigobjDeltaR (), whose results depend on products that are not part of
+  // the key. Each one is registered under a
+  // canonical text in which the objects are numbered in order of appearance,
+  // so that the same subexpression gets the same id in every tree.
+  //////////////////////////////////////////////////////////////////////////////
+  struct Candidate
+  {
+    unsigned  begin, end, id;
+    unsigned  keySlots[2];
+  };
+  vector<Candidate> candidates;
+  SubexpressionRegistry &subexpressions = registry ();
+  {
+    lock_guard<mutex> guard (subexpressions.lock);
+    for (const auto &range : subexpressions_)
+      {
+        unsigned size = range.second - range.first, nLookups = 0;
+        vector<unsigned> slots;
+        bool shareable = true;
+        stringstream text;
+        text.precision (17);
+        for (unsigned i = range.first; shareable && i < range.second; i++)
+          {
+            const Instruction &instruction = program_.at (i);
+            switch (instruction.opcode)
+              {
+                case Opcode::Constant:
+                  text << "C" << instruction.value << ";";
+                  break;
+                case Opcode::Lookup:
+                case Opcode::FourVectorLookup:
+                  {
+                    auto slot = find (slots.begin (), slots.end (), instruction.slot);
+                    if (slot == slots.end ())
+                      slot = slots.insert (slots.end (), instruction.slot);
+                    text << "L" << instruction.collection << "#" << (slot - slots.begin ()) << "." << instruction.variable << ";";
+                    nLookups++;
+                    break;
+                  }
+                case Opcode::Invalid:
+                case Opcode::Number:
+                case Opcode::UservariableLookup:
+                case Opcode::EventvariableLookup:
+                case Opcode::TrigobjDeltaR:
+                  shareable = false;
+                  break;
+                default:
+                  text << "O" << (unsigned) instruction.opcode << "/" << instruction.nOperands << ";";
+              }
+          }
+        if (!shareable || !nLookups || slots.size () > 2)
+          continue;
+        if (size == 1 ? program_.at (range.first).accessor != NULL : size < MIN_SHARED_INSTRUCTIONS)
+          continue;
+
+        auto id = subexpressions.ids.insert (make_pair (text.str (), subexpressions.ids.size ()));
+        if (id.second)
+          subexpressions.references.push_back (0);
+        subexpressions.references.at (id.first->second)++;
+        sharedIds_.push_back (id.first->second);
+        candidates.push_back ({range.first, range.second, id.first->second, {slots.at (0), slots.size () > 1 ? slots.at (1) : NO_SLOT}});
+      }
+    if (candidates.size ())
+      subexpressions.generation++;
+  }
   //////////////////////////////////////////////////////////////////////////////
 
   //////////////////////////////////////////////////////////////////////////////
-  // If there are multiple targets which match at the same position in the
-  // string, then only return the one which matches the most characters.
+  // Rebuilds the program with each candidate bracketed by Load and Store. The
+  // candidates are in the order in which compile_ () finished them, so when
+  // several begin at the same instruction, the outermost comes last, and when
+  // several end at the same instruction, the innermost comes first.
   //////////////////////////////////////////////////////////////////////////////
-  firstHit = indices.at (0);
-  for (auto index = indices.begin (); index != indices.end () && get<0> (*index) == get<0> (firstHit); index++)
+  vector<Instruction> program;
+  vector<unsigned> loads (candidates.size ()), newIndices (program_.size ());
+  for (unsigned i = 0; i < program_.size (); i++)
     {
-      if (get<2> (*index).length () > biggestHit.second.length ())
-        biggestHit = make_pair (get<1> (*index), get<2> (*index));
+      for (unsigned j = candidates.size (); j-- > 0; )
+        {
+          if (candidates.at (j).begin != i)
+            continue;
+          loads.at (j) = program.size ();
+          program.push_back (Instruction ());
+          program.back ().opcode = Opcode::Load;
+          program.back ().subexpression = candidates.at (j).id;
+          program.back ().keySlots[0] = candidates.at (j).keySlots[0];
+          program.back ().keySlots[1] = candidates.at (j).keySlots[1];
+        }
+      newIndices.at (i) = program.size ();
+      program.push_back (program_.at (i));
+      for (unsigned j = 0; j < candidates.size (); j++)
+        {
+          if (candidates.at (j).end != i + 1)
+            continue;
+          program.push_back (program.at (loads.at (j)));
+          program.back ().opcode = Opcode::Store;
+          program.at (loads.at (j)).target = program.size ();
+        }
     }
-  return biggestHit;
-  //////////////////////////////////////////////////////////////////////////////
-}
-
-pair<size_t, string>
-ValueLookupTree::findLastOf (const string &s, const vector<string> &targets, const vector<string> &vetoTargets, const size_t pos) const
-{
-  vector<tuple<size_t, size_t, string> > indices;
-  tuple<size_t, size_t, string> firstHit;
-  pair<size_t, string> biggestHit;
 
-  //////////////////////////////////////////////////////////////////////////////
-  // For each of the target strings, find the index of the first instance of
-  // it. Then sort the indices in ascending order.
-  //////////////////////////////////////////////////////////////////////////////
-  for (const auto &target : targets)
+  // A jump lands right after the operator it belongs to, so that the value of
+  // the operator is still stored if it is shared.
+  for (auto &instruction : program)
     {
-      size_t index = s.rfind (target, pos);
-      if (!vetoMatch (s, target, index, vetoTargets))
-        indices.push_back (make_tuple (index + target.length () - 1, index, target));
+      if (instruction.opcode == Opcode::JumpIfFalse || instruction.opcode == Opcode::JumpIfTrue)
+        instruction.target = newIndices.at (instruction.target - 1) + 1;
     }
-  sort (indices.begin (), indices.end (), anatools::firstOfTupleDescending);
+  program_.swap (program);
   //////////////////////////////////////////////////////////////////////////////
+}
 
+void
+ValueLookupTree::link ()
+{
   //////////////////////////////////////////////////////////////////////////////
-  // If there are no matches, just return string::npos.
-  //////////////////////////////////////////////////////////////////////////////
-  if (!indices.size ())
-    return make_pair (string::npos, "");
+  // Decides which of the bracketed subexpressions actually use the shared
+  // values. This is worthwhile for lookups through the dictionaries, for
+  // subexpressions which appear more than once among all the trees, and for
+  // subexpressions which depend on fewer objects than there are input
+  // collections, since the same objects then come up in many combinations.
   //////////////////////////////////////////////////////////////////////////////
+  SubexpressionRegistry &subexpressions = registry ();
+  lock_guard<mutex> guard (subexpressions.lock);
 
-  //////////////////////////////////////////////////////////////////////////////
-  // If there are multiple targets which match at the same position in the
-  // string, then only return the one which matches the most characters.
-  //////////////////////////////////////////////////////////////////////////////
-  firstHit = indices.at (0);
-  for (auto index = indices.begin (); index != indices.end () && get<0> (*index) == get<0> (firstHit); index++)
+  linkedGeneration_ = subexpressions.generation;
+  for (unsigned i = 0; i < program_.size (); i++)
     {
-      if (get<2> (*index).length () > biggestHit.second.length ())
-        biggestHit = make_pair (get<1> (*index), get<2> (*index));
+      Instruction &load = program_.at (i);
+      if (load.opcode != Opcode::Load)
+        continue;
+      bool isLookup = (load.target == i + 3 && program_.at (i + 1).opcode == Opcode::Lookup);
+      unsigned nObjects = (load.keySlots[1] != NO_SLOT ? 2 : 1);
+      load.isShared = (isLookup
+                    || subexpressions.references.at (load.subexpression) > 1
+                    || nObjects < inputCollections_.size ());
+      program_.at (load.target - 1).isShared = load.isShared;
     }
-  return biggestHit;
   //////////////////////////////////////////////////////////////////////////////
 }
 
-bool
-ValueLookupTree::vetoMatch (const string &s, const string &target, const size_t index, const vector<string> &vetoTargets) const
+void
+ValueLookupTree::release ()
 {
-  //////////////////////////////////////////////////////////////////////////////
-  // If there was no match, just return true, indicating a veto.
-  //////////////////////////////////////////////////////////////////////////////
-  if (index == string::npos)
-    return true;
-  //////////////////////////////////////////////////////////////////////////////
+  if (!sharedIds_.size ())
+    return;
+
+  SubexpressionRegistry &subexpressions = registry ();
+  lock_guard<mutex> guard (subexpressions.lock);
 
+  for (const auto &id : sharedIds_)
+    subexpressions.references.at (id)--;
+  subexpressions.generation++;
+  sharedIds_.clear ();
+}
+
+double
+ValueLookupTree::execute (const vector<void *> &objs)
+{
   //////////////////////////////////////////////////////////////////////////////
-  // We veto an operator match if:
-  //   (1) the first character of the operator and the previous character are
-  //   alphanumeric or an underscore.
-  //   (2) the last character of the operator and the next character are
-  //   alphanumeric or an underscore.
-  //   (3) if the match is embedded in one of the veto targets passed to the
-  //   function.
+  // Runs the compiled program for a single combination of objects. Leaves
+  // push their values onto the stack, and operators replace their operands on
+  // the stack with their result, so that what remains at the bottom of the
+  // stack is the value of the entire expression. A subexpression whose value
+  // is already in the shared store is skipped entirely, as is the right
+  // operand of && and || when the left operand decides the result.
   //////////////////////////////////////////////////////////////////////////////
-  size_t end = index + target.length () - 1;
-  char first = s.at (index), last = s.at (end),
-       preceding = index > 0 ? s.at (index - 1) : '\0', proceeding = end < s.length () - 1 ? s.at (end + 1) : '\0';
-  if ((isalnum (first) || first == '_') && (isalnum (preceding) || preceding == '_'))
-    return true;
-  if ((isalnum (last) || last == '_') && (isalnum (proceeding) || proceeding == '_'))
-    return true;
-  for (const auto &vetoTarget : vetoTargets)
+  double *stack = stack_.data ();
+  unsigned top = 0;
+
+  for (unsigned i = 0; i < program_.size (); i++)
     {
-      size_t i = s.find (vetoTarget, max ((size_t) 0, index - vetoTarget.length () - 1));
-      if (i <= index)
-        return true;
+      const Instruction &instruction = program_[i];
+      switch (instruction.opcode)
+        {
+          case Opcode::Load:
+            if (instruction.isShared)
+              {
+                auto value = valueStore_->values.find (getValueKey (instruction, objs));
+                if (value != valueStore_->values.end ())
+                  {
+                    stack[top++] = value->second;
+                    i = instruction.target - 1;
+                  }
+              }
+            break;
+          case Opcode::Store:
+            if (instruction.isShared)
+              valueStore_->values[getValueKey (instruction, objs)] = stack[top - 1];  // set by the Load which brackets it
+            break;
+          case Opcode::JumpIfFalse:
+            if (IS_INVALID(stack[top - 1]))
+              i = instruction.target - 1;
+            else if (!stack[top - 1])
+              stack[top - 1] = false, i = instruction.target - 1;
+            break;
+          case Opcode::JumpIfTrue:
+            if (IS_INVALID(stack[top - 1]))
+              i = instruction.target - 1;
+            else if (stack[top - 1])
+              stack[top - 1] = true, i = instruction.target - 1;
+            break;
+          case Opcode::Constant:
+          case Opcode::Number:
+            stack[top++] = instruction.value;
+            break;
+          case Opcode::Invalid:
+            evaluationError_ = true;
+            stack[top++] = INVALID_VALUE;
+            break;
+          case Opcode::Lookup:
+          case Opcode::UservariableLookup:
+          case Opcode::EventvariableLookup:
+            stack[top++] = valueLookup (instruction, objs);
+            break;
+          case Opcode::FourVectorLookup:
+            stack[top++] = (fourVectors_[instruction.slot]->*FOUR_VECTOR_MEMBERS[instruction.variableSlot])[localIndices_[instruction.slot]];
+            break;
+          case Opcode::TrigobjDeltaR:
+            top -= 2;
+            stack[top] = trigobjDeltaR (instruction.variableSlot, stack[top], stack[top + 1]);
+            top++;
+            break;
+          default:
+            top -= instruction.nOperands;
+            stack[top] = evaluateOperator (instruction.opcode, stack + top, instruction.nOperands);
+            top++;
+        }
     }
-  //////////////////////////////////////////////////////////////////////////////
 
-  return false;
+  return (top ? stack[0] : INVALID_VALUE);
+  //////////////////////////////////////////////////////////////////////////////
 }
 
-bool
-ValueLookupTree::isUniqueCase (const ObjMap &objs, const unordered_set<string> &keys) const
+// compiled with the same options as the kernels above, which they call
+#pragma GCC push_options
+#pragma GCC optimize ("no-math-errno", "no-trapping-math")
+
+void
+ValueLookupTree::executeBatch (const vector<void *> &objs)
 {
   //////////////////////////////////////////////////////////////////////////////
-  // Returns true only if the given objects are unique and in a specific order.
-  // This is to avoid double counting.
-  //////////////////////////////////////////////////////////////////////////////
-  bool pass = true;
-
-  for (const auto &key : keys)
+  // Runs the compiled program once for all the objects of a single input
+  // collection, writing the results straight into values_. Each entry of the
+  // stack is a column holding one value per object, so that the common
+  // operators become simple loops over contiguous arrays. The jumps are not
+  // needed here, since And and Or below give the same results as the short
+  // circuit. A shared subexpression is only skipped if its values for all of
+  // the objects are already in the store.
+  //////////////////////////////////////////////////////////////////////////////
+  const unsigned n = values_.size ();
+  columns_.resize (stack_.size () * n);
+  double *columns = columns_.data (), *stack = stack_.data ();
+  unsigned top = 0;
+  ValueStore &valueStore = *valueStore_;
+
+  for (unsigned i = 0; i < program_.size (); i++)
     {
-      if (objs.count (key) <= 1)
-        continue;
-      else
+      const Instruction &instruction = program_[i];
+      double *a, *b = columns + top * n;
+      switch (instruction.opcode)
         {
-          auto range = objs.equal_range (key);
-          vector<pair<string, DressedObject> > objsOfThisType (range.first, range.second);
-          sort (objsOfThisType.begin (), objsOfThisType.end (), anatools::collectionIndexAscending);
-          int previousLocalIndex = -1;
-          for (const auto &obj : objsOfThisType)
+          case Opcode::Load:
+            if (instruction.isShared)
+              {
+                unsigned k = 0;
+                for (; k < n; k++)
+                  {
+                    combination_[0] = objs[k];
+                    auto value = valueStore.values.find (getValueKey (instruction, combination_));
+                    if (value == valueStore.values.end ())
+                      break;
+                    b[k] = value->second;
+                  }
+                if (k == n)
+                  top++, i = instruction.target - 1;
+              }
+            break;
+          case Opcode::Store:
+            if (instruction.isShared)
+              {
+                a = b - n;
+                for (unsigned k = 0; k < n; k++)
+                  {
+                    combination_[0] = objs[k];
+                    valueStore.values[getValueKey (instruction, combination_)] = a[k];
+                  }
+              }
+            break;
+          case Opcode::JumpIfFalse:
+          case Opcode::JumpIfTrue:
+            break;
+          case Opcode::Constant:
+          case Opcode::Number:
+            fill (b, b + n, instruction.value);
+            top++;
+            break;
+          case Opcode::Lookup:
+            for (unsigned k = 0; k < n; k++)
+              {
+                try
+                  {
+                    b[k] = instruction.accessor (objs[k]);
+                  }
+                catch (...)
+                  {
+                    b[k] = INVALID_VALUE;
+                  }
+              }
+            top++;
+            break;
+          case Opcode::FourVectorLookup:
             {
-              pass = pass && ((int) obj.second.localIndex > previousLocalIndex);
-              previousLocalIndex = obj.second.localIndex;
+              const vector<double> &column = fourVectors_[0]->*FOUR_VECTOR_MEMBERS[instruction.variableSlot];
+              copy (column.begin (), column.end (), b);
             }
+            top++;
+            break;
+          default:
+            a = columns + (top - instruction.nOperands) * n;
+            b = a + n;
+            switch (instruction.opcode)
+              {
+                case Opcode::Or:
+                  for (unsigned k = 0; k < n; k++)
+                    a[k] = IS_INVALID(a[k]) ? INVALID_VALUE : (a[k] ? 1.0 : (IS_INVALID(b[k]) ? INVALID_VALUE : (b[k] != 0.0)));
+                  break;
+                case Opcode::And:
+                  for (unsigned k = 0; k < n; k++)
+                    a[k] = IS_INVALID(a[k]) ? INVALID_VALUE : (!a[k] ? 0.0 : (IS_INVALID(b[k]) ? INVALID_VALUE : (b[k] != 0.0)));
+                  break;
+                case Opcode::Equal:         applyColumns (a, b, n, [] (double x, double y) -> double { return (x == y); });  break;
+                case Opcode::NotEqual:      applyColumns (a, b, n, [] (double x, double y) -> double { return (x != y); });  break;
+                case Opcode::Less:          applyColumns (a, b, n, [] (double x, double y) -> double { return (x < y); });   break;
+                case Opcode::LessEqual:     applyColumns (a, b, n, [] (double x, double y) -> double { return (x <= y); });  break;
+                case Opcode::Greater:       applyColumns (a, b, n, [] (double x, double y) -> double { return (x > y); });   break;
+                case Opcode::GreaterEqual:  applyColumns (a, b, n, [] (double x, double y) -> double { return (x >= y); });  break;
+                case Opcode::Add:           applyColumns (a, b, n, [] (double x, double y) -> double { return (x + y); });   break;
+                case Opcode::Subtract:      applyColumns (a, b, n, [] (double x, double y) -> double { return (x - y); });   break;
+                case Opcode::Multiply:      applyColumns (a, b, n, [] (double x, double y) -> double { return (x * y); });   break;
+                case Opcode::Divide:        applyColumns (a, b, n, [] (double x, double y) -> double { return (x / y); });   break;
+                case Opcode::Fmax:          applyColumns (a, b, n, [] (double x, double y) -> double { return fmax (x, y); });  break;
+                case Opcode::Fmin:          applyColumns (a, b, n, [] (double x, double y) -> double { return fmin (x, y); });  break;
+                case Opcode::Positive:      applyColumn (a, n, [] (double x) -> double { return +x; });       break;
+                case Opcode::Negative:      applyColumn (a, n, [] (double x) -> double { return -x; });       break;
+                case Opcode::Not:           applyColumn (a, n, [] (double x) -> double { return !x; });       break;
+                case Opcode::Fabs:          applyColumn (a, n, [] (double x) -> double { return fabs (x); }); break;
+                case Opcode::Sqrt:          applyColumn (a, n, [] (double x) -> double { return sqrt (x); }); break;
+                default:
+                  //////////////////////////////////////////////////////////////
+                  // Everything else goes through evaluateOperator () one
+                  // object at a time, using the scalar stack for the operands.
+                  //////////////////////////////////////////////////////////////
+                  for (unsigned k = 0; k < n; k++)
+                    {
+                      for (unsigned j = 0; j < instruction.nOperands; j++)
+                        stack[j] = a[j * n + k];
+                      a[k] = evaluateOperator (instruction.opcode, stack, instruction.nOperands);
+                    }
+                  //////////////////////////////////////////////////////////////
+              }
+            top -= instruction.nOperands - 1;
         }
     }
 
-  return pass;
+  if (top)
+    copy (columns, columns + n, values_.begin ());
   //////////////////////////////////////////////////////////////////////////////
 }
 
 bool
-ValueLookupTree::insertBinaryInfixOperator (const string &s, Node * const tree, const vector<string> &operators, const vector<string> &vetoOperators) const
+ValueLookupTree::executePairwise ()
 {
-  bool foundAnOperator = false;
-  double x;
   //////////////////////////////////////////////////////////////////////////////
-  // If the string is a number, then simply return false;
+  // Fills values_ with a kinematic operator of one object from each of the
+  // two input collections, for all the pairs at once, straight from their
+  // four-vectors. For two copies of the same collection, only the unique
+  // pairs are filled. Returns false, leaving the work to execute (), if either
+  // collection has invalid values or a phi outside of [-pi, pi].
   //////////////////////////////////////////////////////////////////////////////
-  if (isnumber (s, x))
+  const FourVectors &x = *fourVectors_.at (0), &y = *fourVectors_.at (1);
+  if (!x.isRegular || !y.isRegular)
     return false;
-  //////////////////////////////////////////////////////////////////////////////
 
-  //////////////////////////////////////////////////////////////////////////////
-  // For each operator which is found in the string, split the string into a
-  // left and right substring. These substrings are inserted into the tree and
-  // stored as branches for the operator's node.
-  //////////////////////////////////////////////////////////////////////////////
-  for (auto i = findLastOf (s, operators, vetoOperators); !foundAnOperator && i.first != string::npos; i = i.first ? findLastOf (s, operators, vetoOperators, i.first - 1) : make_pair (string::npos, ""))
+  const Instruction *first = NULL, *op = NULL;
+  for (const auto &instruction : program_)
     {
-      string left, right;
-      left = s.substr (0, i.first);
-      right = s.substr (i.first + i.second.length ());
-      if (!splitParentheses (left) && !splitParentheses (right))
-        {
-          anatools::trim (left);
-          anatools::trim (right);
-
-          if (left == "" || right == "") continue;
-          tree->value = i.second;
-          tree->branches.push_back (insert_ (left, tree));
-          tree->branches.push_back (insert_ (right, tree));
-          foundAnOperator = true;
-        }
+      if (instruction.opcode == Opcode::FourVectorLookup && !first)
+        first = &instruction;
+      if (instruction.opcode != Opcode::Load && instruction.opcode != Opcode::Store)
+        op = &instruction;
     }
-  //////////////////////////////////////////////////////////////////////////////
+  bool swapped = (first->slot != 0), unique = (inputCollections_.at (0) == inputCollections_.at (1));
 
-  return foundAnOperator;
+#if defined(__GNUC__) && defined(__x86_64__)
+  static const bool hasAVX2 = __builtin_cpu_supports ("avx2");
+  if (hasAVX2)
+    fillPairsAVX2 (op->opcode, x, y, swapped, unique, values_.data ());
+  else
+#endif
+    fillPairs (op->opcode, x, y, swapped, unique, values_.data ());
+  return true;
+  //////////////////////////////////////////////////////////////////////////////
 }
 
+#pragma GCC pop_options
+
 bool
-ValueLookupTree::insertUnaryPrefixOperator (const string &s, Node * const tree, const vector<string> &operators, const vector<string> &vetoOperators) const
+ValueLookupTree::registerPrecompiled (const string &expression, vector<string> inputCollections, Precompiled function)
 {
-  bool foundAnOperator = false;
-  double x;
+  sort (inputCollections.begin (), inputCollections.end ());
+  ExpressionCache &expressions = expressionCache ();
+  lock_guard<mutex> guard (expressions.lock);
+  expressions.precompiled[make_pair (expression, inputCollections)] = function;
+  return true;
+}
 
+bool
+ValueLookupTree::loadPrecompiled (const string &library)
+{
   //////////////////////////////////////////////////////////////////////////////
-  // If the string is a number, then simply return false;
+  // Loads the library holding the generated code, whose functions register
+  // themselves as soon as it is loaded. Each library is only tried once per
+  // job, and if it cannot be found, the expressions are interpreted as usual.
   //////////////////////////////////////////////////////////////////////////////
-  if (isnumber (s, x))
-    return foundAnOperator;
+  if (library == "")
+    return false;
+  {
+    ExpressionCache &expressions = expressionCache ();
+    lock_guard<mutex> guard (expressions.lock);
+    if (expressions.libraries.count (library))
+      return (expressions.libraries.at (library) != NULL);
+  }
+  // loaded without the lock, since its registrations take it
+  void *handle = dlopen (library.c_str (), RTLD_NOW | RTLD_GLOBAL);
+  if (!handle)
+    clog << "WARNING: precompiled code was requested from " << library << ", but it could not be loaded (" << dlerror () << "). All expressions will be interpreted." << endl;
+  {
+    ExpressionCache &expressions = expressionCache ();
+    lock_guard<mutex> guard (expressions.lock);
+    expressions.libraries[library] = handle;
+  }
+  return (handle != NULL);
   //////////////////////////////////////////////////////////////////////////////
+}
+
+void
+ValueLookupTree::requestCode (const string &fileName)
+{
+  if (fileName == "")
+    return;
+  ExpressionCache &expressions = expressionCache ();
+  lock_guard<mutex> guard (expressions.lock);
+  expressions.codeRequests[fileName]++;
+}
+
+void
+ValueLookupTree::releaseCode (const string &fileName)
+{
+  //////////////////////////////////////////////////////////////////////////////
+  // The file is only written once per job, by the last module to release it,
+  // when every expression of the job has been compiled.
+  //////////////////////////////////////////////////////////////////////////////
+  if (fileName == "")
+    return;
+  {
+    ExpressionCache &expressions = expressionCache ();
+    lock_guard<mutex> guard (expressions.lock);
+    auto requests = expressions.codeRequests.find (fileName);
+    if (requests == expressions.codeRequests.end () || !requests->second || --requests->second)
+      return;
+  }
+  generateCode (fileName);
+  //////////////////////////////////////////////////////////////////////////////
+}
 
+void
+ValueLookupTree::generateCode (const string &fileName)
+{
   //////////////////////////////////////////////////////////////////////////////
-  // For each operator which is found in the string, split the string into a
-  // left and right substring. The right substring is inserted into the tree and
-  // stored as a branch for the operator's node.
+  // Writes a C++ source file with a function for each expression compiled so
+  // far in the process, followed by the calls which register these functions
+  // when the library they are compiled into is loaded. Expressions which
+  // depend on more than the objects themselves, i.e., which contain number(),
+  // trigobjDeltaR(), user variables, event variables, or members without
+  // direct accessors, are left to the interpreter.
   //////////////////////////////////////////////////////////////////////////////
-  for (auto i = findLastOf (s, operators, vetoOperators); !foundAnOperator && i.first != string::npos; i = i.first ? findLastOf (s, operators, vetoOperators, i.first - 1) : make_pair (string::npos, ""))
+  ExpressionCache &expressions = expressionCache ();
+  lock_guard<mutex> guard (expressions.lock);
+
+  stringstream functions, registrations;
+  unsigned nFunctions = 0;
+  for (const auto &compiled : expressions.compiled)
     {
-      string left, right;
-      left = s.substr (0, i.first);
-      right = s.substr (i.first + i.second.length ());
-      if (!splitParentheses (left) && !splitParentheses (right))
-        {
-          anatools::trim (right);
-          tree->value = i.second;
-          tree->branches.push_back (insert_ (right, tree));
-          foundAnOperator = true;
-        }
+      string name = "expression" + to_string (nFunctions);
+      if (!generateFunction (compiled.second.program, compiled.second.stackSize, name, functions))
+        continue;
+      nFunctions++;
+
+      string expression;
+      for (const auto &c : compiled.first.first)
+        expression += string (c == '"' || c == '\\' ? "\\" : "") + c;
+      registrations << "    && ValueLookupTree::registerPrecompiled (\"" << expression << "\", {";
+      for (const auto &collection : compiled.first.second)
+        registrations << (&collection != &compiled.first.second.front () ? ", " : "") << "\"" << collection << "\"";
+      registrations << "}, " << name << ")" << endl;
     }
-  //////////////////////////////////////////////////////////////////////////////
 
-  return foundAnOperator;
+  ofstream fout (fileName.c_str ());
+  fout << "// Generated by ValueLookupTree::generateCode (). Do not edit." << endl << endl
+       << "#include <cmath>" << endl << endl
+       << "#include \"DataFormats/Math/interface/deltaR.h\"" << endl << endl
+       << "#include \"OSUT3Analysis/AnaTools/interface/ValueLookupTree.h\"" << endl << endl
+       << "namespace" << endl << "{" << endl
+       << functions.str ()
+       << "  const bool registered = true" << endl
+       << registrations.str ()
+       << "    ;" << endl
+       << "}" << endl;
+  fout.close ();
+  clog << "Wrote " << nFunctions << " precompiled expressions to " << fileName << "." << endl;
+  //////////////////////////////////////////////////////////////////////////////
 }
 
 bool
-ValueLookupTree::insertDots (const string &s, Node * const tree) const
+ValueLookupTree::generateFunction (const vector<Instruction> &program, const unsigned stackSize, const string &name, ostream &code)
 {
-  bool foundAnOperator = false;
-  double x;
-  //////////////////////////////////////////////////////////////////////////////
-  // If the string is a number, then simply return false;
-  //////////////////////////////////////////////////////////////////////////////
-  if (isnumber (s, x))
-    return false;
   //////////////////////////////////////////////////////////////////////////////
+  // Translates a compiled program into straight-line C++, with the stack
+  // becoming a local array whose indices are all known when generating, and
+  // the jumps becoming gotos. Returns false if the program cannot be
+  // translated.
+  //////////////////////////////////////////////////////////////////////////////
+  static const map<Opcode, string> infixOperators = {
+    {Opcode::Or, "||"}, {Opcode::And, "&&"}, {Opcode::Equal, "=="}, {Opcode::NotEqual, "!="},
+    {Opcode::Less, "<"}, {Opcode::LessEqual, "<="}, {Opcode::Greater, ">"}, {Opcode::GreaterEqual, ">="},
+    {Opcode::Add, "+"}, {Opcode::Subtract, "-"}, {Opcode::Multiply, "*"}, {Opcode::Divide, "/"}
+  };
+  static const map<Opcode, string> functions = {
+    {Opcode::Atan2, "atan2"}, {Opcode::Ldexp, "ldexp"}, {Opcode::Pow, "pow"}, {Opcode::Hypot, "hypot"},
+    {Opcode::Fmod, "fmod"}, {Opcode::Remainder, "remainder"}, {Opcode::Copysign, "copysign"}, {Opcode::Nextafter, "nextafter"},
+    {Opcode::Fdim, "fdim"}, {Opcode::Fmax, "fmax"}, {Opcode::Fmin, "fmin"},
+    {Opcode::Cos, "cos"}, {Opcode::Sin, "sin"}, {Opcode::Tan, "tan"}, {Opcode::Acos, "acos"}, {Opcode::Asin, "asin"}, {Opcode::Atan, "atan"},
+    {Opcode::Cosh, "cosh"}, {Opcode::Sinh, "sinh"}, {Opcode::Tanh, "tanh"}, {Opcode::Acosh, "acosh"}, {Opcode::Asinh, "asinh"}, {Opcode::Atanh, "atanh"},
+    {Opcode::Exp, "exp"}, {Opcode::Log, "log"}, {Opcode::Log10, "log10"}, {Opcode::Exp2, "exp2"}, {Opcode::Expm1, "expm1"}, {Opcode::Ilogb, "ilogb"},
+    {Opcode::Log1p, "log1p"}, {Opcode::Log2, "log2"}, {Opcode::Logb, "logb"}, {Opcode::Sqrt, "sqrt"}, {Opcode::Cbrt, "cbrt"},
+    {Opcode::Erf, "erf"}, {Opcode::Erfc, "erfc"}, {Opcode::Tgamma, "tgamma"}, {Opcode::Lgamma, "lgamma"}, {Opcode::Ceil, "ceil"}, {Opcode::Floor, "floor"},
+    {Opcode::Trunc, "trunc"}, {Opcode::Round, "round"}, {Opcode::Rint, "rint"}, {Opcode::Nearbyint, "nearbyint"}, {Opcode::Fabs, "fabs"},
+    {Opcode::DeltaPhi, "deltaPhi"}, {Opcode::DeltaR, "deltaR"}
+  };
+
+  set<unsigned> targets;
+  for (const auto &instruction : program)
+    {
+      if (instruction.opcode == Opcode::JumpIfFalse || instruction.opcode == Opcode::JumpIfTrue)
+        targets.insert (instruction.target);
+    }
 
-  //////////////////////////////////////////////////////////////////////////////
-  // For each operator which is found in the string, split the string into a
-  // left and right substring. These substrings are inserted into the tree and
-  // stored as branches for the operator's node.
-  //////////////////////////////////////////////////////////////////////////////
-  for (auto i = findFirstOf (s, {"."}, {}); !foundAnOperator && i.first != string::npos; i = findFirstOf (s, {"."}, {}, i.first + i.second.length ()))
+  stringstream body;
+  body << setprecision (17);
+  unsigned top = 0;
+  for (unsigned i = 0; i < program.size (); i++)
     {
-      string left, right;
-      left = s.substr (0, i.first);
-      right = s.substr (i.first + i.second.length ());
-      if (!splitParentheses (left) && !splitParentheses (right))
+      const Instruction &instruction = program.at (i);
+      if (targets.count (i))
+        body << "      L" << i << ": ;" << endl;
+
+      string result = "s[" + to_string (top - instruction.nOperands) + "]";
+      vector<string> operands;
+      for (unsigned j = top - instruction.nOperands; j < top; j++)
+        operands.push_back ("s[" + to_string (j) + "]");
+
+      switch (instruction.opcode)
+        {
+          case Opcode::Constant:
+            body << "      s[" << top++ << "] = " << instruction.value << ";" << endl;
+            continue;
+          case Opcode::Lookup:
+          case Opcode::FourVectorLookup:
+            {
+              string member = anatools::getDirectExpression (instruction.type, instruction.variable);
+              if (member == "")
+                return false;
+              body << "      s[" << top++ << "] = ((const " << instruction.type << " *) objs[" << instruction.slot << "])->" << member << ";" << endl;
+            }
+            continue;
+          case Opcode::JumpIfFalse:
+          case Opcode::JumpIfTrue:
+            body << "      if (IS_INVALID(s[" << top - 1 << "])) goto L" << instruction.target << ";" << endl
+                 << "      if (" << (instruction.opcode == Opcode::JumpIfFalse ? "!" : "") << "s[" << top - 1 << "]) { s[" << top - 1 << "] = "
+                 << (instruction.opcode == Opcode::JumpIfTrue) << "; goto L" << instruction.target << "; }" << endl;
+            continue;
+          case Opcode::Load:
+          case Opcode::Store:
+            continue;
+          case Opcode::Invalid:
+          case Opcode::Number:
+          case Opcode::UservariableLookup:
+          case Opcode::EventvariableLookup:
+          case Opcode::TrigobjDeltaR:
+            return false;
+          default:
+            break;
+        }
+
+      string value;
+      if (infixOperators.count (instruction.opcode))
+        value = "(" + operands.at (0) + " " + infixOperators.at (instruction.opcode) + " " + operands.at (1) + ")";
+      else if (instruction.opcode == Opcode::Modulo)
+        value = "((int) " + operands.at (0) + " % (int) " + operands.at (1) + ")";
+      else if (instruction.opcode == Opcode::Positive || instruction.opcode == Opcode::Negative || instruction.opcode == Opcode::Not)
+        value = string (instruction.opcode == Opcode::Positive ? "+" : (instruction.opcode == Opcode::Negative ? "-" : "!")) + operands.at (0);
+      else if (functions.count (instruction.opcode))
         {
-          anatools::trim (left);
-          anatools::trim (right);
-
-          if (left == "" || right == "") continue;
-          tree->value = i.second;
-          tree->branches.push_back (insert_ (left, tree));
-          tree->branches.push_back (insert_ (right, tree));
-          foundAnOperator = true;
+          value = functions.at (instruction.opcode) + " (";
+          for (const auto &operand : operands)
+            value += (&operand != &operands.front () ? ", " : "") + operand;
+          value += ")";
         }
+      else if (instruction.opcode == Opcode::InvMass || instruction.opcode == Opcode::PT)
+        {
+          ////////////////////////////////////////////////////////////////////////
+          // The operands are (energy, px, py, pz) or (px, py) for each object.
+          ////////////////////////////////////////////////////////////////////////
+          unsigned stride = (instruction.opcode == Opcode::InvMass ? 4 : 2);
+          vector<string> sums (stride);
+          for (unsigned j = 0; j < operands.size (); j++)
+            sums.at (j % stride) += (j < stride ? "(" : " + ") + operands.at (j) + (j + stride >= operands.size () ? ")" : "");
+          if (stride == 4)
+            value = "sqrt (" + sums.at (0) + " * " + sums.at (0) + " - " + sums.at (1) + " * " + sums.at (1) + " - " + sums.at (2) + " * " + sums.at (2) + " - " + sums.at (3) + " * " + sums.at (3) + ")";
+          else
+            value = "hypot (" + sums.at (0) + ", " + sums.at (1) + ")";
+          ////////////////////////////////////////////////////////////////////////
+        }
+      else
+        return false;
+
+      string isInvalid;
+      for (const auto &operand : operands)
+        isInvalid += (&operand != &operands.front () ? " || " : "") + string ("IS_INVALID(") + operand + ")";
+      body << "      " << result << " = (" << isInvalid << ") ? INVALID_VALUE : " << value << ";" << endl;
+      top -= instruction.nOperands - 1;
     }
+  if (targets.count (program.size ()))
+    body << "      L" << program.size () << ": ;" << endl;
+
+  code << "  double" << endl
+       << "  " << name << " (const void * const * const objs)" << endl
+       << "  {" << endl
+       << "    double s[" << max (stackSize, 1u) << "];" << endl
+       << "    try" << endl
+       << "    {" << endl
+       << body.str ()
+       << "    }" << endl
+       << "    catch (...)" << endl
+       << "    {" << endl
+       << "      return INVALID_VALUE;" << endl
+       << "    }" << endl
+       << "    return " << (top ? "s[0]" : "INVALID_VALUE") << ";" << endl
+       << "  }" << endl << endl;
+  return true;
   //////////////////////////////////////////////////////////////////////////////
+}
+
+double
+ValueLookupTree::evaluateOperator (const Opcode op, const double * const operands, const unsigned nOperands) const
+{
+  // if any of the operands are invalid numeric values, do nothing and return
+  // an invalid numeric value
+  for (unsigned i = 0; i < nOperands; i++)
+    {
+      if (IS_INVALID(operands[i]))
+        return INVALID_VALUE;
+    }
+
+  switch (op)
+    {
+      case Opcode::Or:            return (operands[0] || operands[1]);
+      case Opcode::And:           return (operands[0] && operands[1]);
+      case Opcode::Equal:         return (operands[0] == operands[1]);
+      case Opcode::NotEqual:      return (operands[0] != operands[1]);
+      case Opcode::Less:          return (operands[0] < operands[1]);
+      case Opcode::LessEqual:     return (operands[0] <= operands[1]);
+      case Opcode::Greater:       return (operands[0] > operands[1]);
+      case Opcode::GreaterEqual:  return (operands[0] >= operands[1]);
+      case Opcode::Add:           return (operands[0] + operands[1]);
+      case Opcode::Subtract:      return (operands[0] - operands[1]);
+      case Opcode::Multiply:      return (operands[0] * operands[1]);
+      case Opcode::Divide:        return (operands[0] / operands[1]);
+      case Opcode::Modulo:        return ((int) operands[0] % (int) operands[1]);
+      case Opcode::Positive:      return +operands[0];
+      case Opcode::Negative:      return -operands[0];
+      case Opcode::Not:           return (!operands[0]);
+      case Opcode::Atan2:         return atan2 (operands[0], operands[1]);
+      case Opcode::Ldexp:         return ldexp (operands[0], operands[1]);
+      case Opcode::Pow:           return pow (operands[0], operands[1]);
+      case Opcode::Hypot:         return hypot (operands[0], operands[1]);
+      case Opcode::Fmod:          return fmod (operands[0], operands[1]);
+      case Opcode::Remainder:     return remainder (operands[0], operands[1]);
+      case Opcode::Copysign:      return copysign (operands[0], operands[1]);
+      case Opcode::Nextafter:     return nextafter (operands[0], operands[1]);
+      case Opcode::Fdim:          return fdim (operands[0], operands[1]);
+      case Opcode::Fmax:          return fmax (operands[0], operands[1]);
+      case Opcode::Fmin:          return fmin (operands[0], operands[1]);
+      case Opcode::Cos:           return cos (operands[0]);
+      case Opcode::Sin:           return sin (operands[0]);
+      case Opcode::Tan:           return tan (operands[0]);
+      case Opcode::Acos:          return acos (operands[0]);
+      case Opcode::Asin:          return asin (operands[0]);
+      case Opcode::Atan:          return atan (operands[0]);
+      case Opcode::Cosh:          return cosh (operands[0]);
+      case Opcode::Sinh:          return sinh (operands[0]);
+      case Opcode::Tanh:          return tanh (operands[0]);
+      case Opcode::Acosh:         return acosh (operands[0]);
+      case Opcode::Asinh:         return asinh (operands[0]);
+      case Opcode::Atanh:         return atanh (operands[0]);
+      case Opcode::Exp:           return exp (operands[0]);
+      case Opcode::Log:           return log (operands[0]);
+      case Opcode::Log10:         return log10 (operands[0]);
+      case Opcode::Exp2:          return exp2 (operands[0]);
+      case Opcode::Expm1:         return expm1 (operands[0]);
+      case Opcode::Ilogb:         return ilogb (operands[0]);
+      case Opcode::Log1p:         return log1p (operands[0]);
+      case Opcode::Log2:          return log2 (operands[0]);
+      case Opcode::Logb:          return logb (operands[0]);
+      case Opcode::Sqrt:          return sqrt (operands[0]);
+      case Opcode::Cbrt:          return cbrt (operands[0]);
+      case Opcode::Erf:           return erf (operands[0]);
+      case Opcode::Erfc:          return erfc (operands[0]);
+      case Opcode::Tgamma:        return tgamma (operands[0]);
+      case Opcode::Lgamma:        return lgamma (operands[0]);
+      case Opcode::Ceil:          return ceil (operands[0]);
+      case Opcode::Floor:         return floor (operands[0]);
+      case Opcode::Trunc:         return trunc (operands[0]);
+      case Opcode::Round:         return round (operands[0]);
+      case Opcode::Rint:          return rint (operands[0]);
+      case Opcode::Nearbyint:     return nearbyint (operands[0]);
+      case Opcode::Fabs:          return fabs (operands[0]);
+
+      // operands are (phi) for each of two objects
+      case Opcode::DeltaPhi:      return deltaPhi (operands[0], operands[1]);
+
+      // operands are (eta, phi) for each of two objects
+      case Opcode::DeltaR:        return deltaR (operands[0], operands[1], operands[2], operands[3]);
+
+      // operands are (energy, px, py, pz) for each object
+      case Opcode::InvMass:
+        {
+          double energy = 0.0, px = 0.0, py = 0.0, pz = 0.0;
+          for (unsigned i = 0; i < nOperands; i += 4)
+            {
+              energy += operands[i];
+              px += operands[i + 1];
+              py += operands[i + 2];
+              pz += operands[i + 3];
+            }
+          return sqrt (energy * energy - px * px - py * py - pz * pz);
+        }
+
+      // operands are (px, py) for each object
+      case Opcode::PT:
+        {
+          double px = 0.0, py = 0.0;
+          for (unsigned i = 0; i < nOperands; i += 2)
+            {
+              px += operands[i];
+              py += operands[i + 1];
+            }
+          return hypot (px, py);
+        }
 
-  return foundAnOperator;
+      default:
+        break;
+    }
+  return INVALID_VALUE;
 }
 
-bool
-ValueLookupTree::insertParentheses (const string &s, Node * const tree) const
+void
+ValueLookupTree::getObjects (const unsigned id, vector<void *> &objects)
 {
   //////////////////////////////////////////////////////////////////////////////
-  // Look for the first left parenthesis and the last right parenthesis and
-  // simply return false if both are not found.
+  // Fills the second argument with the addresses of all the objects in the
+  // collection with the given id. For the user and event variables, the only
+  // object is the structure holding their values for the event.
   //////////////////////////////////////////////////////////////////////////////
-  size_t leftParenthesis = s.find ('('),
-         rightParenthesis = s.rfind (')');
-  if (leftParenthesis == string::npos || rightParenthesis == string::npos)
-    return false;
+  objects.clear ();
+  anatools::getCollectionRegistry ().at (id).getObjects (*handles_, objects);
   //////////////////////////////////////////////////////////////////////////////
+}
+
+string
+ValueLookupTree::getCollectionType (const string &name) const
+{
+  const vector<anatools::CollectionEntry> &collections = anatools::getCollectionRegistry ();
+  unsigned id = anatools::getCollectionId (name);
+  return (id < collections.size () ? collections.at (id).type : "");
+}
+
+bool
+ValueLookupTree::isCollection (const string &name) const
+{
+  return (anatools::getCollectionId (name) < anatools::getCollectionRegistry ().size ());
+}
 
+bool
+ValueLookupTree::isnumber (const string &s, double &x) const
+{
+  char *p;
+  x = strtod (s.c_str (), &p);
+  return !(*p);
+}
+
+double
+ValueLookupTree::trigobjDeltaR (const unsigned filter, const double eta, const double phi) const
+{
   //////////////////////////////////////////////////////////////////////////////
-  // Insert the substring between the parentheses into the tree and return
-  // true.
+  // Returns the distance from the given direction to the closest trigger
+  // object which passed the filter, which is the largest possible value if
+  // there is none, so that the object does not count as matched. The value is
+  // invalid if the trigger objects were not found.
   //////////////////////////////////////////////////////////////////////////////
-  string middle = s.substr (leftParenthesis + 1, rightParenthesis - leftParenthesis - 1);
-  anatools::trim (middle);
-  tree->value = "()";
-  tree->branches.push_back (insert_ (middle, tree));
-  return true;
+  if (!trigobjFourVectors_ || IS_INVALID(eta) || IS_INVALID(phi))
+    return INVALID_VALUE;
+
+  double minDeltaR = numeric_limits<double>::max ();
+  if (trigobjFilters_[filter])
+    {
+      for (const auto &i : *trigobjFilters_[filter])
+        minDeltaR = min (minDeltaR, deltaR (eta, phi, trigobjFourVectors_->eta[i], trigobjFourVectors_->phi[i]));
+    }
+  return minDeltaR;
   //////////////////////////////////////////////////////////////////////////////
 }
 
 double
-ValueLookupTree::valueLookup (const string &collection, const ObjMap &objs, const string &variable, const bool iterateObj)
+ValueLookupTree::valueLookup (const Instruction &instruction, const vector<void *> &objs) const
 {
-  if (!objIterators_.count (collection))
-    {
-      auto range = objs.equal_range (collection);
-      objIterators_[collection] = range.first;
-      shouldIterate_[collection] = (objs.count (collection) > 1);
-    }
-  else if (shouldIterate_.at (collection) && iterateObj)
-    objIterators_.at (collection)++;
-  void *obj = objIterators_.at (collection)->second.addr;
+  void *obj = objs.at (instruction.slot);
 
   try
     {
-      if (collection == "uservariables")
-        return 1; // FIXME
-      if (collection == "eventvariables")
-        return (((EventVariableProducerPayload *) obj)->at (variable));
-      return anatools::getMember (getCollectionType (collection), obj, variable);
+      if (instruction.opcode == Opcode::UservariableLookup)
+        {
+          //////////////////////////////////////////////////////////////////////
+          // The value is found in the column of the user variable from the
+          // local indices of the objects it depends on. Since both the
+          // collections of the column and inputCollections_ are sorted, they
+          // are matched in a single pass, with the copies of a collection
+          // matched in order.
+          //////////////////////////////////////////////////////////////////////
+          const vector<UservariableColumn> &uservariables = *((const vector<UservariableColumn> *) obj);
+          if (instruction.variableSlot >= uservariables.size () || !uservariables[instruction.variableSlot].values.size ())
+            return INVALID_VALUE;
+          const UservariableColumn &column = uservariables[instruction.variableSlot];
+          unsigned index = 0, k = 0;
+          for (unsigned j = 0; j < column.collections.size (); j++, k++)
+            {
+              while (k < inputCollections_.size () && inputCollections_[k] != column.collections[j])
+                k++;
+              if (k == inputCollections_.size ())
+                return INVALID_VALUE;
+              index += localIndices_[k] * column.strides[j];
+            }
+          return column.values[index];
+          //////////////////////////////////////////////////////////////////////
+        }
+      if (instruction.opcode == Opcode::EventvariableLookup)
+        {
+          const vector<double> &eventvariables = *((const vector<double> *) obj);
+          return (instruction.variableSlot < eventvariables.size () ? eventvariables[instruction.variableSlot] : INVALID_VALUE);
+        }
+      if (instruction.accessor)
+        return instruction.accessor (obj);
+      return anatools::getMember (instruction.type, obj, instruction.variable);
     }
   catch (...)
     {
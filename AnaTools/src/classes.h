@@ -27,6 +27,11 @@ namespace {
      edm::Wrapper<CutCalculatorPayload> CutCalculatorPayloadDummy2;
      edm::Wrapper<vector<CutCalculatorPayload> > CutCalculatorPayloadDummy3;
 
+     CutCalculatorConfiguration CutCalculatorConfigurationDummy0;
+     edm::Wrapper<CutCalculatorConfiguration> CutCalculatorConfigurationDummy1;
+
+     FlagMatrix FlagMatrixDummy0;
+
      Cut cutdummy0;
      edm::Wrapper<Cut> cutdummy1;
      vector<Cut> cutdummy2;
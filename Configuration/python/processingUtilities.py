@@ -198,6 +198,27 @@ def get_collections (cuts):
     return sorted (list (collections))
     ############################################################################
 
+def get_object_producer (process, objectProducer):
+    ############################################################################
+    # Return the label of an object producer with the same configuration as the
+    # given one, adding the given one to the process if there is none yet.
+    # Channels then take their objects from the same products, which lets the
+    # CutCalculator of each share the flags for the cuts they have in common.
+    # The producers are remembered separately for each process, so that a
+    # producer is never shared with a process it was not added to.
+    ############################################################################
+    if not hasattr (add_channels, "objectProducers"):
+        add_channels.objectProducers = {}
+    objectProducers = add_channels.objectProducers.setdefault (process, {})
+    configuration = objectProducer.dumpPython ()
+    if configuration not in objectProducers or not hasattr (process, objectProducers[configuration]):
+        label = "objectProducer" + str (add_channels.producerIndex)
+        setattr (process, label, objectProducer)
+        objectProducers[configuration] = label
+        add_channels.producerIndex += 1
+    return objectProducers[configuration]
+    ############################################################################
+
 
 
 #def add_channels (process, channels, histogramSets, weights, scalingfactorproducers, collections, variableProducers, skim = True):
@@ -423,9 +444,9 @@ def add_channels (process, channels, histogramSets = None, weights = None, scali
                         setattr (eventvariableCollections, collection,inputTag)
                         objectProducer = getattr (collectionProducer, collection).clone()
                         objectProducer.collections = eventvariableCollections
-                        channelPath += objectProducer
-                        setattr (process, "objectProducer" + str (add_channels.producerIndex), objectProducer)
-                        newInputTags.append(cms.InputTag ("objectProducer" + str (add_channels.producerIndex), inputTag.getProductInstanceLabel ()))
+                        objectProducerLabel = get_object_producer (process, objectProducer)
+                        channelPath += getattr (process, objectProducerLabel)
+                        newInputTags.append(cms.InputTag (objectProducerLabel, inputTag.getProductInstanceLabel ()))
                         if collection in cutCollections: 
                             dropCommand = "drop *_" + inputTag.getModuleLabel () + "_" + inputTag.getProductInstanceLabel () + "_"
                             if inputTag.getProcessName ():
@@ -434,16 +455,15 @@ def add_channels (process, channels, histogramSets = None, weights = None, scali
                                 dropCommand += "*"
                             outputCommands.append (dropCommand)
                         # if collection not in cutCollections:
-                        #     outputCommands.append ("keep *_objectProducer" + str (add_channels.producerIndex) + "_" + inputTag.getProductInstanceLabel () + "_" + process.name_ ())
-                        add_channels.producerIndex += 1
+                        #     outputCommands.append ("keep *_" + objectProducerLabel + "_" + inputTag.getProductInstanceLabel () + "_" + process.name_ ())
                     setattr (producedCollections, collection, newInputTags)
                 else:
                     objectProducer = getattr (collectionProducer, collection).clone()
                     objectProducer.collections = channels.collections
-                    channelPath += objectProducer
-                    setattr (process, "objectProducer" + str (add_channels.producerIndex), objectProducer)
+                    objectProducerLabel = get_object_producer (process, objectProducer)
+                    channelPath += getattr (process, objectProducerLabel)
                     originalInputTag = getattr (channels.collections, collection)
-                    setattr (producedCollections, collection, cms.InputTag ("objectProducer" + str (add_channels.producerIndex), originalInputTag.getProductInstanceLabel ()))
+                    setattr (producedCollections, collection, cms.InputTag (objectProducerLabel, originalInputTag.getProductInstanceLabel ()))
                     if collection in cutCollections:
                         dropCommand = "drop *_" + originalInputTag.getModuleLabel () + "_" + originalInputTag.getProductInstanceLabel () + "_"
                         if originalInputTag.getProcessName ():
@@ -452,8 +472,7 @@ def add_channels (process, channels, histogramSets = None, weights = None, scali
                             dropCommand += "*"
                         outputCommands.append (dropCommand)
                     # if collection not in cutCollections:
-                    #     outputCommands.append ("keep *_objectProducer" + str (add_channels.producerIndex) + "_" + originalInputTag.getProductInstanceLabel () + "_" + process.name_ ())
-                    add_channels.producerIndex += 1
+                    #     outputCommands.append ("keep *_" + objectProducerLabel + "_" + originalInputTag.getProductInstanceLabel () + "_" + process.name_ ())
             ########################################################################
     
             ########################################################################
@@ -801,9 +820,9 @@ def add_channels (process, channels, histogramSets = None, weights = None, scali
                         setattr (eventvariableCollections, collection,inputTag)
                         objectProducer = getattr (collectionProducer, collection).clone()
                         objectProducer.collections = eventvariableCollections
-                        channelPath += objectProducer
-                        setattr (process, "objectProducer" + str (add_channels.producerIndex), objectProducer)
-                        newInputTags.append(cms.InputTag ("objectProducer" + str (add_channels.producerIndex), inputTag.getProductInstanceLabel ()))
+                        objectProducerLabel = get_object_producer (process, objectProducer)
+                        channelPath += getattr (process, objectProducerLabel)
+                        newInputTags.append(cms.InputTag (objectProducerLabel, inputTag.getProductInstanceLabel ()))
                         if collection in cutCollections: 
                             dropCommand = "drop *_" + inputTag.getModuleLabel () + "_" + inputTag.getProductInstanceLabel () + "_"
                             if inputTag.getProcessName ():
@@ -812,16 +831,15 @@ def add_channels (process, channels, histogramSets = None, weights = None, scali
                                 dropCommand += "*"
                             outputCommands.append (dropCommand)
                         # if collection not in cutCollections:
-                        #     outputCommands.append ("keep *_objectProducer" + str (add_channels.producerIndex) + "_" + inputTag.getProductInstanceLabel () + "_" + process.name_ ())
-                        add_channels.producerIndex += 1
+                        #     outputCommands.append ("keep *_" + objectProducerLabel + "_" + inputTag.getProductInstanceLabel () + "_" + process.name_ ())
                     setattr (producedCollections, collection, newInputTags)
                 else:
                     objectProducer = getattr (collectionProducer, collection).clone()
                     objectProducer.collections = collections
-                    channelPath += objectProducer
-                    setattr (process, "objectProducer" + str (add_channels.producerIndex), objectProducer)
+                    objectProducerLabel = get_object_producer (process, objectProducer)
+                    channelPath += getattr (process, objectProducerLabel)
                     originalInputTag = getattr (collections, collection)
-                    setattr (producedCollections, collection, cms.InputTag ("objectProducer" + str (add_channels.producerIndex), originalInputTag.getProductInstanceLabel ()))
+                    setattr (producedCollections, collection, cms.InputTag (objectProducerLabel, originalInputTag.getProductInstanceLabel ()))
                     if collection in cutCollections:
                         dropCommand = "drop *_" + originalInputTag.getModuleLabel () + "_" + originalInputTag.getProductInstanceLabel () + "_"
                         if originalInputTag.getProcessName ():
@@ -830,8 +848,7 @@ def add_channels (process, channels, histogramSets = None, weights = None, scali
                             dropCommand += "*"
                         outputCommands.append (dropCommand)
                     # if collection not in cutCollections:
-                    #     outputCommands.append ("keep *_objectProducer" + str (add_channels.producerIndex) + "_" + originalInputTag.getProductInstanceLabel () + "_" + process.name_ ())
-                    add_channels.producerIndex += 1
+                    #     outputCommands.append ("keep *_" + objectProducerLabel + "_" + originalInputTag.getProductInstanceLabel () + "_" + process.name_ ())
             ########################################################################
     
             ########################################################################